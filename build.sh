@@ -6,11 +6,15 @@ set -xe
 # -Wmissing-prototypes 检查未声明原型的函数
 CC=${CC:=/usr/bin/cc}
 CFLAGS="-Wall -Wextra -Wswitch-enum -Wmissing-prototypes -pedantic -std=c11"
-LIBS=
+LIBS=-lm
 
 $CC $CFLAGS -o lasm ./src/lasm.c $LIBS
-$CC $CFLAGS -o lvm ./src/lvm.c $LIBS
+$CC $CFLAGS -o lvm ./src/lvm.c $LIBS -ldl -pthread
 $CC $CFLAGS -o dlsm ./src/delasm.c $LIBS
+$CC $CFLAGS -o lopt ./src/lopt.c $LIBS -ldl -pthread
+$CC $CFLAGS -o lbench ./src/lbench.c $LIBS -pthread
+$CC $CFLAGS -o lvmd ./src/lvmd.c $LIBS -pthread
+$CC $CFLAGS -shared -fPIC -o examples/fmath.so ./examples/fmath.c $LIBS
 
 for example in `find examples/ -name \*.lasm | sed "s/\.lasm//"`; do
     cpp -P "$example.lasm" > "$example.lasm.pp"
@@ -0,0 +1,38 @@
+// Example native plugin: build with
+//   cc -shared -fPIC -o examples/fmath.so examples/fmath.c -lm
+// and run with
+//   ./lvm --plugin ./examples/fmath.so -i examples/sqrt.lvm
+#include <math.h>
+#include "../src/lvm_plugin.h"
+
+static Err fmath_sqrt(Word *args)
+{
+  args[0].as_f64 = sqrt(args[0].as_f64);
+  return ERR_OK;
+}
+
+static Err fmath_pow(Word *args)
+{
+  args[0].as_f64 = pow(args[0].as_f64, args[1].as_f64);
+  return ERR_OK;
+}
+
+static Err fmath_sincos(Word *args)
+{
+  const double x = args[0].as_f64;
+  args[0].as_f64 = sin(x);
+  args[1].as_f64 = cos(x);
+  return ERR_OK;
+}
+
+static const LVM_Plugin_Def fmath_natives[] = {
+  {"sqrt",   fmath_sqrt,   1, 1},
+  {"pow",    fmath_pow,    2, 1},
+  {"sincos", fmath_sincos, 1, 2},
+};
+
+const LVM_Plugin lvm_plugin = {
+  .abi_version = LVM_PLUGIN_ABI_VERSION,
+  .natives_size = sizeof(fmath_natives) / sizeof(fmath_natives[0]),
+  .natives = fmath_natives,
+};
@@ -2,20 +2,183 @@
 #include "./lvm.h"
 
 //LVM lvm = {0};
+LVM_Trace trace = {0};
+
+#define DLSM_DEFAULT_TRACE_COUNT 32
+#define DLSM_MAX_TRACE_COUNT (64 * 1024)
+
+// One decoded instruction: `entry` is the recorded transfer it is, or NULL
+// for an instruction recovered from the straight-line run before one.
+typedef struct {
+    Inst_Addr pc;
+    const LVM_Trace_Entry *entry;
+} Trace_Line;
+
+Trace_Line *lines = NULL;
+uint64_t lines_count = 0;
+uint64_t lines_capacity = 0;
+
+static void usage(FILE *stream)
+{
+    fprintf(stream, "Usage: ./delsm <input.lvm> [-t <file.trace>] [-n <count>]\n");
+    fprintf(stream, "  -t  print the instructions that led to the end of a trace of this program\n");
+    fprintf(stream, "  -n  how many of the last instructions (default %d)\n", DLSM_DEFAULT_TRACE_COUNT);
+}
+
+static void push_line(Inst_Addr pc, const LVM_Trace_Entry *entry)
+{
+    lines[lines_count++ % lines_capacity] = (Trace_Line) {pc, entry};
+}
+
+static void print_location(Inst_Addr addr)
+{
+    char location[LVM_SYMBOL_NAME_CAPACITY + 32];
+    const LVM_Symbol *symbol = lvm_find_symbol(&lvm, addr);
+    if (symbol == NULL) {
+        snprintf(location, sizeof(location), "-");
+    } else if (symbol->addr == addr) {
+        snprintf(location, sizeof(location), "%s", symbol->name);
+    } else {
+        snprintf(location, sizeof(location), "%s+%" PRIu64, symbol->name, addr - symbol->addr);
+    }
+    printf("%-24s", location);
+}
+
+static void print_line(const Trace_Line *line)
+{
+    if (line->pc == (Inst_Addr) -1) {
+        printf("  ...    (not recorded)\n");
+        return;
+    }
+
+    printf("  %-6" PRIu64 " ", line->pc);
+    print_location(line->pc);
+
+    char instruction[64];
+    const char *prefix = line->entry != NULL && (line->entry->type & LVM_TRACE_BLOCK) ? "[block] " : "";
+    if (line->pc >= lvm.program_size) {
+        snprintf(instruction, sizeof(instruction), "<outside of the program>");
+    } else if (inst_has_operand(lvm.program[line->pc].type)) {
+        snprintf(instruction, sizeof(instruction), "%s%s %" PRIu64, prefix,
+                 inst_name(lvm.program[line->pc].type), lvm.program[line->pc].operand.as_u64);
+    } else {
+        snprintf(instruction, sizeof(instruction), "%s%s", prefix, inst_name(lvm.program[line->pc].type));
+    }
+    printf(" %-24s", instruction);
+
+    if (line->entry != NULL) {
+        char top[32] = "";
+        if (line->entry->stack_size > 0) {
+            snprintf(top, sizeof(top), "%" PRIu64, line->entry->top);
+        }
+        printf(" %-6" PRIu32 " %-20s", line->entry->stack_size, top);
+        if (line->entry->type & LVM_TRACE_STOP) {
+            printf("  <- stopped here");
+        } else if (line->entry->next != line->pc + 1) {
+            printf("  -> %" PRIu32, line->entry->next);
+        }
+    }
+    printf("\n");
+}
+
+// Only transfers are recorded, so the instructions between one entry's
+// `next` and the following entry's `pc` are filled in from the program.
+static void print_trace(uint64_t count)
+{
+    const uint64_t recorded = trace.count < LVM_TRACE_CAPACITY ? trace.count : LVM_TRACE_CAPACITY;
+    if (count > DLSM_MAX_TRACE_COUNT) {
+        count = DLSM_MAX_TRACE_COUNT;
+    }
+    lines_capacity = count > 0 ? count : 1;
+    lines = malloc(sizeof(lines[0]) * lines_capacity);
+    assert(lines != NULL);
+
+    for (uint64_t i = trace.count - recorded; i < trace.count; ++i) {
+        const LVM_Trace_Entry *entry = &trace.entries[i & (LVM_TRACE_CAPACITY - 1)];
+        if (i > trace.count - recorded) {
+            const LVM_Trace_Entry *prev = &trace.entries[(i - 1) & (LVM_TRACE_CAPACITY - 1)];
+            Inst_Addr pc = prev->next;
+            while (pc < entry->pc && pc < lvm.program_size) {
+                push_line(pc++, NULL);
+            }
+            if (pc != entry->pc) {
+                push_line((Inst_Addr) -1, NULL);
+            }
+        }
+        push_line(entry->pc, entry);
+    }
+
+    const uint64_t shown = lines_count < count ? lines_count : count;
+    printf("; last %" PRIu64 " instructions, from %" PRIu64 " recorded transfers, ", shown, trace.count);
+    if (trace.reason & LVM_TRACE_SIGNAL) {
+        printf("stopped by signal %" PRIu32 "\n", trace.reason & ~(uint32_t) LVM_TRACE_SIGNAL);
+    } else {
+        printf("stopped by %s\n", err_as_cstr((Err) trace.reason));
+    }
+    printf("; %-6s %-24s %-24s %-6s %s\n", "pc", "location", "instruction", "depth", "top");
+
+    for (uint64_t i = lines_count - shown; i < lines_count; ++i) {
+        print_line(&lines[i % lines_capacity]);
+    }
+    free(lines);
+}
 
 int main(int argc, char *argv[])
 {
     if (argc < 2) {
-        fprintf(stderr, "Usage: ./delsm <input.lvm>\n");
+        usage(stderr);
         fprintf(stderr, "ERROR: no input is provided\n");
         exit(1);
     }
 
     const char *input_file_path = argv[1];
+    const char *trace_file_path = NULL;
+    uint64_t trace_count = DLSM_DEFAULT_TRACE_COUNT;
+
+    for (int i = 2; i < argc; ++i) {
+        if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-n") == 0) && i + 1 < argc) {
+            if (argv[i][1] == 't') {
+                trace_file_path = argv[i + 1];
+            } else {
+                trace_count = strtoull(argv[i + 1], NULL, 10);
+            }
+            i += 1;
+        } else {
+            usage(stderr);
+            fprintf(stderr, "ERROR: unexpected argument `%s`\n", argv[i]);
+            exit(1);
+        }
+    }
 
     lvm_load_program_from_file(&lvm, input_file_path);
 
+    if (trace_file_path != NULL) {
+        lvm_trace_load(&trace, trace_file_path);
+        print_trace(trace_count);
+        return 0;
+    }
+
+    for (size_t i = 0; i < lvm.natives_size; ++i) {
+      printf("%%native %s\n", lvm.natives[i].name);
+    }
+
+    for (Memory_Addr addr = 0; addr < lvm.data_size; addr += 16) {
+      printf("%%byte data_%" PRIu64, addr);
+      for (Memory_Addr i = addr; i < addr + 16 && i < lvm.data_size; ++i) {
+        uint8_t byte;
+        lvm_memory_read(&lvm, i, &byte, 1);
+        printf(" %u", byte);
+      }
+      printf("\n");
+    }
+
     for (Inst_Addr i = 0; i < lvm.program_size; ++i) {
+      for (size_t j = 0; j < lvm.symbols_size; ++j) {
+        if (lvm.symbols[j].addr == i) {
+          printf("%s:\n", lvm.symbols[j].name);
+        }
+      }
+
       printf("%s", inst_name(lvm.program[i].type));
       if (inst_has_operand(lvm.program[i].type)) {
             printf(" %" PRIu64 "", lvm.program[i].operand.as_i64);
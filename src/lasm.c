@@ -1,6 +1,8 @@
 #include "./lvm.h"
+#include "./lvm_profile.h"
 
 Lasm lasm = {0};
+Lasm_Profile profile = {0};
 
 char *shift(int *argc, char ***argv);
 void usage(FILE *stream, const char *program);
@@ -16,13 +18,25 @@ char *shift(int *argc, char ***argv)
 
 void usage(FILE *stream, const char *program)
 {
-  fprintf(stream, "Usage: %s <input.lasm> <output.lvm>\n",program);
+  fprintf(stream, "Usage: %s [--profile <file>] <input.lasm> <output.lvm>\n",program);
+  fprintf(stream, "  --profile  lay the blocks out by a profile written by lvm --profile\n");
 }
 
 
 int main(int argc, char **argv)
 {
   const char* program = shift(&argc, &argv);
+  const char *profile_file_path = NULL;
+
+  if (argc > 0 && strcmp(*argv, "--profile") == 0) {
+    shift(&argc, &argv);
+    if (argc == 0) {
+      usage(stderr, program);
+      fprintf(stderr, "ERROR: No argument is provided for flag `--profile`\n");
+      exit(1);
+    }
+    profile_file_path = shift(&argc, &argv);
+  }
 
   if (argc == 0) {
     usage(stderr, program);
@@ -41,6 +55,11 @@ int main(int argc, char **argv)
 
   lasm_translate_source(&lvm,&lasm,cstr_as_sv(input_file_path),0);
 
+  if (profile_file_path != NULL) {
+    lasm_profile_load(&lasm, &profile, profile_file_path);
+    lasm_layout(&lvm, &lasm, &profile);
+  }
+
   lvm_save_program_to_file(&lvm, output_file_path);
 
   return 0;
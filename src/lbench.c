@@ -0,0 +1,469 @@
+#define _POSIX_C_SOURCE 200809L
+#include "./lvm.h"
+#include "./lvm_reg.h"
+#include "./lvm_io.h"
+#include "./lvm_parallel.h"
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Benchmark driver. Every kernel runs on the stack interpreter and on the
+// register engine, each in its own process so the peak RSS belongs to that
+// run alone. Output natives are replaced by sinks that fold their input
+// into a checksum, so kernels measure the VM and not the terminal, and the
+// two engines can be checked against each other.
+
+#define BENCH_CAPACITY 128
+#define BENCH_NAME_CAPACITY 64
+#define BENCH_DEFAULT_RUNS 3
+#define BENCH_ASM_ROUNDS 200
+#define BENCH_REGRESSION_PERCENT 5.0
+
+typedef struct {
+  char name[BENCH_NAME_CAPACITY];
+  char engine[BENCH_NAME_CAPACITY];
+  // instructions dispatched, or lines assembled
+  uint64_t units;
+  double secs;
+  long peak_rss_kb;
+  uint64_t checksum;
+  Err err;
+} Bench_Result;
+
+typedef enum {
+  BENCH_STACK = 0,
+  BENCH_REG,
+} Bench_Engine;
+
+LVM_Native_Table natives = {0};
+Reg_Program reg_program = {0};
+Lasm lasm = {0};
+LVM bench_vm = {0};
+uint64_t bench_checksum = 0;
+
+Bench_Result results[BENCH_CAPACITY];
+size_t results_size = 0;
+Bench_Result baseline[BENCH_CAPACITY];
+size_t baseline_size = 0;
+
+char *shift(int *argc, char ***argv);
+void usage(FILE *stream, const char *program);
+
+char *shift(int *argc, char ***argv)
+{
+  assert(*argc > 0);
+  char *result = **argv;
+  *argv += 1;
+  *argc -= 1;
+  return result;
+}
+
+void usage(FILE *stream, const char *program)
+{
+  fprintf(stream, "Usage: %s [-o <results.tsv>] [-b <baseline.tsv>] [-r <runs>] <kernel.lvm>...\n", program);
+  fprintf(stream, "  -o  write the results as TSV\n");
+  fprintf(stream, "  -b  compare against results saved by an earlier run\n");
+  fprintf(stream, "  -r  best of how many runs (default %d)\n", BENCH_DEFAULT_RUNS);
+}
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static long bench_peak_rss_kb(void)
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0) {
+    return 0;
+  }
+  return usage.ru_maxrss;
+}
+
+static Err bench_sink(LVM *lvm)
+{
+  if (lvm->stack_size < 1) {
+    return ERR_STACK_UNDERFLOW;
+  }
+  bench_checksum = bench_checksum * 31 + lvm->stack[lvm->stack_size - 1].as_u64;
+  lvm->stack_size -= 1;
+  return ERR_OK;
+}
+
+static Err bench_sink_memory(LVM *lvm)
+{
+  if (lvm->stack_size < 2) {
+    return ERR_STACK_UNDERFLOW;
+  }
+
+  Memory_Addr addr = lvm->stack[lvm->stack_size - 2].as_u64;
+  uint64_t count = lvm->stack[lvm->stack_size - 1].as_u64;
+  if (!lvm_memory_contains(lvm, addr, count)) {
+    return ERR_ILLEGAL_MEMORY_ACCESS;
+  }
+
+  for (uint64_t i = 0; i < count; ++i) {
+    uint8_t byte = 0;
+    const Err err = lvm_memory_read(lvm, addr + i, &byte, 1);
+    if (err != ERR_OK) {
+      return err;
+    }
+    bench_checksum = bench_checksum * 31 + byte;
+  }
+  lvm->stack_size -= 2;
+  return ERR_OK;
+}
+
+static void bench_name(char *output, const char *file_path)
+{
+  const char *base = strrchr(file_path, '/');
+  base = base == NULL ? file_path : base + 1;
+  size_t n = strcspn(base, ".");
+  if (n >= BENCH_NAME_CAPACITY) {
+    n = BENCH_NAME_CAPACITY - 1;
+  }
+  memcpy(output, base, n);
+  output[n] = '\0';
+}
+
+static Err bench_execute(LVM *vm, Bench_Engine engine)
+{
+  if (engine == BENCH_REG) {
+    return lvm_reg_execute_program(vm, &reg_program, -1);
+  }
+  return lvm_execute_program(vm, -1);
+}
+
+static Bench_Result bench_kernel(const char *file_path, Bench_Engine engine, int runs)
+{
+  static LVM vm;
+  Bench_Result result = {0};
+  bench_name(result.name, file_path);
+  strcpy(result.engine, engine == BENCH_REG ? "reg" : "stack");
+
+  lvm_load_program_from_file(&bench_vm, file_path);
+  lvm_link_natives(&bench_vm, &natives);
+  if (engine == BENCH_REG) {
+    lvm_reg_translate(&bench_vm, &reg_program);
+  } else {
+    lvm_quicken(&bench_vm);
+  }
+
+  // the first run counts the dispatches and takes the checksum, the timed
+  // runs go through the same entry points as lvm itself
+  lvm_memory_release(&vm);
+  lvm_fork(&vm, &bench_vm);
+  bench_checksum = 0;
+  while (!vm.halt) {
+    result.err = lvm_execute_inst(&vm);
+    if (result.err != ERR_OK) {
+      return result;
+    }
+    result.units += 1;
+  }
+  if (engine == BENCH_REG) {
+    lvm_memory_release(&vm);
+    lvm_fork(&vm, &bench_vm);
+    bench_checksum = 0;
+    result.err = bench_execute(&vm, engine);
+    if (result.err != ERR_OK) {
+      return result;
+    }
+  }
+  result.checksum = bench_checksum;
+
+  for (int i = 0; i < runs; ++i) {
+    lvm_memory_release(&vm);
+    lvm_fork(&vm, &bench_vm);
+    const double start = bench_now();
+    result.err = bench_execute(&vm, engine);
+    const double secs = bench_now() - start;
+    if (result.err != ERR_OK) {
+      return result;
+    }
+    if (i == 0 || secs < result.secs) {
+      result.secs = secs;
+    }
+  }
+
+  return result;
+}
+
+// A large source touching every part of the assembler: labels, forward
+// jumps, integer and float literals, comments and blank lines.
+static size_t bench_generate_source(const char *file_path)
+{
+  FILE *f = fopen(file_path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not write file `%s`: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+
+  size_t lines = 0;
+  size_t insts = 0;
+  fprintf(f, "%%label N 1000\n");
+  lines += 1;
+  for (size_t block = 0; insts + 8 < LVM_PROGRAM_CAPACITY; ++block) {
+    fprintf(f, "; block %zu\n", block);
+    fprintf(f, "l%zu:\n", block);
+    fprintf(f, "    push %zu\n", block);
+    fprintf(f, "    push %zu.5\n", block);
+    fprintf(f, "    swap 1\n");
+    fprintf(f, "    push N\n");
+    fprintf(f, "    plusi\n");
+    fprintf(f, "    drop\n");
+    fprintf(f, "    drop\n");
+    fprintf(f, "    jmp l%zu\n", block + 1);
+    fprintf(f, "\n");
+    lines += 11;
+    insts += 8;
+  }
+  fprintf(f, "l%zu:\n", insts / 8);
+  fprintf(f, "    halt\n");
+  lines += 2;
+
+  fclose(f);
+  return lines;
+}
+
+static Bench_Result bench_assembler(int runs)
+{
+  static LVM vm;
+  Bench_Result result = {0};
+  strcpy(result.name, "lasm");
+  strcpy(result.engine, "lasm");
+
+  char file_path[] = "/tmp/lbench-XXXXXX";
+  int fd = mkstemp(file_path);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not create a temporary file: %s\n", strerror(errno));
+    exit(1);
+  }
+  close(fd);
+  const size_t lines = bench_generate_source(file_path);
+
+  for (int i = 0; i < runs; ++i) {
+    const double start = bench_now();
+    for (int round = 0; round < BENCH_ASM_ROUNDS; ++round) {
+      lasm.labels_size = 0;
+      lasm.defered_operands_size = 0;
+      lasm.memory_size = 0;
+      vm.natives_size = 0;
+      vm.symbols_size = 0;
+      vm.data_size = 0;
+      lasm_translate_source(&vm, &lasm, cstr_as_sv(file_path), 0);
+    }
+    const double secs = bench_now() - start;
+    if (i == 0 || secs < result.secs) {
+      result.secs = secs;
+    }
+  }
+
+  unlink(file_path);
+  result.units = (uint64_t) lines * BENCH_ASM_ROUNDS;
+  result.checksum = vm.program_size;
+  return result;
+}
+
+// Runs one benchmark in a child process and collects its result.
+static Bench_Result bench_isolated(const char *file_path, Bench_Engine engine, int runs)
+{
+  int fds[2];
+  if (pipe(fds) < 0) {
+    fprintf(stderr, "ERROR: Could not create a pipe: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "ERROR: Could not fork: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    Bench_Result result = file_path == NULL
+      ? bench_assembler(runs)
+      : bench_kernel(file_path, engine, runs);
+    result.peak_rss_kb = bench_peak_rss_kb();
+    if (write(fds[1], &result, sizeof(result)) != (ssize_t) sizeof(result)) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  close(fds[1]);
+  Bench_Result result = {0};
+  const ssize_t n = read(fds[0], &result, sizeof(result));
+  close(fds[0]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (n != (ssize_t) sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "ERROR: benchmark `%s` did not finish\n",
+            file_path == NULL ? "lasm" : file_path);
+    exit(1);
+  }
+  return result;
+}
+
+static void bench_push_result(Bench_Result result)
+{
+  assert(results_size < BENCH_CAPACITY);
+  results[results_size++] = result;
+}
+
+static void bench_save_results(const char *file_path)
+{
+  FILE *f = fopen(file_path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not write file `%s`: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+
+  fprintf(f, "name\tengine\tunits\tseconds\tunits_per_sec\tns_per_unit\tpeak_rss_kb\tchecksum\n");
+  for (size_t i = 0; i < results_size; ++i) {
+    const Bench_Result *r = &results[i];
+    fprintf(f, "%s\t%s\t%" PRIu64 "\t%.6f\t%.0f\t%.3f\t%ld\t%" PRIu64 "\n",
+            r->name, r->engine, r->units, r->secs,
+            (double) r->units / r->secs, r->secs * 1e9 / (double) r->units,
+            r->peak_rss_kb, r->checksum);
+  }
+
+  fclose(f);
+}
+
+static void bench_load_baseline(const char *file_path)
+{
+  FILE *f = fopen(file_path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "INFO: no baseline at `%s`, run `make bench-baseline` to save one\n", file_path);
+    return;
+  }
+
+  char line[512];
+  while (fgets(line, sizeof(line), f) != NULL && baseline_size < BENCH_CAPACITY) {
+    Bench_Result *r = &baseline[baseline_size];
+    double units_per_sec, ns_per_unit;
+    if (sscanf(line, "%63s %63s %" SCNu64 " %lf %lf %lf %ld %" SCNu64,
+               r->name, r->engine, &r->units, &r->secs,
+               &units_per_sec, &ns_per_unit, &r->peak_rss_kb, &r->checksum) == 8) {
+      baseline_size += 1;
+    }
+  }
+
+  fclose(f);
+}
+
+static const Bench_Result *bench_find_baseline(const Bench_Result *r)
+{
+  for (size_t i = 0; i < baseline_size; ++i) {
+    if (strcmp(baseline[i].name, r->name) == 0 && strcmp(baseline[i].engine, r->engine) == 0) {
+      return &baseline[i];
+    }
+  }
+  return NULL;
+}
+
+static void bench_report(void)
+{
+  printf("%-12s %-6s %12s %10s %10s %s\n", "benchmark", "engine", "M/sec", "ns/unit", "rss KB", "vs baseline");
+  for (size_t i = 0; i < results_size; ++i) {
+    const Bench_Result *r = &results[i];
+    const double rate = (double) r->units / r->secs;
+    printf("%-12s %-6s %12.2f %10.3f %10ld", r->name, r->engine,
+           rate * 1e-6, r->secs * 1e9 / (double) r->units, r->peak_rss_kb);
+
+    const Bench_Result *base = bench_find_baseline(r);
+    if (base != NULL) {
+      const double delta = (rate / ((double) base->units / base->secs) - 1.0) * 100.0;
+      printf(" %+7.1f%%%s", delta, delta < -BENCH_REGRESSION_PERCENT ? " REGRESSION" : "");
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *program = shift(&argc, &argv);
+  const char *output_file_path = NULL;
+  const char *baseline_file_path = NULL;
+  const char *kernels[BENCH_CAPACITY];
+  size_t kernels_size = 0;
+  int runs = BENCH_DEFAULT_RUNS;
+
+  while (argc > 0) {
+    const char *flag = shift(&argc, &argv);
+    if (strcmp(flag, "-o") == 0 || strcmp(flag, "-b") == 0 || strcmp(flag, "-r") == 0) {
+      if (argc == 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: no argument provided for %s\n", flag);
+        exit(1);
+      }
+      const char *value = shift(&argc, &argv);
+      if (flag[1] == 'o') {
+        output_file_path = value;
+      } else if (flag[1] == 'b') {
+        baseline_file_path = value;
+      } else {
+        runs = atoi(value);
+        if (runs <= 0) {
+          fprintf(stderr, "ERROR: `%s` is not a valid number of runs\n", value);
+          exit(1);
+        }
+      }
+    } else if (strcmp(flag, "-h") == 0) {
+      usage(stdout, program);
+      exit(0);
+    } else if (*flag == '-') {
+      usage(stderr, program);
+      fprintf(stderr, "ERROR: unknown flag `%s`\n", flag);
+      exit(1);
+    } else {
+      assert(kernels_size < BENCH_CAPACITY / 2);
+      kernels[kernels_size++] = flag;
+    }
+  }
+
+  lvm_register_builtin_natives(&natives);
+  lvm_io_register_natives(&natives);
+  lvm_parallel_register_natives(&natives);
+  lvm_register_native(&natives, "print_f64",   bench_sink,        1, 0);
+  lvm_register_native(&natives, "print_i64",   bench_sink,        1, 0);
+  lvm_register_native(&natives, "print_u64",   bench_sink,        1, 0);
+  lvm_register_native(&natives, "print_ptr",   bench_sink,        1, 0);
+  lvm_register_native(&natives, "dump_memory", bench_sink_memory, 2, 0);
+
+  int exit_code = 0;
+  for (size_t i = 0; i < kernels_size; ++i) {
+    const Bench_Result stack = bench_isolated(kernels[i], BENCH_STACK, runs);
+    const Bench_Result reg = bench_isolated(kernels[i], BENCH_REG, runs);
+    if (stack.err != ERR_OK || reg.err != ERR_OK) {
+      fprintf(stderr, "ERROR: `%s` failed: %s\n", kernels[i],
+              err_as_cstr(stack.err != ERR_OK ? stack.err : reg.err));
+      exit_code = 1;
+      continue;
+    }
+    if (stack.checksum != reg.checksum) {
+      fprintf(stderr, "ERROR: `%s`: the engines disagree on the output\n", kernels[i]);
+      exit_code = 1;
+    }
+    bench_push_result(stack);
+    bench_push_result(reg);
+  }
+  bench_push_result(bench_isolated(NULL, BENCH_STACK, runs));
+
+  if (baseline_file_path != NULL) {
+    bench_load_baseline(baseline_file_path);
+  }
+  bench_report();
+  if (output_file_path != NULL) {
+    bench_save_results(output_file_path);
+  }
+
+  return exit_code;
+}
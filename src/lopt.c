@@ -0,0 +1,680 @@
+#define _POSIX_C_SOURCE 200809L
+#include "./lvm.h"
+#include "./lvm_io.h"
+#include "./lvm_parallel.h"
+#include <time.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// lopt assumes that code addresses only ever appear as jmp/jmp_if/call
+// operands, as return addresses pushed by call and as routines pushed for
+// parallel_for and spawn. Programs that push code addresses by hand and
+// `ret` to them are not supported, and programs whose data segment may hold
+// the address of a label that would move are refused.
+
+char *shift(int *argc, char ***argv);
+void usage(FILE *stream, const char *program);
+
+char *shift(int *argc, char ***argv)
+{
+  assert(*argc > 0);
+  char *result = **argv;
+  *argv += 1;
+  *argc -= 1;
+  return result;
+}
+
+void usage(FILE *stream, const char *program)
+{
+  fprintf(stream, "Usage: %s <input.lvm> <output.lvm> [-b] [--plugin <lib.so>]...\n", program);
+  fprintf(stream, "  -b        run the program before and after optimization and compare\n");
+  fprintf(stream, "  --plugin  load natives for -b from a plugin, like lvm does\n");
+}
+
+static void opt_load_plugin(LVM_Native_Table *table, const char *file_path)
+{
+  void *handle = dlopen(file_path, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    fprintf(stderr, "ERROR: Could not load plugin `%s`: %s\n", file_path, dlerror());
+    exit(1);
+  }
+
+  const LVM_Plugin *plugin = dlsym(handle, LVM_PLUGIN_SYMBOL);
+  if (plugin == NULL) {
+    fprintf(stderr, "ERROR: plugin `%s` does not export `%s`\n",
+            file_path, LVM_PLUGIN_SYMBOL);
+    exit(1);
+  }
+
+  if (plugin->abi_version != LVM_PLUGIN_ABI_VERSION) {
+    fprintf(stderr, "ERROR: plugin `%s` was built for ABI version %" PRIu32 ", expected %d\n",
+            file_path, plugin->abi_version, LVM_PLUGIN_ABI_VERSION);
+    exit(1);
+  }
+
+  for (uint32_t i = 0; i < plugin->natives_size; ++i) {
+    lvm_register_plugin_native(table, &plugin->natives[i]);
+  }
+}
+
+typedef struct {
+  bool leader[LVM_PROGRAM_CAPACITY];
+  bool reachable[LVM_PROGRAM_CAPACITY];
+  bool dead[LVM_PROGRAM_CAPACITY];
+  // pushes of a routine address that a native runs
+  bool code_push[LVM_PROGRAM_CAPACITY];
+} Opt;
+
+static Opt opt = {0};
+
+static bool inst_ends_block(Inst_Type type)
+{
+  return inst_is_jump(type) || type == INST_RET || type == INST_HALT;
+}
+
+// Basic blocks start at the entry point, at every jump target and right
+// after every control transfer.
+static void opt_find_leaders(const LVM *lvm)
+{
+  memset(opt.leader, 0, sizeof(opt.leader));
+  opt.leader[0] = true;
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    const Inst inst = lvm->program[i];
+    if (inst_is_jump(inst.type) && inst.operand.as_u64 < lvm->program_size) {
+      opt.leader[inst.operand.as_u64] = true;
+    }
+    if (inst_ends_block(inst.type) && i + 1 < lvm->program_size) {
+      opt.leader[i + 1] = true;
+    }
+  }
+}
+
+// Natives that run the routine whose address is `depth` words below the
+// top of the stack.
+static const struct {
+  const char *name;
+  uint64_t depth;
+} opt_code_natives[] = {
+  {"parallel_for", 3},
+  {"spawn", 0},
+};
+
+// The push in the same block that left the word `depth` below the top of
+// the stack right before `i`, or program_size if it came from anywhere
+// else.
+static Inst_Addr opt_find_producer(const LVM *lvm, Inst_Addr i, uint64_t depth)
+{
+  while (i > 0 && !opt.leader[i]) {
+    const Inst inst = lvm->program[--i];
+    if (inst.type == INST_PUSH && depth == 0) {
+      return i;
+    }
+
+    if (inst.type == INST_DUP) {
+      depth = depth == 0 ? inst.operand.as_u64 : depth - 1;
+    } else if (inst.type == INST_SWAP) {
+      if (depth == 0) {
+        depth = inst.operand.as_u64;
+      } else if (depth == inst.operand.as_u64) {
+        depth = 0;
+      }
+    } else {
+      const Inst_Def *def = &inst_defs[inst.type];
+      if (def->inputs < 0 || depth < (uint64_t) def->outputs) {
+        break;
+      }
+      depth = depth - (uint64_t) def->outputs + (uint64_t) def->inputs;
+    }
+  }
+  return lvm->program_size;
+}
+
+// Marks the pushes that hand a routine to a native, so it stays reachable
+// and its address is renumbered. A program where the address is computed
+// can't be optimized safely.
+static void opt_find_code_pushes(const LVM *lvm)
+{
+  memset(opt.code_push, 0, sizeof(opt.code_push));
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    const Inst inst = lvm->program[i];
+    if (inst.type != INST_NATIVE || inst.operand.as_u64 >= lvm->natives_size) {
+      continue;
+    }
+
+    const char *name = lvm->natives[inst.operand.as_u64].name;
+    for (size_t j = 0; j < sizeof(opt_code_natives) / sizeof(opt_code_natives[0]); ++j) {
+      if (strcmp(name, opt_code_natives[j].name) != 0) {
+        continue;
+      }
+
+      const Inst_Addr push = opt_find_producer(lvm, i, opt_code_natives[j].depth);
+      if (push >= lvm->program_size || lvm->program[push].operand.as_u64 >= lvm->program_size) {
+        fprintf(stderr, "ERROR: the routine `native %s` at %" PRIu64 " runs is not a label pushed in the same block\n",
+                name, i);
+        exit(1);
+      }
+      opt.code_push[push] = true;
+      opt.leader[lvm->program[push].operand.as_u64] = true;
+    }
+  }
+}
+
+static void opt_find_reachable(const LVM *lvm)
+{
+  static Inst_Addr worklist[LVM_PROGRAM_CAPACITY];
+  size_t worklist_size = 0;
+
+  memset(opt.reachable, 0, sizeof(opt.reachable));
+  if (lvm->program_size == 0) {
+    return;
+  }
+
+  opt.reachable[0] = true;
+  worklist[worklist_size++] = 0;
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    const Inst_Addr routine = lvm->program[i].operand.as_u64;
+    if (opt.code_push[i] && !opt.reachable[routine]) {
+      opt.reachable[routine] = true;
+      worklist[worklist_size++] = routine;
+    }
+  }
+
+  while (worklist_size > 0) {
+    Inst_Addr i = worklist[--worklist_size];
+    // walk the block, then queue its successors
+    while (true) {
+      const Inst inst = lvm->program[i];
+      Inst_Addr succs[2];
+      size_t succs_size = 0;
+
+      if (inst.type == INST_JMP) {
+        succs[succs_size++] = inst.operand.as_u64;
+      } else if (inst_is_jump(inst.type)) {
+        succs[succs_size++] = inst.operand.as_u64;
+        succs[succs_size++] = i + 1;
+      } else if (inst.type != INST_RET && inst.type != INST_HALT) {
+        succs[succs_size++] = i + 1;
+      }
+
+      if (!inst_ends_block(inst.type) && i + 1 < lvm->program_size
+          && !opt.leader[i + 1]) {
+        opt.reachable[++i] = true;
+        continue;
+      }
+
+      for (size_t j = 0; j < succs_size; ++j) {
+        if (succs[j] < lvm->program_size && !opt.reachable[succs[j]]) {
+          opt.reachable[succs[j]] = true;
+          worklist[worklist_size++] = succs[j];
+        }
+      }
+      break;
+    }
+  }
+}
+
+// Index of the next live instruction after `i` within the same block,
+// or program_size if there is none.
+static Inst_Addr opt_next_in_block(const LVM *lvm, Inst_Addr i)
+{
+  for (i += 1; i < lvm->program_size; ++i) {
+    if (opt.leader[i]) {
+      return lvm->program_size;
+    }
+    if (!opt.dead[i]) {
+      return i;
+    }
+  }
+  return lvm->program_size;
+}
+
+// `x b op` that leaves x unchanged, e.g. `push 0; plusi`.
+static bool opt_is_identity(Inst_Type type, Word b)
+{
+  if (type == INST_PLUSI || type == INST_MINUSI || type == INST_ORB
+      || type == INST_XOR || type == INST_SHR || type == INST_SHL) {
+    return b.as_u64 == 0;
+  }
+  if (type == INST_MULTI || type == INST_DIVI) {
+    return b.as_u64 == 1;
+  }
+  return false;
+}
+
+static size_t opt_fold_constants(LVM *lvm)
+{
+  size_t changes = 0;
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    Inst *inst = &lvm->program[i];
+    if (opt.dead[i]) {
+      continue;
+    }
+
+    if (inst->type == INST_NOP) {
+      opt.dead[i] = true;
+      changes += 1;
+      continue;
+    }
+
+    if (inst->type != INST_PUSH) {
+      continue;
+    }
+
+    Inst_Addr j = opt_next_in_block(lvm, i);
+    if (j >= lvm->program_size) {
+      continue;
+    }
+    Inst *next = &lvm->program[j];
+
+    if (next->type == INST_DROP) {
+      opt.dead[i] = opt.dead[j] = true;
+      changes += 1;
+      continue;
+    }
+
+    Word result = {0};
+    if (inst_fold_unary(next->type, inst->operand, &result)) {
+      inst->operand = result;
+      opt.dead[j] = true;
+      changes += 1;
+      i -= 1;
+      continue;
+    }
+
+    if (next->type == INST_JMP_IF) {
+      if (inst->operand.as_u64) {
+        next->type = INST_JMP;
+      } else {
+        opt.dead[j] = true;
+      }
+      opt.dead[i] = true;
+      changes += 1;
+      continue;
+    }
+
+    if (opt_is_identity(next->type, inst->operand)) {
+      opt.dead[i] = opt.dead[j] = true;
+      changes += 1;
+      continue;
+    }
+
+    if (next->type != INST_PUSH) {
+      continue;
+    }
+
+    Inst_Addr k = opt_next_in_block(lvm, j);
+    if (k >= lvm->program_size) {
+      continue;
+    }
+
+    if (!inst_fold_binary(lvm->program[k].type, inst->operand, next->operand, &result)) {
+      continue;
+    }
+
+    if (inst_is_cond_jump(lvm->program[k].type)) {
+      if (result.as_u64) {
+        lvm->program[k].type = INST_JMP;
+      } else {
+        opt.dead[k] = true;
+      }
+      opt.dead[i] = opt.dead[j] = true;
+      changes += 1;
+    } else {
+      inst->operand = result;
+      opt.dead[j] = opt.dead[k] = true;
+      changes += 1;
+      // try to fold the result into whatever comes next
+      i -= 1;
+    }
+  }
+  return changes;
+}
+
+static size_t opt_thread_jumps(LVM *lvm)
+{
+  size_t changes = 0;
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    Inst *inst = &lvm->program[i];
+    if (opt.dead[i] || !inst_is_jump(inst->type)) {
+      continue;
+    }
+
+    // follow jmp chains, bounded in case of `l: jmp l` style loops
+    Inst_Addr target = inst->operand.as_u64;
+    for (size_t hops = 0; hops < lvm->program_size; ++hops) {
+      if (target >= lvm->program_size || lvm->program[target].type != INST_JMP
+          || lvm->program[target].operand.as_u64 == target) {
+        break;
+      }
+      target = lvm->program[target].operand.as_u64;
+    }
+
+    if (target != inst->operand.as_u64) {
+      inst->operand.as_u64 = target;
+      changes += 1;
+    }
+
+    if (inst->type == INST_JMP) {
+      // a jump to the next live instruction is a nop
+      Inst_Addr next = i + 1;
+      while (next < lvm->program_size && opt.dead[next]) {
+        next += 1;
+      }
+      if (target == next) {
+        opt.dead[i] = true;
+        changes += 1;
+      }
+    }
+  }
+  return changes;
+}
+
+// The conditional jump taking the same branch as `cmp; jmp_if`, or as
+// `cmp; not; jmp_if` when `negate` is set. Float compares are never
+// negated since `!(a < b)` is not `a >= b` once NaNs are involved.
+static bool opt_cond_jump(Inst_Type cmp, bool negate, Inst_Type *output)
+{
+  static const struct {
+    Inst_Type cmp;
+    Inst_Type jump;
+    Inst_Type negated;
+  } table[] = {
+    {INST_EQ,  INST_JEQ,  INST_JNE},
+    {INST_NE,  INST_JNE,  INST_JEQ},
+    {INST_LTI, INST_JLTI, INST_JGEI},
+    {INST_LEI, INST_JLEI, INST_JGTI},
+    {INST_GTI, INST_JGTI, INST_JLEI},
+    {INST_GEI, INST_JGEI, INST_JLTI},
+    {INST_LTU, INST_JLTU, INST_JGEU},
+    {INST_LEU, INST_JLEU, INST_JGTU},
+    {INST_GTU, INST_JGTU, INST_JLEU},
+    {INST_GEU, INST_JGEU, INST_JLTU},
+    // gef compares the top against the value below it
+    {INST_GEF, INST_JLEF, NUMBER_OF_INSTS},
+    {INST_LTF, INST_JLTF, NUMBER_OF_INSTS},
+    {INST_LEF, INST_JLEF, NUMBER_OF_INSTS},
+    {INST_GTF, INST_JGTF, NUMBER_OF_INSTS},
+  };
+
+  for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); ++i) {
+    if (table[i].cmp == cmp) {
+      *output = negate ? table[i].negated : table[i].jump;
+      return *output != NUMBER_OF_INSTS;
+    }
+  }
+  return false;
+}
+
+// `cmp; jmp_if l` and `cmp; not; jmp_if l` become a single `jxx l`.
+static size_t opt_fuse_branches(LVM *lvm)
+{
+  size_t changes = 0;
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    if (opt.dead[i]) {
+      continue;
+    }
+
+    Inst_Addr j = opt_next_in_block(lvm, i);
+    if (j >= lvm->program_size) {
+      continue;
+    }
+
+    bool negate = false;
+    if (lvm->program[j].type == INST_NOT) {
+      negate = true;
+      j = opt_next_in_block(lvm, j);
+      if (j >= lvm->program_size) {
+        continue;
+      }
+    }
+
+    Inst_Type jump;
+    if (lvm->program[j].type != INST_JMP_IF
+        || !opt_cond_jump(lvm->program[i].type, negate, &jump)) {
+      continue;
+    }
+
+    lvm->program[j].type = jump;
+    for (Inst_Addr k = i; k < j; ++k) {
+      opt.dead[k] = true;
+    }
+    changes += 1;
+  }
+  return changes;
+}
+
+// A %u64 in the data segment may hold a code address, and nothing tells it
+// apart from a number. Refuses to move any label that a data word equals.
+static void opt_check_data(const LVM *lvm, const Inst_Addr *new_addr)
+{
+  static const LVM_Symbol *moved[LVM_PROGRAM_CAPACITY];
+  memset(moved, 0, sizeof(moved));
+  for (size_t i = 0; i < lvm->symbols_size; ++i) {
+    const Inst_Addr addr = lvm->symbols[i].addr;
+    if (addr < lvm->program_size && new_addr[addr] != addr) {
+      moved[addr] = &lvm->symbols[i];
+    }
+  }
+
+  for (Memory_Addr addr = 0; addr + sizeof(uint64_t) <= lvm->data_size; addr += sizeof(uint64_t)) {
+    uint64_t word = 0;
+    lvm_memory_read(lvm, addr, &word, sizeof(word));
+    if (word < lvm->program_size && moved[word] != NULL) {
+      fprintf(stderr, "ERROR: the data word at %" PRIu64 " may be the address of label `%s`, which optimization would move\n",
+              addr, moved[word]->name);
+      exit(1);
+    }
+  }
+}
+
+// Drops dead instructions and renumbers jump targets, routine addresses
+// and labels. A jump to a removed instruction lands on the next surviving
+// one.
+static void opt_compact(LVM *lvm)
+{
+  static Inst_Addr new_addr[LVM_PROGRAM_CAPACITY + 1];
+  Inst_Addr size = 0;
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    new_addr[i] = size;
+    if (!opt.dead[i]) {
+      size += 1;
+    }
+  }
+  new_addr[lvm->program_size] = size;
+  opt_check_data(lvm, new_addr);
+
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    if (opt.dead[i]) {
+      continue;
+    }
+    Inst inst = lvm->program[i];
+    if ((inst_is_jump(inst.type) || opt.code_push[i]) && inst.operand.as_u64 <= lvm->program_size) {
+      inst.operand.as_u64 = new_addr[inst.operand.as_u64];
+    }
+    lvm->program[new_addr[i]] = inst;
+  }
+
+  // labels follow their instruction and go away with it
+  size_t symbols_size = 0;
+  for (size_t i = 0; i < lvm->symbols_size; ++i) {
+    LVM_Symbol symbol = lvm->symbols[i];
+    if (symbol.addr < lvm->program_size && !opt.dead[symbol.addr]) {
+      symbol.addr = new_addr[symbol.addr];
+      lvm->symbols[symbols_size++] = symbol;
+    }
+  }
+  lvm->symbols_size = symbols_size;
+
+  lvm->program_size = size;
+  memset(opt.dead, 0, sizeof(opt.dead));
+}
+
+static void opt_optimize(LVM *lvm)
+{
+  size_t changes = 1;
+  while (changes > 0) {
+    changes = 0;
+
+    opt_find_leaders(lvm);
+    opt_find_code_pushes(lvm);
+    opt_find_reachable(lvm);
+    for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+      if (!opt.reachable[i]) {
+        opt.dead[i] = true;
+        changes += 1;
+      }
+    }
+
+    changes += opt_fold_constants(lvm);
+    changes += opt_fuse_branches(lvm);
+    changes += opt_thread_jumps(lvm);
+    opt_compact(lvm);
+  }
+}
+
+#define OPT_COMPARE_RUNS 3
+
+typedef struct {
+  Err err;
+  uint64_t insts;
+  double secs;
+} Opt_Run;
+
+static double opt_now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// Runs the program with its output discarded.
+static Opt_Run opt_run(LVM *vm, const LVM_Native_Table *natives)
+{
+  Opt_Run run = {0};
+  lvm_link_natives(vm, natives);
+
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  if (saved_stdout >= 0 && devnull >= 0) {
+    dup2(devnull, STDOUT_FILENO);
+  }
+
+  double begin = opt_now();
+  while (!vm->halt) {
+    run.err = lvm_execute_inst(vm);
+    if (run.err != ERR_OK) {
+      break;
+    }
+    run.insts += 1;
+  }
+  run.secs = opt_now() - begin;
+
+  fflush(stdout);
+  if (saved_stdout >= 0 && devnull >= 0) {
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(devnull);
+  }
+  return run;
+}
+
+int main(int argc, char **argv)
+{
+  const char *program = shift(&argc, &argv);
+  const char *input_file_path = NULL;
+  const char *output_file_path = NULL;
+  bool compare = false;
+  static LVM_Native_Table natives = {0};
+  lvm_register_builtin_natives(&natives);
+  lvm_io_register_natives(&natives);
+  lvm_parallel_register_natives(&natives);
+
+  while (argc > 0) {
+    const char *arg = shift(&argc, &argv);
+    if (strcmp(arg, "-b") == 0) {
+      compare = true;
+    } else if (strcmp(arg, "--plugin") == 0) {
+      if (argc == 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", arg);
+        exit(1);
+      }
+
+      opt_load_plugin(&natives, shift(&argc, &argv));
+    } else if (strcmp(arg, "-h") == 0) {
+      usage(stdout, program);
+      exit(0);
+    } else if (input_file_path == NULL) {
+      input_file_path = arg;
+    } else if (output_file_path == NULL) {
+      output_file_path = arg;
+    } else {
+      usage(stderr, program);
+      fprintf(stderr, "ERROR: unexpected argument `%s`\n", arg);
+      exit(1);
+    }
+  }
+
+  if (input_file_path == NULL || output_file_path == NULL) {
+    usage(stderr, program);
+    fprintf(stderr, "ERROR: expected input and output\n");
+    exit(1);
+  }
+
+  lvm_load_program_from_file(&lvm, input_file_path);
+  const uint64_t before = lvm.program_size;
+
+  LVM *original = NULL;
+  if (compare) {
+    original = malloc(sizeof(LVM));
+    assert(original != NULL);
+    memcpy(original, &lvm, sizeof(LVM));
+  }
+
+  opt_optimize(&lvm);
+  lvm_save_program_to_file(&lvm, output_file_path);
+
+  printf("%s: %" PRIu64 " -> %" PRIu64 " instructions\n",
+         input_file_path, before, lvm.program_size);
+
+  if (compare) {
+
+    LVM *optimized = malloc(sizeof(LVM));
+    assert(optimized != NULL);
+    memcpy(optimized, &lvm, sizeof(LVM));
+
+    // best of a few runs on fresh copies, so page faults and cold caches
+    // of the first run don't skew the comparison
+    LVM *vm = malloc(sizeof(LVM));
+    assert(vm != NULL);
+    Opt_Run a = {0};
+    Opt_Run b = {0};
+    for (int i = 0; i < OPT_COMPARE_RUNS; ++i) {
+      memcpy(vm, original, sizeof(LVM));
+      Opt_Run run = opt_run(vm, &natives);
+      if (i == 0 || run.secs < a.secs) {
+        a = run;
+      }
+
+      memcpy(vm, optimized, sizeof(LVM));
+      run = opt_run(vm, &natives);
+      if (i == 0 || run.secs < b.secs) {
+        b = run;
+      }
+    }
+
+    printf("  executed: %" PRIu64 " -> %" PRIu64 " instructions\n", a.insts, b.insts);
+    printf("  time:     %.3f ms -> %.3f ms\n", a.secs * 1e3, b.secs * 1e3);
+    if (a.err != b.err) {
+      printf("  WARNING: result differs: %s -> %s\n", err_as_cstr(a.err), err_as_cstr(b.err));
+    }
+
+    free(vm);
+    free(optimized);
+    free(original);
+  }
+
+  return 0;
+}
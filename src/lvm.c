@@ -1,5 +1,30 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 #include "lvm.h"
+#include "lvm_reg.h"
+#include "lvm_perf.h"
+#include "lvm_io.h"
+#include "lvm_parallel.h"
+#include "lvm_profile.h"
+#include "lvm_memprof.h"
 #include <stdio.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+LVM_Native_Table natives = {0};
+Reg_Program reg_program = {0};
+LVM_Trace trace = {0};
+LVM_Output output = {0};
+LVM_Profile profile = {0};
+LVM_Memprof memprof = {0};
+const char *trace_file_path = NULL;
+const char *profile_file_path = NULL;
+const char *map_file_paths[LVM_SEGMENTS_CAPACITY];
+bool map_writable[LVM_SEGMENTS_CAPACITY];
+size_t map_files_size = 0;
 
 char *shift(int *argc, char ***argv);
 void usage(FILE *stream, const char *program);
@@ -15,111 +40,191 @@ char *shift(int *argc, char ***argv)
 
 void usage(FILE *stream, const char *program)
 {
-    fprintf(stream, "Usage: %s -i <input.lvm> [-l <limit>] [-h] [-d]\n", program);
+    fprintf(stream, "Usage: %s -i <input.lvm> [-l <limit>] [--timeout <ms>] [-h] [-d] [--plugin <lib.so>]... [--reg] [--check-reg] [--perf] [--trace <file.trace>] [--map|--map-rw <file>]... [--out=text|binary] [--threads <n>] [--profile <file>] [--memprof]\n", program);
+    fprintf(stream, "  -l           stop after about this many instructions: the limit is checked\n");
+    fprintf(stream, "               at back-edges and calls\n");
+    fprintf(stream, "  --timeout    stop with an error after this many milliseconds of wall-clock\n");
+    fprintf(stream, "               time, also checked at back-edges and calls\n");
+    fprintf(stream, "  --reg        run on the register engine\n");
+    fprintf(stream, "  --check-reg  run on both engines and compare the final state\n");
+    fprintf(stream, "  --perf       report hardware counters for the run and for its regions\n");
+    fprintf(stream, "  --trace      record the last %d jumps, calls and returns and dump them on error,\n", LVM_TRACE_CAPACITY);
+    fprintf(stream, "               on a fatal signal or on SIGUSR1. Decode with dlsm -t. Off by\n");
+    fprintf(stream, "               default: every taken transfer is recorded, which costs about\n");
+    fprintf(stream, "               1.5 ns each and up to 45%% on call-heavy code\n");
+    fprintf(stream, "  --map        map a file read-only into memory, the n-th one at n << %d\n", LVM_SEGMENT_SHIFT);
+    fprintf(stream, "  --map-rw     same, but writes go to the file\n");
+    fprintf(stream, "  --out        how the print natives write: lines of text (default) or\n");
+    fprintf(stream, "               8-byte little-endian words. Output is flushed when the buffer\n");
+    fprintf(stream, "               is full, on out_flush and at the end of the run\n");
+    fprintf(stream, "  --threads    worker threads for parallel_for, one per CPU by default\n");
+    fprintf(stream, "  --profile    count how often every labeled block runs, for lasm --profile.\n");
+    fprintf(stream, "               Runs on the stack interpreter without the scheduler\n");
+    fprintf(stream, "  --memprof    report where memory is read and written, how wide and at which\n");
+    fprintf(stream, "               strides, with suggestions. Same engine as --profile\n");
 }
 
 
-static Err lvm_alloc(LVM *lvm)
+static void lvm_load_plugin(LVM_Native_Table *table, const char *file_path)
 {
-    if (lvm->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
+    void *handle = dlopen(file_path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        fprintf(stderr, "ERROR: Could not load plugin `%s`: %s\n", file_path, dlerror());
+        exit(1);
     }
 
-    lvm->stack[lvm->stack_size - 1].as_ptr = malloc(lvm->stack[lvm->stack_size - 1].as_u64);
-
-    return ERR_OK;
-}
-
-static Err lvm_free(LVM *lvm)
-{
-    if (lvm->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
+    const LVM_Plugin *plugin = dlsym(handle, LVM_PLUGIN_SYMBOL);
+    if (plugin == NULL) {
+        fprintf(stderr, "ERROR: plugin `%s` does not export `%s`\n",
+                file_path, LVM_PLUGIN_SYMBOL);
+        exit(1);
     }
 
-    free(lvm->stack[lvm->stack_size - 1].as_ptr);
-    lvm->stack_size -= 1;
+    if (plugin->abi_version != LVM_PLUGIN_ABI_VERSION) {
+        fprintf(stderr, "ERROR: plugin `%s` was built for ABI version %" PRIu32 ", expected %d\n",
+                file_path, plugin->abi_version, LVM_PLUGIN_ABI_VERSION);
+        exit(1);
+    }
 
-    return ERR_OK;
+    for (uint32_t i = 0; i < plugin->natives_size; ++i) {
+        lvm_register_plugin_native(table, &plugin->natives[i]);
+    }
 }
 
-static Err lvm_print_f64(LVM *lvm)
+static void lvm_trace_record_stop(void)
 {
-    if (lvm->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    printf("%lf\n", lvm->stack[lvm->stack_size - 1].as_f64);
-    lvm->stack_size -= 1;
-    return ERR_OK;
+    const uint32_t type = lvm.pc < lvm.program_size ? inst_dequicken(lvm.program[lvm.pc]).type : NUMBER_OF_INSTS;
+    lvm_trace_record(&lvm, lvm.pc, type | LVM_TRACE_STOP);
 }
 
-
-static Err lvm_print_i64(LVM *lvm)
+// Only async-signal-safe calls from here on.
+static void lvm_trace_dump_on_signal(int sig)
 {
-    if (lvm->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
+    trace.reason = LVM_TRACE_SIGNAL | (uint32_t) sig;
+    lvm_trace_record_stop();
+    const int fd = open(trace_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        const ssize_t n = write(fd, &trace, sizeof(trace));
+        (void) n;
+        close(fd);
     }
 
-    printf("%" PRId64 "\n", lvm->stack[lvm->stack_size - 1].as_i64);
-    lvm->stack_size -= 1;
-    return ERR_OK;
+    if (sig != SIGUSR1) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
 }
 
-static Err lvm_print_u64(LVM *lvm)
+static void lvm_trace_enable(LVM *vm)
 {
-    if (lvm->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
+    static const int signals[] = {SIGINT, SIGTERM, SIGSEGV, SIGBUS, SIGFPE, SIGABRT, SIGUSR1};
+
+    lvm_trace_init(&trace);
+    vm->trace = &trace;
 
-    printf("%" PRIu64 "\n", lvm->stack[lvm->stack_size - 1].as_u64);
-    lvm->stack_size -= 1;
-    return ERR_OK;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = lvm_trace_dump_on_signal;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i) {
+        sigaction(signals[i], &action, NULL);
+    }
 }
 
-static Err lvm_print_ptr(LVM *lvm)
+static void lvm_trace_dump_on_error(Err err)
 {
-    if (lvm->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
+    if (trace_file_path == NULL) {
+        return;
     }
 
-    printf("%p\n", lvm->stack[lvm->stack_size - 1].as_ptr);
-    lvm->stack_size -= 1;
-    return ERR_OK;
+    trace.reason = (uint32_t) err;
+    lvm_trace_record_stop();
+    lvm_trace_save(&trace, trace_file_path);
+    fprintf(stderr, "INFO: the last instructions were written to `%s`\n", trace_file_path);
 }
 
-static Err lvm_dump_memory(LVM *lvm)
+static void lvm_timeout_expired(int sig)
 {
-    if (lvm->stack_size < 2) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    Memory_Addr addr = lvm->stack[lvm->stack_size - 2].as_u64;
-    uint64_t count = lvm->stack[lvm->stack_size - 1].as_u64;
+    (void) sig;
+    lvm_interrupt = 1;
+}
 
-    if (addr >= LVM_MEMORY_CAPACITY) {
-        return ERR_ILLEGAL_MEMORY_ACCESS;
+static void lvm_timeout_start(long ms)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = lvm_timeout_expired;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &action, NULL);
+
+    const struct itimerval timer = {
+        .it_interval = {0, 0},
+        .it_value = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000},
+    };
+    if (setitimer(ITIMER_REAL, &timer, NULL) < 0) {
+        fprintf(stderr, "ERROR: Could not start the timer: %s\n", strerror(errno));
+        exit(1);
     }
+}
 
-    if (addr + count < addr || addr + count >= LVM_MEMORY_CAPACITY) {
-        return ERR_ILLEGAL_MEMORY_ACCESS;
+// Runs the program on the stack interpreter and on the register engine and
+// checks that both end up with the same stack, memory and heap. Output of
+// natives is produced twice.
+static Err lvm_check_reg_engine(LVM *vm, int64_t limit)
+{
+    LVM *reference = malloc(sizeof(LVM));
+    assert(reference != NULL);
+    lvm_fork(reference, vm);
+
+    const Err expected = lvm_execute_program(reference, limit);
+    lvm_reg_translate(vm, &reg_program);
+    const Err err = lvm_reg_execute_program(vm, &reg_program, limit);
+
+    const char *diverged = NULL;
+    if (err != expected) {
+        diverged = "result";
+    } else if (vm->pc != reference->pc || vm->halt != reference->halt) {
+        diverged = "pc";
+    } else if (err == ERR_OK && vm->stack_size != reference->stack_size) {
+        diverged = "stack size";
+    } else if (err == ERR_OK && memcmp(vm->stack, reference->stack, sizeof(vm->stack[0]) * vm->stack_size) != 0) {
+        diverged = "stack";
+    } else if (!lvm_memory_equal(vm, reference)) {
+        diverged = "memory";
+    } else if (!lvm_heap_equal(&vm->heap, &reference->heap)) {
+        diverged = "heap";
     }
 
-    for (uint64_t i = 0; i < count; ++i) {
-        printf("%02X ", lvm->memory[addr + i]);
+    if (diverged != NULL) {
+        fprintf(stderr, "ERROR: register engine diverged from the stack interpreter: %s differs\n", diverged);
+        fprintf(stderr, "  stack interpreter: %s at %" PRIu64 "\n", err_as_cstr(expected), reference->pc);
+        fprintf(stderr, "  register engine:   %s at %" PRIu64 "\n", err_as_cstr(err), vm->pc);
+        exit(1);
     }
-    printf("\n");
 
-    lvm->stack_size -= 2;
-
-    return ERR_OK;
+    fprintf(stderr, "INFO: register engine matches the stack interpreter (%zu blocks, %zu ops for %" PRIu64 " instructions)\n",
+            reg_program.blocks_size, reg_program.ops_size, reg_program.translated_insts);
+    lvm_memory_release(reference);
+    free(reference);
+    return err;
 }
 
 int main(int argc, char *argv[])
 {
   const char *program = shift(&argc, &argv);
   const char *input_file_path = NULL;
-  int limit = -1;
+  int64_t limit = -1;
+  long timeout_ms = 0;
   int debug = 0;
+  int reg = 0;
+  int check_reg = 0;
+  int perf_enabled = 0;
+  int memprof_enabled = 0;
+
+  lvm_register_builtin_natives(&natives);
+  lvm_io_register_natives(&natives);
+  lvm_parallel_register_natives(&natives);
 
   while (argc > 0) {
     const char *flag = shift(&argc, &argv);
@@ -139,12 +244,77 @@ int main(int argc, char *argv[])
         exit(1);
       }
 
-      limit = atoi(shift(&argc, &argv));
+      limit = strtoll(shift(&argc, &argv), NULL, 10);
+    } else if (strcmp(flag, "--timeout") == 0) {
+      if (argc == 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+        exit(1);
+      }
+
+      timeout_ms = atol(shift(&argc, &argv));
+    } else if (strcmp(flag, "--plugin") == 0) {
+      if (argc == 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+        exit(1);
+      }
+
+      lvm_load_plugin(&natives, shift(&argc, &argv));
     } else if (strcmp(flag, "-h") == 0) {
       usage(stdout, program);
       exit(0);
     } else if (strcmp(flag, "-d") == 0) {
       debug = 1;
+    } else if (strcmp(flag, "--reg") == 0) {
+      reg = 1;
+    } else if (strcmp(flag, "--check-reg") == 0) {
+      check_reg = 1;
+    } else if (strcmp(flag, "--perf") == 0) {
+      perf_enabled = 1;
+    } else if (strcmp(flag, "--memprof") == 0) {
+      memprof_enabled = 1;
+    } else if (strcmp(flag, "--trace") == 0) {
+      if (argc == 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+        exit(1);
+      }
+
+      trace_file_path = shift(&argc, &argv);
+    } else if (strcmp(flag, "--profile") == 0) {
+      if (argc == 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+        exit(1);
+      }
+
+      profile_file_path = shift(&argc, &argv);
+    } else if (strcmp(flag, "--map") == 0 || strcmp(flag, "--map-rw") == 0) {
+      if (argc == 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+        exit(1);
+      }
+      if (map_files_size >= LVM_SEGMENTS_CAPACITY) {
+        fprintf(stderr, "ERROR: too many mapped files, the capacity is %d\n", LVM_SEGMENTS_CAPACITY);
+        exit(1);
+      }
+
+      map_writable[map_files_size] = strcmp(flag, "--map-rw") == 0;
+      map_file_paths[map_files_size++] = shift(&argc, &argv);
+    } else if (strcmp(flag, "--threads") == 0) {
+      if (argc == 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+        exit(1);
+      }
+
+      pool.threads_size = (size_t) atoi(shift(&argc, &argv));
+    } else if (strcmp(flag, "--out=text") == 0) {
+      output.binary = false;
+    } else if (strcmp(flag, "--out=binary") == 0) {
+      output.binary = true;
     } else {
       usage(stderr, program);
       fprintf(stderr, "ERROR: Unknown flag `%s`\n", flag);
@@ -158,32 +328,76 @@ int main(int argc, char *argv[])
     exit(1);
   }
   
+  if (perf_enabled) {
+    perf_register_natives(&natives);
+  }
+
   lvm_load_program_from_file(&lvm, input_file_path);
-  lvm_push_native(&lvm, lvm_alloc);     // 0
-  lvm_push_native(&lvm, lvm_free);      // 1
-  lvm_push_native(&lvm, lvm_print_f64); // 2
-  lvm_push_native(&lvm, lvm_print_i64); // 3
-  lvm_push_native(&lvm, lvm_print_u64); // 4
-  lvm_push_native(&lvm, lvm_print_ptr); // 5
-  lvm_push_native(&lvm, lvm_dump_memory); // 6
+  lvm_link_natives(&lvm, &natives);
+  for (size_t i = 0; i < map_files_size; ++i) {
+    if (lvm_segment_map(&lvm, map_file_paths[i], map_writable[i]) == 0) {
+      fprintf(stderr, "ERROR: Could not map file `%s`: %s\n", map_file_paths[i], strerror(errno));
+      exit(1);
+    }
+  }
+  if (trace_file_path != NULL) {
+    lvm_trace_enable(&lvm);
+  }
+  if (timeout_ms > 0) {
+    lvm_timeout_start(timeout_ms);
+  }
   
   if (!debug) {
-    Err err = lvm_execute_program(&lvm,limit);
+    output.fd = STDOUT_FILENO;
+    lvm.output = &output;
+
+    Err err = ERR_OK;
+    if (check_reg) {
+      err = lvm_check_reg_engine(&lvm, limit);
+    } else if (profile_file_path != NULL) {
+      lvm_quicken(&lvm);
+      err = lvm_profile_execute_program(&lvm, &profile, limit);
+      lvm_profile_save(&lvm, &profile, profile_file_path);
+    } else if (memprof_enabled) {
+      lvm_quicken(&lvm);
+      err = lvm_memprof_execute_program(&lvm, &memprof, limit);
+      lvm_output_flush(&output);
+      lvm_memprof_report(stderr, &lvm, &memprof);
+    } else if (perf_enabled) {
+      if (reg) {
+        lvm_reg_translate(&lvm, &reg_program);
+      } else {
+        perf.quickened = lvm_quicken(&lvm);
+      }
+      err = lvm_perf_execute_program(&lvm, reg ? &reg_program : NULL, limit);
+    } else {
+      if (reg) {
+        lvm_reg_translate(&lvm, &reg_program);
+        pool.rp = &reg_program;
+      } else {
+        lvm_quicken(&lvm);
+      }
+      err = lvm_io_run(&lvm, reg ? &reg_program : NULL, limit);
+    }
+    lvm_output_flush(&output);
     //lvm_dump_stack(stdout,&lvm);
     if (err != ERR_OK) {
       fprintf(stderr, "ERROR: %s\n", err_as_cstr(err));
+      lvm_trace_dump_on_error(err);
       exit(1);
     }    
   }else {
     while (limit != 0 && !lvm.halt) {
       lvm_dump_stack(stdout, &lvm);
+      const Inst inst = inst_dequicken(lvm.program[lvm.pc]);
       printf("Instruction: %s %" PRIu64 "\n",
-             inst_name(lvm.program[lvm.pc].type),
-	     lvm.program[lvm.pc].operand.as_u64);
+             inst_name(inst.type),
+	     inst.operand.as_u64);
       getchar();
       Err err = lvm_execute_inst(&lvm);
       if (err != ERR_OK) {
         fprintf(stderr, "ERROR: %s\n", err_as_cstr(err));
+        lvm_trace_dump_on_error(err);
         return 1;
       }
       if (limit > 0) {
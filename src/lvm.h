@@ -2,6 +2,7 @@
 #define LVM_H
 #include <ctype.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +10,15 @@
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./lvm_plugin.h"
 
 // 1. designated init
 // 2. c99 c11区别
@@ -17,11 +27,31 @@
 
 #define LVM_STACK_CAPACITY 1024
 #define LVM_NATIVES_CAPACITY 1024
+#define LVM_NATIVE_NAME_CAPACITY 32
+#define LVM_SYMBOLS_CAPACITY 1024
+#define LVM_SYMBOL_NAME_CAPACITY 32
+#define LVM_TRACE_CAPACITY 4096
 #define LVM_PROGRAM_CAPACITY 1024
 #define LVM_EXECUTION_LIMIT 128
 #define LVM_MEMORY_CAPACITY (640 * 1000)
+#define LVM_PAGE_SIZE 4096
+#define LVM_SEGMENTS_CAPACITY 16
+#define LVM_OUTPUT_CAPACITY (64 * 1024)
+// enough for any double printed with %lf
+#define LVM_FORMAT_CAPACITY 512
+#define LVM_HEAP_INITIAL_CAPACITY (256 * 1024)
+#define LVM_HEAP_NURSERY_CAPACITY (64 * 1024)
+#define LVM_HEAP_CAPACITY (1ull << 30)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LVM_HOST_BIG_ENDIAN 1
+#else
+#define LVM_HOST_BIG_ENDIAN 0
+#endif
+#define LVM_SEGMENT_PATH_CAPACITY 4096
 #define LASM_LABEL_CAPACITY 1024
 #define LASM_DEFERED_OPERANDS_CAPACITY 1024
+#define LASM_CODE_WORDS_CAPACITY 1024
 #define LASM_NUMBER_LITERAL_CAPACITY 1024
 #define LASM_MEMORY_CAPACITY (1000 * 1000 * 1000)
 
@@ -29,72 +59,132 @@
 #define LASM_COMMENT_SYMBOL ';'
 #define LASM_PP_SYMBOL '%'
 #define LASM_MAX_INCLUDE_LEVEL 64
+#define LASM_MACROS_CAPACITY 256
+#define LASM_MACRO_PARAMS_CAPACITY 16
+#define LASM_MAX_MACRO_LEVEL 64
+#define LASM_INLINES_CAPACITY 256
+// the longest routine %inline copies into its callers
+#define LASM_INLINE_CAPACITY 32
 
 typedef uint64_t Inst_Addr;
 typedef uint64_t Memory_Addr;
 
-typedef union {
-    uint64_t as_u64;
-    int64_t as_i64;
-    double as_f64;
-    void *as_ptr;
-} Word;
-
-static_assert(sizeof(Word) == 8,
-              "The LVM's Word is expected to be 64 bits");
-
-typedef enum {
-  ERR_OK = 0,
-  ERR_STACK_OVERFLOW,
-  ERR_STACK_UNDERFLOW,
-  ERR_ILLEGAL_INST,
-  ERR_ILLEGAL_INST_ACCESS,
-  ERR_ILLEGAL_OPERAND,
-  ERR_ILLEGAL_MEMORY_ACCESS,
-  ERR_DIV_BY_ZERO,
-} Err;
+// Every instruction, in the order of its opcode in .lvm files: the enum
+// constant, the name lasm knows it by, whether it takes an operand, and how
+// many words below the top it reads and how many it leaves in their place.
+// -1 for instructions whose stack effect depends on more than the
+// instruction: dup and swap on their operand, control transfers and natives
+// on where they go.
+#define LVM_INSTS(X) \
+  X(INST_NOP,         "nop",         false,  0,  0)                          \
+  X(INST_PUSH,        "push",        true,   0,  1)                          \
+  X(INST_DROP,        "drop",        false,  1,  0)                          \
+  X(INST_DUP,         "dup",         true,  -1, -1)                          \
+  X(INST_SWAP,        "swap",        true,  -1, -1)                          \
+  X(INST_PLUSI,       "plusi",       false,  2,  1)                          \
+  X(INST_MINUSI,      "minusi",      false,  2,  1)                          \
+  X(INST_MULTI,       "multi",       false,  2,  1)                          \
+  X(INST_DIVI,        "divi",        false,  2,  1)                          \
+  X(INST_PLUSF,       "plusf",       false,  2,  1)                          \
+  X(INST_MINUSF,      "minusf",      false,  2,  1)                          \
+  X(INST_MULTF,       "multf",       false,  2,  1)                          \
+  X(INST_DIVF,        "divf",        false,  2,  1)                          \
+  X(INST_JMP,         "jmp",         true,  -1, -1)                          \
+  X(INST_JMP_IF,      "jmp_if",      true,  -1, -1)                          \
+  X(INST_EQ,          "eq",          false,  2,  1)                          \
+  X(INST_RET,         "ret",         false, -1, -1)                          \
+  X(INST_CALL,        "call",        true,  -1, -1)                          \
+  X(INST_NATIVE,      "native",      true,  -1, -1)                          \
+  X(INST_HALT,        "halt",        false, -1, -1)                          \
+  X(INST_NOT,         "not",         false,  1,  1)                          \
+  X(INST_GEF,         "gef",         false,  2,  1)                          \
+  X(INST_ANDB,        "andb",        false,  2,  1)                          \
+  X(INST_ORB,         "orb",         false,  2,  1)                          \
+  X(INST_XOR,         "xor",         false,  2,  1)                          \
+  X(INST_SHR,         "shr",         false,  2,  1)                          \
+  X(INST_SHL,         "shl",         false,  2,  1)                          \
+  X(INST_NOTB,        "notb",        false,  1,  1)                          \
+  X(INST_READ8,       "read8",       false,  1,  1)                          \
+  X(INST_READ16,      "read16",      false,  1,  1)                          \
+  X(INST_READ32,      "read32",      false,  1,  1)                          \
+  X(INST_READ64,      "read64",      false,  1,  1)                          \
+  X(INST_WRITE8,      "write8",      false,  2,  0)                          \
+  X(INST_WRITE16,     "write16",     false,  2,  0)                          \
+  X(INST_WRITE32,     "write32",     false,  2,  0)                          \
+  X(INST_WRITE64,     "write64",     false,  2,  0)                          \
+  X(INST_PRINT_DEBUG, "print_debug", false,  1,  0)                          \
+  X(INST_NE,          "ne",          false,  2,  1)                          \
+  X(INST_LTI,         "lti",         false,  2,  1)                          \
+  X(INST_LEI,         "lei",         false,  2,  1)                          \
+  X(INST_GTI,         "gti",         false,  2,  1)                          \
+  X(INST_GEI,         "gei",         false,  2,  1)                          \
+  X(INST_LTU,         "ltu",         false,  2,  1)                          \
+  X(INST_LEU,         "leu",         false,  2,  1)                          \
+  X(INST_GTU,         "gtu",         false,  2,  1)                          \
+  X(INST_GEU,         "geu",         false,  2,  1)                          \
+  X(INST_EQF,         "eqf",         false,  2,  1)                          \
+  X(INST_NEF,         "nef",         false,  2,  1)                          \
+  X(INST_LTF,         "ltf",         false,  2,  1)                          \
+  X(INST_LEF,         "lef",         false,  2,  1)                          \
+  X(INST_GTF,         "gtf",         false,  2,  1)                          \
+  X(INST_JEQ,         "jeq",         true,  -1, -1)                          \
+  X(INST_JNE,         "jne",         true,  -1, -1)                          \
+  X(INST_JLTI,        "jlti",        true,  -1, -1)                          \
+  X(INST_JLEI,        "jlei",        true,  -1, -1)                          \
+  X(INST_JGTI,        "jgti",        true,  -1, -1)                          \
+  X(INST_JGEI,        "jgei",        true,  -1, -1)                          \
+  X(INST_JLTU,        "jltu",        true,  -1, -1)                          \
+  X(INST_JLEU,        "jleu",        true,  -1, -1)                          \
+  X(INST_JGTU,        "jgtu",        true,  -1, -1)                          \
+  X(INST_JGEU,        "jgeu",        true,  -1, -1)                          \
+  X(INST_JLTF,        "jltf",        true,  -1, -1)                          \
+  X(INST_JLEF,        "jlef",        true,  -1, -1)                          \
+  X(INST_JGTF,        "jgtf",        true,  -1, -1)                          \
+  X(INST_JGEF,        "jgef",        true,  -1, -1)                          \
+  X(INST_I2F,         "i2f",         false,  1,  1)                          \
+  X(INST_U2F,         "u2f",         false,  1,  1)                          \
+  X(INST_F2I,         "f2i",         false,  1,  1)                          \
+  X(INST_F2U,         "f2u",         false,  1,  1)                          \
+  X(INST_FMAF,        "fmaf",        false,  3,  1)                          \
+  X(INST_READ16BE,    "read16be",    false,  1,  1)                          \
+  X(INST_READ32BE,    "read32be",    false,  1,  1)                          \
+  X(INST_READ64BE,    "read64be",    false,  1,  1)                          \
+  X(INST_WRITE16BE,   "write16be",   false,  2,  0)                          \
+  X(INST_WRITE32BE,   "write32be",   false,  2,  0)                          \
+  X(INST_WRITE64BE,   "write64be",   false,  2,  0)                          \
+  X(INST_AREAD32,     "aread32",     false,  1,  1)                          \
+  X(INST_AREAD64,     "aread64",     false,  1,  1)                          \
+  X(INST_AWRITE32,    "awrite32",    false,  2,  0)                          \
+  X(INST_AWRITE64,    "awrite64",    false,  2,  0)                          \
+  X(INST_AADD32,      "aadd32",      false,  2,  1)                          \
+  X(INST_AADD64,      "aadd64",      false,  2,  1)                          \
+  X(INST_ACAS32,      "acas32",      false,  3,  1)                          \
+  X(INST_ACAS64,      "acas64",      false,  3,  1)                          \
+  X(INST_FENCE,       "fence",       false,  0,  0)                          \
+  /* quickened forms of push, dup and swap with their operand built */        \
+  /* in. Only lvm_quicken creates them and they never end up in a file */     \
+  X(INST_PUSH0,       "push0",       false,  0,  1)                          \
+  X(INST_PUSH1,       "push1",       false,  0,  1)                          \
+  X(INST_DUP0,        "dup0",        false,  1,  2)                          \
+  X(INST_DUP1,        "dup1",        false,  2,  3)                          \
+  X(INST_DUP2,        "dup2",        false,  3,  4)                          \
+  X(INST_SWAP1,       "swap1",       false,  2,  2)                          \
+  X(INST_SWAP2,       "swap2",       false,  3,  3)
 
 typedef enum {
-  INST_NOP = 0,
-  INST_PUSH,
-  INST_DROP,
-  INST_DUP,
-  INST_SWAP,
-  INST_PLUSI,
-  INST_MINUSI,
-  INST_MULTI,
-  INST_DIVI,
-  INST_PLUSF,
-  INST_MINUSF,
-  INST_MULTF,
-  INST_DIVF,
-  INST_JMP,
-  INST_JMP_IF,
-  INST_EQ,
-  INST_RET,
-  INST_CALL,
-  INST_NATIVE,
-  INST_HALT,
-  INST_NOT,
-  INST_GEF,
-  INST_ANDB,
-  INST_ORB,
-  INST_XOR,
-  INST_SHR,
-  INST_SHL,
-  INST_NOTB,
-  INST_READ8,
-  INST_READ16,
-  INST_READ32,
-  INST_READ64,
-  INST_WRITE8,
-  INST_WRITE16,
-  INST_WRITE32,
-  INST_WRITE64,
-  INST_PRINT_DEBUG,
+#define X(type, name, operand, inputs, outputs) type,
+  LVM_INSTS(X)
+#undef X
   NUMBER_OF_INSTS,
 } Inst_Type;
 
+typedef struct {
+  const char *name;
+  bool operand;
+  int inputs;
+  int outputs;
+} Inst_Def;
+
 // Designated Initializers
 // [INDEX] = value：指定初始化器（C99 特性）
 
@@ -115,11 +205,27 @@ bool sv_eq(String_View a, String_View b);
 const char *inst_name(Inst_Type type);
 bool inst_has_operand(Inst_Type type);
 bool inst_by_name(String_View name, Inst_Type *output);
+bool inst_is_cond_jump(Inst_Type type);
+bool inst_is_jump(Inst_Type type);
+bool inst_is_quickened(Inst_Type type);
+bool inst_is_memory_read(Inst_Type type);
+bool inst_is_memory_write(Inst_Type type);
+bool inst_stack_effect(Inst_Type type, Word operand, uint64_t *inputs, uint64_t *outputs);
+int64_t lvm_f64_to_i64(double x);
+uint64_t lvm_f64_to_u64(double x);
+bool inst_fold_unary(Inst_Type type, Word a, Word *result);
+bool inst_fold_binary(Inst_Type type, Word a, Word b, Word *result);
+
+const Inst_Def inst_defs[NUMBER_OF_INSTS] = {
+#define X(type, name, operand, inputs, outputs) [type] = {name, operand, inputs, outputs},
+  LVM_INSTS(X)
+#undef X
+};
 
 bool inst_by_name(String_View name, Inst_Type *output)
 {
     for (Inst_Type type = (Inst_Type) 0; type < NUMBER_OF_INSTS; type += 1) {
-        if (sv_eq(cstr_as_sv(inst_name(type)), name)) {
+        if (!inst_is_quickened(type) && sv_eq(cstr_as_sv(inst_name(type)), name)) {
             *output = type;
             return true;
         }
@@ -130,94 +236,210 @@ bool inst_by_name(String_View name, Inst_Type *output)
 
 const char *inst_name(Inst_Type type)
 {
-    switch (type) {
-    case INST_NOP:		return "nop";
-    case INST_PUSH:		return "push";
-    case INST_DROP:		return "drop";
-    case INST_DUP:		return "dup";
-    case INST_PLUSI:		return "plusi";
-    case INST_MINUSI:		return "minusi";
-    case INST_MULTI:		return "multi";
-    case INST_DIVI:		return "divi";
-    case INST_PLUSF:		return "plusf";
-    case INST_MINUSF:		return "minusf";
-    case INST_MULTF:		return "multf";
-    case INST_DIVF:		return "divf";
-    case INST_JMP:		return "jmp";
-    case INST_JMP_IF:		return "jmp_if";
-    case INST_EQ:		return "eq";
-    case INST_HALT:		return "halt";
-    case INST_PRINT_DEBUG:	return "print_debug";
-    case INST_SWAP:		return "swap";
-    case INST_NOT:		return "not";
-    case INST_GEF:		return "gef";
-    case INST_RET:		return "ret";
-    case INST_CALL:		return "call";
-    case INST_NATIVE:		return "native";
-    case INST_ANDB:		return "andb";
-    case INST_ORB:		return "orb";
-    case INST_XOR:		return "xor";
-    case INST_SHR:		return "shr";
-    case INST_SHL:		return "shl";
-    case INST_NOTB:		return "notb";
-    case INST_READ8:		return "read8";
-    case INST_READ16:		return "read16";
-    case INST_READ32:		return "read32";
-    case INST_READ64:		return "read64";
-    case INST_WRITE8:		return "write8";
-    case INST_WRITE16:		return "write16";
-    case INST_WRITE32:		return "write32";
-    case INST_WRITE64:		return "write64";
-    case NUMBER_OF_INSTS:
-    default: assert(false && "inst_name: unreachable");
-    }
+  assert(type < NUMBER_OF_INSTS);
+  return inst_defs[type].name;
 }
 
 bool inst_has_operand(Inst_Type type)
 {
-  switch (type) {
-    case INST_NOP:	return false;
-    case INST_PUSH:	return true;
-    case INST_DROP:	return false;
-    case INST_DUP:	return true;
-    case INST_PLUSI:	return false;
-    case INST_MINUSI:	return false;
-    case INST_MULTI:	return false;
-    case INST_DIVI:	return false;
-    case INST_PLUSF:	return false;
-    case INST_MINUSF:	return false;
-    case INST_MULTF:	return false;
-    case INST_DIVF:	return false;
-    case INST_JMP:	return true;
-    case INST_JMP_IF:	return true;
-    case INST_EQ:	return false;
-    case INST_HALT:	return false;
-    case INST_SWAP:	return true;
-    case INST_NOT:	return false;
-    case INST_GEF:	return false;
-    case INST_RET:	return false;
-    case INST_CALL:	return true;
-    case INST_NATIVE:	return true;
-    case INST_ANDB:	return false;
-    case INST_ORB:	return false;
-    case INST_XOR:	return false;
-    case INST_SHR:	return false;
-    case INST_SHL:	return false;
-    case INST_NOTB:	return false;
-    case INST_READ8:	return false;
-    case INST_READ16:	return false;
-    case INST_READ32:	return false;
-    case INST_READ64:	return false;
-    case INST_WRITE8:	return false;
-    case INST_WRITE16:	return false;
-    case INST_WRITE32:	return false;
-    case INST_WRITE64:	return false;
-    case INST_PRINT_DEBUG: return false;
-    case NUMBER_OF_INSTS:
-    default: assert(false && "inst_name: unreachable");
-    }
+  assert(type < NUMBER_OF_INSTS);
+  return inst_defs[type].operand;
+}
+
+
+// `a b jxx label` pops both operands and jumps if `a xx b` holds.
+bool inst_is_cond_jump(Inst_Type type)
+{
+  return type >= INST_JEQ && type <= INST_JGEF;
+}
+
+// Instructions whose operand is a code address.
+bool inst_is_jump(Inst_Type type)
+{
+  return type == INST_JMP || type == INST_JMP_IF || type == INST_CALL
+    || inst_is_cond_jump(type);
+}
+
+bool inst_is_quickened(Inst_Type type)
+{
+  return type >= INST_PUSH0 && type <= INST_SWAP2;
+}
+
+bool inst_is_memory_read(Inst_Type type)
+{
+  return (type >= INST_READ8 && type <= INST_READ64)
+    || (type >= INST_READ16BE && type <= INST_READ64BE);
+}
+
+bool inst_is_memory_write(Inst_Type type)
+{
+  return (type >= INST_WRITE8 && type <= INST_WRITE64)
+    || (type >= INST_WRITE16BE && type <= INST_WRITE64BE);
+}
+
+// How many words below the top an instruction reads and how many it leaves
+// in their place; dup and swap read down to their operand. False for
+// control transfers and natives, whose effect depends on more than the
+// instruction.
+bool inst_stack_effect(Inst_Type type, Word operand, uint64_t *inputs, uint64_t *outputs)
+{
+  assert(type < NUMBER_OF_INSTS);
+  if (type == INST_DUP || type == INST_SWAP) {
+    *inputs = operand.as_u64 + 1;
+    *outputs = operand.as_u64 + 1 + (type == INST_DUP);
+    return true;
+  }
+  if (inst_defs[type].inputs < 0) {
+    return false;
+  }
+  *inputs = (uint64_t) inst_defs[type].inputs;
+  *outputs = (uint64_t) inst_defs[type].outputs;
+  return true;
+}
+
+// f2i and f2u saturate instead of hitting undefined behaviour: NaN is 0
+// and out of range values clamp to the nearest representable one.
+int64_t lvm_f64_to_i64(double x)
+{
+  if (x != x) {
+    return 0;
+  }
+  if (x >= 9223372036854775808.0) {
+    return INT64_MAX;
+  }
+  if (x < -9223372036854775808.0) {
+    return INT64_MIN;
+  }
+  return (int64_t) x;
+}
+
+uint64_t lvm_f64_to_u64(double x)
+{
+  if (x != x || x <= 0.0) {
+    return 0;
+  }
+  if (x >= 18446744073709551616.0) {
+    return UINT64_MAX;
+  }
+  return (uint64_t) x;
+}
+
+bool inst_fold_unary(Inst_Type type, Word a, Word *result)
+{
+  if (type == INST_NOT) {
+    result->as_u64 = !a.as_u64;
+  } else if (type == INST_NOTB) {
+    result->as_u64 = ~a.as_u64;
+  } else if (type == INST_I2F) {
+    result->as_f64 = (double) a.as_i64;
+  } else if (type == INST_U2F) {
+    result->as_f64 = (double) a.as_u64;
+  } else if (type == INST_F2I) {
+    result->as_i64 = lvm_f64_to_i64(a.as_f64);
+  } else if (type == INST_F2U) {
+    result->as_u64 = lvm_f64_to_u64(a.as_f64);
+  } else {
+    return false;
+  }
+  return true;
 }
 
+// Folds `a b op` into a single word with exactly the semantics of
+// lvm_execute_inst. Returns false if the operation can't be folded.
+// For conditional jumps the result is whether the jump is taken.
+bool inst_fold_binary(Inst_Type type, Word a, Word b, Word *result)
+{
+  if (type == INST_PLUSI) {
+    result->as_u64 = a.as_u64 + b.as_u64;
+  } else if (type == INST_MINUSI) {
+    result->as_u64 = a.as_u64 - b.as_u64;
+  } else if (type == INST_MULTI) {
+    result->as_u64 = a.as_u64 * b.as_u64;
+  } else if (type == INST_DIVI && b.as_u64 != 0) {
+    result->as_u64 = a.as_u64 / b.as_u64;
+  } else if (type == INST_PLUSF) {
+    result->as_f64 = a.as_f64 + b.as_f64;
+  } else if (type == INST_MINUSF) {
+    result->as_f64 = a.as_f64 - b.as_f64;
+  } else if (type == INST_MULTF) {
+    result->as_f64 = a.as_f64 * b.as_f64;
+  } else if (type == INST_DIVF) {
+    result->as_f64 = a.as_f64 / b.as_f64;
+  } else if (type == INST_EQ) {
+    result->as_u64 = b.as_u64 == a.as_u64;
+  } else if (type == INST_GEF) {
+    result->as_u64 = b.as_f64 >= a.as_f64;
+  } else if (type == INST_NE) {
+    result->as_u64 = a.as_u64 != b.as_u64;
+  } else if (type == INST_LTI) {
+    result->as_u64 = a.as_i64 < b.as_i64;
+  } else if (type == INST_LEI) {
+    result->as_u64 = a.as_i64 <= b.as_i64;
+  } else if (type == INST_GTI) {
+    result->as_u64 = a.as_i64 > b.as_i64;
+  } else if (type == INST_GEI) {
+    result->as_u64 = a.as_i64 >= b.as_i64;
+  } else if (type == INST_LTU) {
+    result->as_u64 = a.as_u64 < b.as_u64;
+  } else if (type == INST_LEU) {
+    result->as_u64 = a.as_u64 <= b.as_u64;
+  } else if (type == INST_GTU) {
+    result->as_u64 = a.as_u64 > b.as_u64;
+  } else if (type == INST_GEU) {
+    result->as_u64 = a.as_u64 >= b.as_u64;
+  } else if (type == INST_EQF) {
+    result->as_u64 = a.as_f64 == b.as_f64;
+  } else if (type == INST_NEF) {
+    result->as_u64 = a.as_f64 != b.as_f64;
+  } else if (type == INST_LTF) {
+    result->as_u64 = a.as_f64 < b.as_f64;
+  } else if (type == INST_LEF) {
+    result->as_u64 = a.as_f64 <= b.as_f64;
+  } else if (type == INST_GTF) {
+    result->as_u64 = a.as_f64 > b.as_f64;
+  } else if (type == INST_JEQ) {
+    result->as_u64 = a.as_u64 == b.as_u64;
+  } else if (type == INST_JNE) {
+    result->as_u64 = a.as_u64 != b.as_u64;
+  } else if (type == INST_JLTI) {
+    result->as_u64 = a.as_i64 < b.as_i64;
+  } else if (type == INST_JLEI) {
+    result->as_u64 = a.as_i64 <= b.as_i64;
+  } else if (type == INST_JGTI) {
+    result->as_u64 = a.as_i64 > b.as_i64;
+  } else if (type == INST_JGEI) {
+    result->as_u64 = a.as_i64 >= b.as_i64;
+  } else if (type == INST_JLTU) {
+    result->as_u64 = a.as_u64 < b.as_u64;
+  } else if (type == INST_JLEU) {
+    result->as_u64 = a.as_u64 <= b.as_u64;
+  } else if (type == INST_JGTU) {
+    result->as_u64 = a.as_u64 > b.as_u64;
+  } else if (type == INST_JGEU) {
+    result->as_u64 = a.as_u64 >= b.as_u64;
+  } else if (type == INST_JLTF) {
+    result->as_u64 = a.as_f64 < b.as_f64;
+  } else if (type == INST_JLEF) {
+    result->as_u64 = a.as_f64 <= b.as_f64;
+  } else if (type == INST_JGTF) {
+    result->as_u64 = a.as_f64 > b.as_f64;
+  } else if (type == INST_JGEF) {
+    result->as_u64 = a.as_f64 >= b.as_f64;
+  } else if (type == INST_ANDB) {
+    result->as_u64 = a.as_u64 & b.as_u64;
+  } else if (type == INST_ORB) {
+    result->as_u64 = a.as_u64 | b.as_u64;
+  } else if (type == INST_XOR) {
+    result->as_u64 = a.as_u64 ^ b.as_u64;
+  } else if (type == INST_SHR && b.as_u64 < 64) {
+    result->as_u64 = a.as_u64 >> b.as_u64;
+  } else if (type == INST_SHL && b.as_u64 < 64) {
+    result->as_u64 = a.as_u64 << b.as_u64;
+  } else {
+    return false;
+  }
+  return true;
+}
 
 const char *err_as_cstr(Err err);
 const char *inst_type_as_cstr(Inst_Type type);
@@ -241,6 +463,14 @@ const char *err_as_cstr(Err err)
     return "ERR_ILLEGAL_MEMORY_ACCESS";
   case ERR_DIV_BY_ZERO:
     return "ERR_DIV_BY_ZERO";
+  case ERR_WOULD_BLOCK:
+    return "ERR_WOULD_BLOCK";
+  case ERR_OUT_OF_FUEL:
+    return "ERR_OUT_OF_FUEL";
+  case ERR_INTERRUPTED:
+    return "ERR_INTERRUPTED";
+  case ERR_OUT_OF_HEAP:
+    return "ERR_OUT_OF_HEAP";
   default:
     assert(0 && "err_as_cstr: Unreachable");
   }
@@ -251,10 +481,193 @@ typedef struct {
   Word operand;
 } Inst;
 
+// .lvm file layout: LVM_File_Meta, then `natives_size` import names of
+// LVM_NATIVE_NAME_CAPACITY bytes each, then `symbols_size` LVM_Symbols,
+// then `program_size` Insts, then `data_size` bytes loaded at memory
+// address 0. Version 1 files have no symbols and their meta stops before
+// `symbols_size`, version 2 files have no data and it stops before
+// `data_size`.
+#define LVM_FILE_MAGIC 0x004D564C // "LVM\0"
+#define LVM_FILE_VERSION 3
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t program_size;
+  uint64_t natives_size;
+  uint64_t symbols_size;
+  uint64_t data_size;
+} LVM_File_Meta;
+
+// A code label, kept for the disassembler and trace decoder.
+typedef struct {
+  char name[LVM_SYMBOL_NAME_CAPACITY];
+  Inst_Addr addr;
+} LVM_Symbol;
+
+// Ring buffer of the last LVM_TRACE_CAPACITY control transfers. Only an
+// instruction that does not fall through to pc + 1 (a taken jump, call,
+// ret, halt) is recorded, with the pc it went to and the stack right
+// after it; the instructions in between are straight-line and the decoder
+// recovers them from the program. The whole struct is the on-disk format
+// of a .trace dump. Entry `count - 1` (modulo the capacity) is the most
+// recent one.
+#define LVM_TRACE_MAGIC 0x5254564C // "LVTR"
+#define LVM_TRACE_VERSION 1
+// set in Trace_Entry.type when the register engine ran a whole block
+#define LVM_TRACE_BLOCK 0x8000
+// set in Trace_Entry.type for the instruction the run stopped at
+#define LVM_TRACE_STOP 0x4000
+// `reason` for dumps caused by a signal, or'ed with the signal number
+#define LVM_TRACE_SIGNAL 0x10000
+
+static_assert((LVM_TRACE_CAPACITY & (LVM_TRACE_CAPACITY - 1)) == 0,
+              "LVM_TRACE_CAPACITY is expected to be a power of two");
+
+typedef struct {
+  uint64_t top;
+  uint32_t pc;
+  uint32_t next;
+  uint32_t stack_size;
+  uint32_t type;
+} LVM_Trace_Entry;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t count;
+  uint32_t capacity;
+  uint32_t reason;
+  LVM_Trace_Entry entries[LVM_TRACE_CAPACITY];
+} LVM_Trace;
+
 typedef struct LVM LVM;
 
 typedef Err (*LVM_Native)(LVM*);
 
+// A native slot. Exactly one of `native` (host natives that see the whole
+// VM) and `plugin` (natives that only see their arguments) is set once the
+// slot is linked. `inputs`/`outputs` declare the stack effect.
+typedef struct {
+  char name[LVM_NATIVE_NAME_CAPACITY];
+  LVM_Native native;
+  LVM_Plugin_Native plugin;
+  uint64_t inputs;
+  uint64_t outputs;
+} LVM_Native_Def;
+
+// Natives the host makes available to programs, looked up by name when a
+// program is linked.
+typedef struct {
+  LVM_Native_Def defs[LVM_NATIVES_CAPACITY];
+  size_t defs_size;
+} LVM_Native_Table;
+
+// Memory is allocated a page at a time on the first write; a page that
+// was never written reads as zeros. Pages are shared between a VM and its
+// forks and copied by whichever side writes to one first.
+#define LVM_MEMORY_PAGES ((LVM_MEMORY_CAPACITY + LVM_PAGE_SIZE - 1) / LVM_PAGE_SIZE)
+#define LVM_DIRTY_WORDS ((LVM_MEMORY_PAGES + 63) / 64)
+
+typedef struct {
+  // atomic so that VMs on different threads can share pages
+  _Atomic uint64_t refs;
+  uint8_t bytes[LVM_PAGE_SIZE];
+} LVM_Page;
+
+// A host file mapped into the address space. Segment i starts at
+// (i + 1) << LVM_SEGMENT_SHIFT, far above the VM memory, so any file up
+// to 1TB fits and the address of a segment never depends on the others.
+#define LVM_SEGMENT_SHIFT 40
+
+typedef struct {
+  uint8_t *data;
+  uint64_t size;
+  bool writable;
+} LVM_Segment;
+
+// What the print natives write, passed to `fd` in batches: when the buffer
+// fills up, on out_flush and by lvm_output_flush() once the run is over.
+// In binary mode the print natives write their word as 8 little-endian
+// bytes and dump_memory the bytes themselves instead of a line of text.
+typedef struct {
+  int fd;
+  bool binary;
+  size_t size;
+  char bytes[LVM_OUTPUT_CAPACITY];
+} LVM_Output;
+
+// Objects live in one arena and are referenced through a table of
+// handles, so the collector can move them without touching the words that
+// refer to them. A handle is LVM_HEAP_HANDLE_TAG | generation << 32 | index
+// into the table. The slot keeps the generation in the same bits and bumps
+// it whenever its object dies, so a handle kept past that no longer
+// resolves, even once the slot is reused (until 65536 reuses wrap around).
+//
+// Allocation bumps `size`. Everything above `old` is the nursery: when it
+// fills up a minor collection compacts it and promotes the survivors, and
+// when the arena fills up a major collection compacts all of it. Roots are
+// the words on the stack that are handles of live objects, and word arrays
+// are traced the same way. Handles that are only kept in memory do not
+// keep an object alive.
+#define LVM_HEAP_HANDLE_TAG 0x4C56000000000000ull
+#define LVM_HEAP_HANDLE_MASK 0xFFFF000000000000ull
+#define LVM_HEAP_GENERATION_MASK 0x0000FFFF00000000ull
+#define LVM_HEAP_INDEX_MASK 0x00000000FFFFFFFFull
+// A slot of the handle table holds its generation | the offset of the
+// object. A free slot holds LVM_HEAP_FREE_SLOT | its generation | the next
+// free slot, counting from 1 so that 0 ends the list.
+#define LVM_HEAP_FREE_SLOT (1ull << 63)
+
+typedef enum {
+  LVM_OBJECT_BYTES = 0,
+  LVM_OBJECT_WORDS,
+  LVM_OBJECT_STRING,
+} LVM_Object_Type;
+
+#define LVM_OBJECT_MARKED 1
+// an old word array that may hold handles of nursery objects
+#define LVM_OBJECT_REMEMBERED 2
+
+// Followed by `length` bytes or words, padded to a whole word.
+typedef struct {
+  uint64_t length;
+  uint32_t handle;
+  uint8_t type;
+  uint8_t flags;
+} LVM_Object;
+
+typedef struct {
+  uint8_t *bytes;
+  uint64_t capacity;
+  uint64_t size;
+  // [0, old) survived a collection, [old, size) is the nursery
+  uint64_t old;
+
+  // generation and offset of each object in `bytes`
+  uint64_t *handles;
+  uint64_t handles_size;
+  size_t handles_capacity;
+  // the first free slot, counting from 1, or 0
+  uint64_t free_handle;
+
+  uint32_t *remembered;
+  size_t remembered_size;
+  size_t remembered_capacity;
+  // objects still to be traced during a collection
+  uint32_t *marks;
+  size_t marks_size;
+  size_t marks_capacity;
+
+  // A parallel_for worker's view of its parent's heap: objects can be read
+  // and written, but nothing is allocated or moved.
+  bool borrowed;
+
+  uint64_t allocated;
+  uint64_t minor_collections;
+  uint64_t major_collections;
+} LVM_Heap;
+
 struct LVM {
     Word stack[LVM_STACK_CAPACITY];
     uint64_t stack_size;
@@ -263,640 +676,2090 @@ struct LVM {
     uint64_t program_size;
     Inst_Addr pc;
 
-    LVM_Native natives[LVM_NATIVES_CAPACITY];
+    // Imported natives: the `native` operand indexes this table. The names
+    // come from the .lvm file, the functions from lvm_link_natives().
+    LVM_Native_Def natives[LVM_NATIVES_CAPACITY];
     size_t natives_size;
 
-    uint8_t memory[LVM_MEMORY_CAPACITY];
+    // Code labels, from the .lvm file. Only used for diagnostics.
+    LVM_Symbol symbols[LVM_SYMBOLS_CAPACITY];
+    size_t symbols_size;
+
+    LVM_Page *pages[LVM_MEMORY_PAGES];
+    // memory [0, data_size) is the data segment of the .lvm file
+    uint64_t data_size;
+    // Pages this VM got a copy of, or a new one, since it was forked or
+    // reset: all that lvm_reset() has to put back.
+    uint64_t dirty[LVM_DIRTY_WORDS];
+
+    // Shared with forks, unmapped by the VM that mapped them.
+    LVM_Segment segments[LVM_SEGMENTS_CAPACITY];
+    size_t segments_size;
 
     int halt;
+
+    // NULL unless tracing is enabled
+    LVM_Trace *trace;
+
+    // Shared with forks. NULL: the natives print through stdio.
+    LVM_Output *output;
+
+    // Copied by forks, released with the memory.
+    LVM_Heap heap;
+
+    // How many instructions the current run may take, 0 for no limit. Fuel
+    // is charged a straight run of instructions at a time, whenever control
+    // goes somewhere else than the next instruction, and only checked at
+    // back-edges and calls: a run can go over by one forward path.
+    uint64_t fuel_limit;
+    uint64_t fuel_used;
+    // where the straight run that is not charged yet started
+    Inst_Addr fuel_run;
 };
 
+// Set it, e.g. from a timer signal, to stop every VM at its next back-edge
+// or call with ERR_INTERRUPTED.
+volatile sig_atomic_t lvm_interrupt = 0;
+
+// Runs until the VM halts or fails; `counts` is only used by the variants
+// that profile.
+typedef Err (*LVM_Run)(LVM *lvm, uint64_t *counts);
+
+#define LVM_RUN_FUEL 1
+#define LVM_RUN_TRACE 2
+#define LVM_RUN_PROFILE 4
+#define LVM_RUN_VARIANTS 8
 
 Err lvm_execute_inst(LVM* lvm);
-Err lvm_execute_program(LVM *lvm, int limit);
+Err lvm_transfer(LVM *lvm, Inst_Addr last, Inst_Type type);
+void lvm_fuel_begin(LVM *lvm, int64_t limit);
+Err lvm_fuel_end(LVM *lvm, Err err);
+uint64_t lvm_fuel_spent(const LVM *lvm);
+Err lvm_execute_program(LVM *lvm, int64_t limit);
+Err lvm_execute_program_counted(LVM *lvm, int64_t limit, uint64_t *counts);
+Inst inst_quicken(Inst inst);
+Inst inst_dequicken(Inst inst);
+size_t lvm_quicken(LVM *lvm);
+void lvm_dequicken(LVM *lvm);
 void lvm_dump_stack(FILE* stream, const LVM* lvm);
 
-void lvm_push_native(LVM* lvm, LVM_Native native);
+void lvm_native_table_push(LVM_Native_Table *table, LVM_Native_Def def);
+void lvm_native_def_set_name(LVM_Native_Def *def, String_View name);
+void lvm_register_native(LVM_Native_Table *table, const char *name,
+                         LVM_Native native, uint64_t inputs, uint64_t outputs);
+void lvm_register_plugin_native(LVM_Native_Table *table, const LVM_Plugin_Def *def);
+void lvm_register_builtin_natives(LVM_Native_Table *table);
+size_t lvm_push_import(LVM *lvm, String_View name);
+const char *lvm_try_link_natives(LVM *lvm, const LVM_Native_Table *table);
+void lvm_link_natives(LVM *lvm, const LVM_Native_Table *table);
 void lvm_load_program_from_memory(LVM* lvm, Inst * program,size_t program_size);
+bool lvm_read_program(LVM *lvm, FILE *f, const char *file_path, char *error, size_t error_size);
 void lvm_load_program_from_file(LVM* lvm, const char* file_path);
 void lvm_save_program_to_file(const LVM* lvm, const char* file_path);
-
-void lvm_push_native(LVM* lvm, LVM_Native native) {
-  assert(lvm->natives_size < LVM_NATIVES_CAPACITY);
-  lvm->natives[lvm->natives_size++] = native;
+void lvm_push_symbol(LVM *lvm, String_View name, Inst_Addr addr);
+const LVM_Symbol *lvm_find_symbol(const LVM *lvm, Inst_Addr addr);
+uint64_t lvm_bswap64(uint64_t x);
+Err lvm_memory_load(const LVM *lvm, Memory_Addr addr, size_t size, bool big_endian, uint64_t *value);
+Err lvm_memory_store(LVM *lvm, Memory_Addr addr, size_t size, bool big_endian, uint64_t value);
+Err lvm_memory_cell(LVM *lvm, Memory_Addr addr, size_t size, bool write, void **cell);
+Err lvm_execute_atomic(LVM *lvm, Inst_Type type);
+Err lvm_memory_read(const LVM *lvm, Memory_Addr addr, void *dst, size_t size);
+Err lvm_memory_read_slow(const LVM *lvm, Memory_Addr addr, void *dst, size_t size);
+Err lvm_memory_write(LVM *lvm, Memory_Addr addr, const void *src, size_t size);
+Err lvm_memory_write_slow(LVM *lvm, Memory_Addr addr, const void *src, size_t size);
+bool lvm_memory_contains(const LVM *lvm, Memory_Addr addr, uint64_t size);
+uint8_t *lvm_segment_bytes(const LVM *lvm, Memory_Addr addr, uint64_t size, bool write);
+Memory_Addr lvm_segment_map(LVM *lvm, const char *file_path, bool writable);
+void lvm_segments_unmap(LVM *lvm);
+LVM_Page *lvm_memory_page_for_write(LVM *lvm, size_t index);
+bool lvm_memory_equal(const LVM *a, const LVM *b);
+void lvm_memory_release(LVM *lvm);
+void lvm_fork(LVM *child, const LVM *parent);
+void lvm_reset(LVM *lvm, const LVM *pristine);
+LVM_Object *lvm_heap_object(const LVM_Heap *heap, Word handle);
+Err lvm_heap_alloc(LVM *lvm, LVM_Object_Type type, uint64_t length, Word *handle);
+void lvm_heap_collect(LVM *lvm, bool major);
+void lvm_heap_promote(LVM_Heap *heap);
+void lvm_heap_remember(LVM_Heap *heap, LVM_Object *array, Word value);
+void lvm_heap_copy(LVM_Heap *dst, const LVM_Heap *src);
+bool lvm_heap_equal(const LVM_Heap *a, const LVM_Heap *b);
+void lvm_heap_release(LVM_Heap *heap);
+void lvm_output_write(LVM_Output *output, const void *data, size_t size);
+void lvm_output_flush(LVM_Output *output);
+void lvm_output_word(LVM_Output *output, Word word);
+void lvm_printf(LVM *lvm, const char *format, ...);
+size_t lvm_format_u64(char *text, uint64_t x);
+size_t lvm_format_i64(char *text, int64_t x);
+size_t lvm_format_f64(char *text, double x);
+void lvm_trace_init(LVM_Trace *trace);
+void lvm_trace_record(LVM *lvm, Inst_Addr pc, uint32_t type);
+void lvm_trace_save(const LVM_Trace *trace, const char *file_path);
+void lvm_trace_load(LVM_Trace *trace, const char *file_path);
+
+void lvm_native_table_push(LVM_Native_Table *table, LVM_Native_Def def)
+{
+  if (table->defs_size >= LVM_NATIVES_CAPACITY) {
+    fprintf(stderr, "ERROR: too many natives registered, the capacity is %d\n",
+            LVM_NATIVES_CAPACITY);
+    exit(1);
+  }
+  table->defs[table->defs_size++] = def;
 }
 
-Err lvm_execute_inst(LVM* lvm) {
-  if (lvm->pc >= lvm->program_size) {
-    return ERR_ILLEGAL_INST_ACCESS;
+void lvm_native_def_set_name(LVM_Native_Def *def, String_View name)
+{
+  if (name.count >= LVM_NATIVE_NAME_CAPACITY) {
+    fprintf(stderr, "ERROR: native name `%.*s` is longer than %d characters\n",
+            SV_FORMAT(name), LVM_NATIVE_NAME_CAPACITY - 1);
+    exit(1);
   }
+  memset(def->name, 0, sizeof(def->name));
+  memcpy(def->name, name.data, name.count);
+}
 
-  Inst inst = lvm->program[lvm->pc];
+void lvm_register_native(LVM_Native_Table *table, const char *name,
+                         LVM_Native native, uint64_t inputs, uint64_t outputs)
+{
+  LVM_Native_Def def = {0};
+  lvm_native_def_set_name(&def, cstr_as_sv(name));
+  def.native = native;
+  def.inputs = inputs;
+  def.outputs = outputs;
+  lvm_native_table_push(table, def);
+}
 
-  switch (inst.type) {
-  case INST_NOP: 
-    lvm->pc += 1;
-    break;
-  
-  case INST_PUSH:
-    if (lvm->stack_size >= LVM_STACK_CAPACITY) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    lvm->stack[lvm->stack_size++]= inst.operand;
-    lvm->pc += 1;
-    break;
-  case INST_DROP:
-    if (lvm->stack_size < 1) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    lvm->stack_size -= 1;
-    lvm->pc += 1;
-    break;
-  case INST_PLUSI:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    lvm->stack[lvm->stack_size - 2].as_u64 += lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->stack_size -=1;
-    lvm->pc +=1;
-    break;
-  case INST_MINUSI:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    lvm->stack[lvm->stack_size - 2].as_u64 -= lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->stack_size -=1;
-    lvm->pc +=1;
-    break;
-  case INST_DIVI:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    if (lvm->stack[lvm->stack_size -1].as_u64 == 0) {
-      return ERR_DIV_BY_ZERO;
-    }
-    lvm->stack[lvm->stack_size - 2].as_u64 /= lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->stack_size -=1;
-    lvm->pc +=1;
-    break;
-  case INST_MULTI:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    lvm->stack[lvm->stack_size - 2].as_u64 *= lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->stack_size -=1;
-    lvm->pc +=1;
-    break;
-  case INST_PLUSF:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
-    }
+void lvm_register_plugin_native(LVM_Native_Table *table, const LVM_Plugin_Def *plugin)
+{
+  LVM_Native_Def def = {0};
+  lvm_native_def_set_name(&def, cstr_as_sv(plugin->name));
+  def.plugin = plugin->native;
+  def.inputs = plugin->inputs;
+  def.outputs = plugin->outputs;
+  lvm_native_table_push(table, def);
+}
 
-    lvm->stack[lvm->stack_size - 2].as_f64 += lvm->stack[lvm->stack_size - 1].as_f64;
-    lvm->stack_size -= 1;
-    lvm->pc += 1;
-    break;
-  case INST_MINUSF:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
-    }
+size_t lvm_push_import(LVM *lvm, String_View name)
+{
+  assert(lvm->natives_size < LVM_NATIVES_CAPACITY);
+  LVM_Native_Def *def = &lvm->natives[lvm->natives_size];
+  memset(def, 0, sizeof(*def));
+  lvm_native_def_set_name(def, name);
+  return lvm->natives_size++;
+}
 
-    lvm->stack[lvm->stack_size - 2].as_f64 -= lvm->stack[lvm->stack_size - 1].as_f64;
-    lvm->stack_size -= 1;
-    lvm->pc += 1;
-    break;
-  case INST_MULTF:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+// NULL once every import is linked, otherwise the name of the first one
+// that `table` lacks.
+const char *lvm_try_link_natives(LVM *lvm, const LVM_Native_Table *table)
+{
+  for (size_t i = 0; i < lvm->natives_size; ++i) {
+    LVM_Native_Def *import = &lvm->natives[i];
+    bool found = false;
+    // Search from the end so later registrations (plugins) override
+    // earlier ones (builtins) with the same name.
+    for (size_t j = table->defs_size; j > 0 && !found; --j) {
+      if (strcmp(table->defs[j - 1].name, import->name) == 0) {
+        *import = table->defs[j - 1];
+        found = true;
+      }
     }
 
-    lvm->stack[lvm->stack_size - 2].as_f64 *= lvm->stack[lvm->stack_size - 1].as_f64;
-    lvm->stack_size -= 1;
-    lvm->pc += 1;
-    break;
-  case INST_DIVF:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+    if (!found) {
+      return import->name;
     }
+  }
+  return NULL;
+}
 
-    lvm->stack[lvm->stack_size - 2].as_f64 /= lvm->stack[lvm->stack_size - 1].as_f64;
-    lvm->stack_size -= 1;
-    lvm->pc += 1;
-    break;
-  case INST_JMP:
-    lvm->pc = inst.operand.as_u64;
-    break;
-  case INST_RET:
+void lvm_link_natives(LVM *lvm, const LVM_Native_Table *table)
+{
+  const char *missing = lvm_try_link_natives(lvm, table);
+  if (missing != NULL) {
+    fprintf(stderr, "ERROR: unknown native `%s`\n", missing);
+    exit(1);
+  }
+}
+
+Err lvm_alloc(LVM *lvm);
+Err lvm_free(LVM *lvm);
+Err lvm_print_f64(LVM *lvm);
+Err lvm_print_i64(LVM *lvm);
+Err lvm_print_u64(LVM *lvm);
+Err lvm_print_ptr(LVM *lvm);
+Err lvm_dump_memory(LVM *lvm);
+Err lvm_map_file(LVM *lvm);
+Err lvm_segment_size(LVM *lvm);
+Err lvm_region_nop(LVM *lvm);
+Err lvm_out_bytes(LVM *lvm);
+Err lvm_out_flush(LVM *lvm);
+Err lvm_heap_bytes(LVM *lvm);
+Err lvm_heap_words(LVM *lvm);
+Err lvm_heap_string(LVM *lvm);
+Err lvm_heap_length(LVM *lvm);
+Err lvm_heap_get(LVM *lvm);
+Err lvm_heap_set(LVM *lvm);
+Err lvm_heap_read(LVM *lvm);
+Err lvm_heap_gc(LVM *lvm);
+
+Err lvm_alloc(LVM *lvm)
+{
     if (lvm->stack_size < 1) {
-      return ERR_STACK_UNDERFLOW;
+        return ERR_STACK_UNDERFLOW;
     }
 
-    lvm->pc = lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->stack_size -= 1;
-    break;
-  case INST_CALL:
-    if (lvm->stack_size >= LVM_STACK_CAPACITY) {
-      return ERR_STACK_OVERFLOW;
-    }
+    lvm->stack[lvm->stack_size - 1].as_ptr = malloc(lvm->stack[lvm->stack_size - 1].as_u64);
 
-    lvm->stack[lvm->stack_size++].as_u64 = lvm->pc + 1;
-    lvm->pc = inst.operand.as_u64;
-    break;
-  case INST_NATIVE:
-    if (inst.operand.as_u64 > lvm->natives_size) {
-      return ERR_ILLEGAL_OPERAND;
-    }
-    const Err err = lvm->natives[inst.operand.as_u64](lvm);
-    if (err != ERR_OK) {
-      return err;
-    }
-    lvm->pc += 1;
-    break;
-  case INST_HALT:
-    lvm->halt = 1;
-    break;
-  case INST_EQ:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 1].as_u64 == lvm->stack[lvm->stack_size - 2].as_u64;
-    lvm->stack_size -=1;
-    lvm->pc +=1;
-    break;
-  case INST_GEF:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+    return ERR_OK;
+}
+
+Err lvm_free(LVM *lvm)
+{
+    if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
     }
 
-    lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 1].as_f64 >= lvm->stack[lvm->stack_size - 2].as_f64;
+    free(lvm->stack[lvm->stack_size - 1].as_ptr);
     lvm->stack_size -= 1;
-    lvm->pc += 1;
-    break;
-  case INST_JMP_IF:
+
+    return ERR_OK;
+}
+
+Err lvm_print_f64(LVM *lvm)
+{
     if (lvm->stack_size < 1) {
-      return ERR_STACK_UNDERFLOW;
+        return ERR_STACK_UNDERFLOW;
     }
-    if (lvm->stack[lvm->stack_size -1].as_u64) {
-      lvm->pc = inst.operand.as_u64;
-    }else {
-      lvm->pc += 1;
+
+    const Word value = lvm->stack[lvm->stack_size - 1];
+    if (lvm->output == NULL) {
+        printf("%lf\n", value.as_f64);
+    } else if (lvm->output->binary) {
+        lvm_output_word(lvm->output, value);
+    } else {
+        char text[LVM_FORMAT_CAPACITY];
+        size_t n = lvm_format_f64(text, value.as_f64);
+        text[n++] = '\n';
+        lvm_output_write(lvm->output, text, n);
     }
     lvm->stack_size -= 1;
-    break;
-  case INST_PRINT_DEBUG:
-    if (lvm->stack_size < 1) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    fprintf(stdout, "  u64: %" PRIu64 ", i64: %" PRId64 ", f64: %lf, ptr: %p\n",
-            lvm->stack[lvm->stack_size - 1].as_u64,
-            lvm->stack[lvm->stack_size - 1].as_i64,
-            lvm->stack[lvm->stack_size - 1].as_f64,
-            lvm->stack[lvm->stack_size - 1].as_ptr);
-    lvm->stack_size -=1;
-    lvm->pc +=1;
-    break;
-  case INST_DUP:
-    if (lvm->stack_size >= LVM_STACK_CAPACITY) {
-      return ERR_STACK_OVERFLOW;
-    }
-    if (lvm->stack_size - inst.operand.as_u64 <=0) {
-      return ERR_STACK_UNDERFLOW;
-    }
-
-    lvm->stack[lvm->stack_size] = lvm->stack[lvm->stack_size - 1 - inst.operand.as_u64];
-    lvm->stack_size += 1;
-    lvm->pc += 1;
-    break;
-  case INST_SWAP:
-    if (inst.operand.as_u64 >= lvm->stack_size) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    const uint64_t a = lvm->stack_size - 1;
-    const uint64_t b = lvm->stack_size - 1 - inst.operand.as_u64;
-    Word t = lvm->stack[a];
-    lvm->stack[a] = lvm->stack[b];
-    lvm->stack[b] = t;
-    lvm->pc += 1;
-    break;
-  case INST_NOT:
+    return ERR_OK;
+}
+
+Err lvm_print_i64(LVM *lvm)
+{
     if (lvm->stack_size < 1) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    lvm->stack[lvm->stack_size - 1].as_u64 = !lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->pc += 1;
-    break;
-  case INST_ANDB:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+        return ERR_STACK_UNDERFLOW;
     }
 
-    lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 & lvm->stack[lvm->stack_size - 1].as_u64;
+    const Word value = lvm->stack[lvm->stack_size - 1];
+    if (lvm->output == NULL) {
+        printf("%" PRId64 "\n", value.as_i64);
+    } else if (lvm->output->binary) {
+        lvm_output_word(lvm->output, value);
+    } else {
+        char text[LVM_FORMAT_CAPACITY];
+        size_t n = lvm_format_i64(text, value.as_i64);
+        text[n++] = '\n';
+        lvm_output_write(lvm->output, text, n);
+    }
     lvm->stack_size -= 1;
-    lvm->pc += 1;
-
-    break;
+    return ERR_OK;
+}
 
-  case INST_ORB:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+Err lvm_print_u64(LVM *lvm)
+{
+    if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
     }
 
-    lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 | lvm->stack[lvm->stack_size - 1].as_u64;
+    const Word value = lvm->stack[lvm->stack_size - 1];
+    if (lvm->output == NULL) {
+        printf("%" PRIu64 "\n", value.as_u64);
+    } else if (lvm->output->binary) {
+        lvm_output_word(lvm->output, value);
+    } else {
+        char text[LVM_FORMAT_CAPACITY];
+        size_t n = lvm_format_u64(text, value.as_u64);
+        text[n++] = '\n';
+        lvm_output_write(lvm->output, text, n);
+    }
     lvm->stack_size -= 1;
-    lvm->pc += 1;
-    break;
+    return ERR_OK;
+}
 
-  case INST_XOR:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+Err lvm_print_ptr(LVM *lvm)
+{
+    if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
     }
 
-    lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 ^ lvm->stack[lvm->stack_size - 1].as_u64;
+    if (lvm->output != NULL && lvm->output->binary) {
+        lvm_output_word(lvm->output, lvm->stack[lvm->stack_size - 1]);
+    } else {
+        lvm_printf(lvm, "%p\n", lvm->stack[lvm->stack_size - 1].as_ptr);
+    }
     lvm->stack_size -= 1;
-    lvm->pc += 1;
-    break;
+    return ERR_OK;
+}
 
-  case INST_SHR:
+Err lvm_dump_memory(LVM *lvm)
+{
     if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+        return ERR_STACK_UNDERFLOW;
     }
 
-    lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 >> lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->stack_size -= 1;
-    lvm->pc += 1;
-    break;
+    Memory_Addr addr = lvm->stack[lvm->stack_size - 2].as_u64;
+    uint64_t count = lvm->stack[lvm->stack_size - 1].as_u64;
 
-  case INST_SHL:
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+    if (!lvm_memory_contains(lvm, addr, count)) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
     }
 
-    lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 << lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->stack_size -= 1;
-    lvm->pc += 1;
-    break;
-
-  case INST_NOTB:
-    if (lvm->stack_size < 1) {
-      return ERR_STACK_UNDERFLOW;
+    if (lvm->output != NULL && lvm->output->binary) {
+        return lvm_out_bytes(lvm);
     }
 
-    lvm->stack[lvm->stack_size - 1].as_u64 = ~lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->pc += 1;
-    break;
-  case INST_READ8: {
-    if (lvm->stack_size < 1) {
-      return ERR_STACK_UNDERFLOW;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint8_t byte;
+        lvm_memory_read(lvm, addr + i, &byte, 1);
+        lvm_printf(lvm, "%02X ", byte);
     }
-    const Memory_Addr addr = lvm->stack[lvm->stack_size - 1].as_u64;
-    if (addr >= LVM_MEMORY_CAPACITY) {
-      return ERR_ILLEGAL_MEMORY_ACCESS;
+    lvm_printf(lvm, "\n");
+
+    lvm->stack_size -= 2;
+
+    return ERR_OK;
+}
+
+// path_addr path_size writable -- addr
+// The path is read from the VM memory. Pushes 0 if the file can't be mapped.
+Err lvm_map_file(LVM *lvm)
+{
+    if (lvm->stack_size < 3) {
+        return ERR_STACK_UNDERFLOW;
     }
-    lvm->stack[lvm->stack_size - 1].as_u64 = lvm->memory[addr];
-    lvm->pc += 1;
-  } break;
 
-  case INST_READ16: {
-    if (lvm->stack_size < 1) {
-      return ERR_STACK_UNDERFLOW;
+    const Memory_Addr path_addr = lvm->stack[lvm->stack_size - 3].as_u64;
+    const uint64_t path_size = lvm->stack[lvm->stack_size - 2].as_u64;
+    const bool writable = lvm->stack[lvm->stack_size - 1].as_u64 != 0;
+
+    char path[LVM_SEGMENT_PATH_CAPACITY];
+    if (path_size >= sizeof(path)) {
+        return ERR_ILLEGAL_OPERAND;
     }
-    const Memory_Addr addr = lvm->stack[lvm->stack_size - 1].as_u64;
-    if (addr >= LVM_MEMORY_CAPACITY - 1) {
-      return ERR_ILLEGAL_MEMORY_ACCESS;
+    const Err err = lvm_memory_read(lvm, path_addr, path, path_size);
+    if (err != ERR_OK) {
+        return err;
     }
-    lvm->stack[lvm->stack_size - 1].as_u64 = *(uint16_t*)&lvm->memory[addr];
-    lvm->pc += 1;
-  } break;
+    path[path_size] = '\0';
 
-  case INST_READ32: {
+    lvm->stack[lvm->stack_size - 3].as_u64 = lvm_segment_map(lvm, path, writable);
+    lvm->stack_size -= 2;
+    return ERR_OK;
+}
+
+// addr -- size
+// Size of the segment starting at `addr`, 0 if there is none.
+Err lvm_segment_size(LVM *lvm)
+{
     if (lvm->stack_size < 1) {
-      return ERR_STACK_UNDERFLOW;
+        return ERR_STACK_UNDERFLOW;
     }
+
     const Memory_Addr addr = lvm->stack[lvm->stack_size - 1].as_u64;
-    if (addr >= LVM_MEMORY_CAPACITY - 3) {
-      return ERR_ILLEGAL_MEMORY_ACCESS;
+    const uint64_t index = addr >> LVM_SEGMENT_SHIFT;
+    uint64_t size = 0;
+    if (index > 0 && index <= lvm->segments_size && addr == index << LVM_SEGMENT_SHIFT) {
+        size = lvm->segments[index - 1].size;
     }
-    lvm->stack[lvm->stack_size - 1].as_u64 = *(uint32_t*)&lvm->memory[addr];
-    lvm->pc += 1;
-  } break;
+    lvm->stack[lvm->stack_size - 1].as_u64 = size;
+    return ERR_OK;
+}
 
-  case INST_READ64: {
+// Without --perf regions cost nothing: the id is dropped.
+Err lvm_region_nop(LVM *lvm)
+{
     if (lvm->stack_size < 1) {
-      return ERR_STACK_UNDERFLOW;
-    }
-    const Memory_Addr addr = lvm->stack[lvm->stack_size - 1].as_u64;
-    if (addr >= LVM_MEMORY_CAPACITY - 7) {
-      return ERR_ILLEGAL_MEMORY_ACCESS;
+        return ERR_STACK_UNDERFLOW;
     }
-    lvm->stack[lvm->stack_size - 1].as_u64 = *(uint64_t*)&lvm->memory[addr];
-    lvm->pc += 1;
-  } break;
 
-  case INST_WRITE8: {
+    lvm->stack_size -= 1;
+    return ERR_OK;
+}
+
+// addr size --
+// Bytes from the VM memory, written as they are.
+Err lvm_out_bytes(LVM *lvm)
+{
     if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+        return ERR_STACK_UNDERFLOW;
     }
+
     const Memory_Addr addr = lvm->stack[lvm->stack_size - 2].as_u64;
-    if (addr >= LVM_MEMORY_CAPACITY) {
-      return ERR_ILLEGAL_MEMORY_ACCESS;
+    const uint64_t size = lvm->stack[lvm->stack_size - 1].as_u64;
+    if (!lvm_memory_contains(lvm, addr, size)) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    uint8_t chunk[LVM_PAGE_SIZE];
+    for (uint64_t i = 0; i < size; i += sizeof(chunk)) {
+        const size_t n = size - i < sizeof(chunk) ? (size_t) (size - i) : sizeof(chunk);
+        lvm_memory_read(lvm, addr + i, chunk, n);
+        if (lvm->output != NULL) {
+            lvm_output_write(lvm->output, chunk, n);
+        } else {
+            fwrite(chunk, 1, n, stdout);
+        }
     }
-    lvm->memory[addr] = (uint8_t) lvm->stack[lvm->stack_size - 1].as_u64;
+
     lvm->stack_size -= 2;
-    lvm->pc += 1;
-  } break;
+    return ERR_OK;
+}
 
-  case INST_WRITE16: {
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+Err lvm_out_flush(LVM *lvm)
+{
+    if (lvm->output != NULL) {
+        lvm_output_flush(lvm->output);
+    } else {
+        fflush(stdout);
     }
-    const Memory_Addr addr = lvm->stack[lvm->stack_size - 2].as_u64;
-    if (addr >= LVM_MEMORY_CAPACITY - 1) {
-      return ERR_ILLEGAL_MEMORY_ACCESS;
+    return ERR_OK;
+}
+
+static Err lvm_heap_new(LVM *lvm, LVM_Object_Type type)
+{
+    if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
     }
-    *(uint16_t*)&lvm->memory[addr] = (uint16_t) lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->stack_size -= 2;
-    lvm->pc += 1;
-  } break;
 
-  case INST_WRITE32: {
+    Word handle;
+    const Err err = lvm_heap_alloc(lvm, type, lvm->stack[lvm->stack_size - 1].as_u64, &handle);
+    if (err != ERR_OK) {
+        return err;
+    }
+    lvm->stack[lvm->stack_size - 1] = handle;
+    return ERR_OK;
+}
+
+// length -- handle
+Err lvm_heap_bytes(LVM *lvm)
+{
+    return lvm_heap_new(lvm, LVM_OBJECT_BYTES);
+}
+
+// length -- handle
+Err lvm_heap_words(LVM *lvm)
+{
+    return lvm_heap_new(lvm, LVM_OBJECT_WORDS);
+}
+
+// addr size -- handle
+// A string is a byte buffer copied from memory that can't be changed.
+Err lvm_heap_string(LVM *lvm)
+{
     if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+        return ERR_STACK_UNDERFLOW;
     }
+
     const Memory_Addr addr = lvm->stack[lvm->stack_size - 2].as_u64;
-    if (addr >= LVM_MEMORY_CAPACITY - 3) {
-      return ERR_ILLEGAL_MEMORY_ACCESS;
+    const uint64_t size = lvm->stack[lvm->stack_size - 1].as_u64;
+    if (!lvm_memory_contains(lvm, addr, size)) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
     }
-    *(uint32_t*)&lvm->memory[addr] = (uint32_t) lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->stack_size -= 2;
-    lvm->pc += 1;
-  } break;
 
-  case INST_WRITE64: {
-    if (lvm->stack_size < 2) {
-      return ERR_STACK_UNDERFLOW;
+    Word handle;
+    const Err err = lvm_heap_alloc(lvm, LVM_OBJECT_STRING, size, &handle);
+    if (err != ERR_OK) {
+        return err;
     }
-    const Memory_Addr addr = lvm->stack[lvm->stack_size - 2].as_u64;
-    if (addr >= LVM_MEMORY_CAPACITY - 7) {
-      return ERR_ILLEGAL_MEMORY_ACCESS;
+    LVM_Object *object = lvm_heap_object(&lvm->heap, handle);
+    lvm_memory_read(lvm, addr, object + 1, size);
+    lvm->stack[lvm->stack_size - 2] = handle;
+    lvm->stack_size -= 1;
+    return ERR_OK;
+}
+
+// handle -- length
+Err lvm_heap_length(LVM *lvm)
+{
+    if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
     }
-    *(uint64_t*)&lvm->memory[addr] = lvm->stack[lvm->stack_size - 1].as_u64;
-    lvm->stack_size -= 2;
-    lvm->pc += 1;
-  } break;
 
-  case NUMBER_OF_INSTS:
-  default:
-    return ERR_ILLEGAL_INST;
-  }
-  return ERR_OK;
+    const LVM_Object *object = lvm_heap_object(&lvm->heap, lvm->stack[lvm->stack_size - 1]);
+    if (object == NULL) {
+        return ERR_ILLEGAL_OPERAND;
+    }
+    lvm->stack[lvm->stack_size - 1].as_u64 = object->length;
+    return ERR_OK;
 }
 
-Err lvm_execute_program(LVM *lvm, int limit) {
-  while (limit !=0 &&  ! lvm->halt) {
-    Err err = lvm_execute_inst(lvm);
-    if (err != ERR_OK) {
-      return err;
+// handle index -- value
+// Bytes come out zero-extended.
+Err lvm_heap_get(LVM *lvm)
+{
+    if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
     }
-    if (limit > 0) {
-      --limit;
+
+    const LVM_Object *object = lvm_heap_object(&lvm->heap, lvm->stack[lvm->stack_size - 2]);
+    const uint64_t index = lvm->stack[lvm->stack_size - 1].as_u64;
+    if (object == NULL) {
+        return ERR_ILLEGAL_OPERAND;
+    }
+    if (index >= object->length) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
     }
-  }
 
-  return ERR_OK;
+    if (object->type == LVM_OBJECT_WORDS) {
+        lvm->stack[lvm->stack_size - 2] = ((const Word*) (object + 1))[index];
+    } else {
+        lvm->stack[lvm->stack_size - 2].as_u64 = ((const uint8_t*) (object + 1))[index];
+    }
+    lvm->stack_size -= 1;
+    return ERR_OK;
 }
 
+// handle index value --
+// Only the low byte of `value` is stored into a byte buffer.
+Err lvm_heap_set(LVM *lvm)
+{
+    if (lvm->stack_size < 3) {
+        return ERR_STACK_UNDERFLOW;
+    }
 
-void lvm_dump_stack(FILE* stream, const LVM* lvm) {
-  fprintf(stream, "Stack:\n");
-  if (lvm->stack_size > 0) {
-    for (Inst_Addr i = 0; i < lvm->stack_size; ++i) {
-      fprintf(stream, "  u64: %" PRIu64 ", i64: %" PRId64 ", f64: %lf, ptr: %p\n",
-              lvm->stack[i].as_u64,
-              lvm->stack[i].as_i64,
-              lvm->stack[i].as_f64,
-              lvm->stack[i].as_ptr);
+    LVM_Heap *heap = &lvm->heap;
+    LVM_Object *object = lvm_heap_object(heap, lvm->stack[lvm->stack_size - 3]);
+    const uint64_t index = lvm->stack[lvm->stack_size - 2].as_u64;
+    const Word value = lvm->stack[lvm->stack_size - 1];
+    if (object == NULL || object->type == LVM_OBJECT_STRING) {
+        return ERR_ILLEGAL_OPERAND;
     }
-  }else {
-    fprintf(stream, "  [empty]\n");
-  }
+    if (index >= object->length) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    if (object->type == LVM_OBJECT_WORDS) {
+        ((Word*) (object + 1))[index] = value;
+        lvm_heap_remember(heap, object, value);
+    } else {
+        ((uint8_t*) (object + 1))[index] = (uint8_t) value.as_u64;
+    }
+    lvm->stack_size -= 3;
+    return ERR_OK;
 }
 
+// handle addr --
+// Copies a byte buffer or a string into memory.
+Err lvm_heap_read(LVM *lvm)
+{
+    if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    const LVM_Object *object = lvm_heap_object(&lvm->heap, lvm->stack[lvm->stack_size - 2]);
+    const Memory_Addr addr = lvm->stack[lvm->stack_size - 1].as_u64;
+    if (object == NULL || object->type == LVM_OBJECT_WORDS) {
+        return ERR_ILLEGAL_OPERAND;
+    }
 
-void lvm_load_program_from_memory(LVM* lvm, Inst * program,size_t program_size) {
-  assert(program_size < LVM_PROGRAM_CAPACITY);
-  memcpy(lvm->program,program,sizeof(program[0])* program_size);
-  lvm->program_size = program_size;
+    const Err err = lvm_memory_write(lvm, addr, object + 1, object->length);
+    if (err != ERR_OK) {
+        return err;
+    }
+    lvm->stack_size -= 2;
+    return ERR_OK;
 }
 
-void lvm_load_program_from_file(LVM* lvm, const char* file_path) {
-  FILE* f = fopen(file_path, "rb");
-  if (f==NULL) {
-    fprintf(stderr, "ERROR: Cound not open file %s : %s\n",
-	    file_path,strerror(errno));
-    exit(1);
+// --
+// Runs a major collection.
+Err lvm_heap_gc(LVM *lvm)
+{
+    if (lvm->heap.borrowed) {
+        return ERR_ILLEGAL_OPERAND;
+    }
+    lvm_heap_collect(lvm, true);
+    return ERR_OK;
+}
+
+void lvm_register_builtin_natives(LVM_Native_Table *table)
+{
+  lvm_register_native(table, "alloc",       lvm_alloc,       1, 1);
+  lvm_register_native(table, "free",        lvm_free,        1, 0);
+  lvm_register_native(table, "print_f64",   lvm_print_f64,   1, 0);
+  lvm_register_native(table, "print_i64",   lvm_print_i64,   1, 0);
+  lvm_register_native(table, "print_u64",   lvm_print_u64,   1, 0);
+  lvm_register_native(table, "print_ptr",   lvm_print_ptr,   1, 0);
+  lvm_register_native(table, "dump_memory", lvm_dump_memory, 2, 0);
+  lvm_register_native(table, "region_begin", lvm_region_nop, 1, 0);
+  lvm_register_native(table, "region_end",   lvm_region_nop, 1, 0);
+  lvm_register_native(table, "map_file",     lvm_map_file,     3, 1);
+  lvm_register_native(table, "segment_size", lvm_segment_size, 1, 1);
+  lvm_register_native(table, "out_bytes",    lvm_out_bytes,    2, 0);
+  lvm_register_native(table, "out_flush",    lvm_out_flush,    0, 0);
+  lvm_register_native(table, "heap_bytes",   lvm_heap_bytes,   1, 1);
+  lvm_register_native(table, "heap_words",   lvm_heap_words,   1, 1);
+  lvm_register_native(table, "heap_string",  lvm_heap_string,  2, 1);
+  lvm_register_native(table, "heap_length",  lvm_heap_length,  1, 1);
+  lvm_register_native(table, "heap_get",     lvm_heap_get,     2, 1);
+  lvm_register_native(table, "heap_set",     lvm_heap_set,     3, 0);
+  lvm_register_native(table, "heap_read",    lvm_heap_read,    2, 0);
+  lvm_register_native(table, "heap_collect", lvm_heap_gc,      0, 0);
+}
+
+// Compilers turn this into a single bswap.
+uint64_t lvm_bswap64(uint64_t x)
+{
+  return ((x & 0x00000000000000FFull) << 56) | ((x & 0x000000000000FF00ull) << 40)
+    | ((x & 0x0000000000FF0000ull) << 24) | ((x & 0x00000000FF000000ull) << 8)
+    | ((x & 0x000000FF00000000ull) >> 8) | ((x & 0x0000FF0000000000ull) >> 24)
+    | ((x & 0x00FF000000000000ull) >> 40) | ((x & 0xFF00000000000000ull) >> 56);
+}
+
+// Loads and stores of 1, 2, 4 or 8 byte integers. The VM memory is
+// little-endian on every host; `big_endian` is for the *be instructions.
+// Only memcpy touches the bytes, so any address is fine on any target.
+Err lvm_memory_load(const LVM *lvm, Memory_Addr addr, size_t size, bool big_endian, uint64_t *value)
+{
+  uint64_t x = 0;
+  const Err err = lvm_memory_read(lvm, addr, &x, size);
+  if (err != ERR_OK) {
+    return err;
   }
 
-  //seek to end
-  if (fseek(f, 0, SEEK_END) < 0) {
-    fprintf(stderr, "ERROR: Cound not set position at end of  file %s : %s\n",
-	    file_path,strerror(errno));
-    exit(1);
+  // x has the bytes in address order at its lowest addresses
+  if (big_endian) {
+    x = (LVM_HOST_BIG_ENDIAN ? x : lvm_bswap64(x)) >> (64 - 8 * size);
+  } else if (LVM_HOST_BIG_ENDIAN) {
+    x = lvm_bswap64(x);
   }
+  *value = x;
+  return ERR_OK;
+}
 
-  long m = ftell(f);
-  if (m<0) {
-    fprintf(stderr, "ERROR: Cound not determine length of file %s : %s\n",
-	    file_path,strerror(errno));
-    exit(1);    
+Err lvm_memory_store(LVM *lvm, Memory_Addr addr, size_t size, bool big_endian, uint64_t value)
+{
+  if (big_endian) {
+    value <<= 64 - 8 * size;
+    value = LVM_HOST_BIG_ENDIAN ? value : lvm_bswap64(value);
+  } else if (LVM_HOST_BIG_ENDIAN) {
+    value = lvm_bswap64(value);
   }
+  return lvm_memory_write(lvm, addr, &value, size);
+}
 
-  assert((size_t) m % sizeof(lvm->program[0]) == 0);
-  assert((size_t) m <= LVM_PROGRAM_CAPACITY * sizeof(lvm->program[0]));
+static_assert(LVM_MEMORY_CAPACITY % 8 == 0,
+              "An aligned atomic cell has to fit in memory whenever its address does");
 
-  if (fseek(f, 0, SEEK_SET) < 0) {
-        fprintf(stderr, "ERROR: Could not rewind file %s : %s\n",
-                file_path, strerror(errno));
-        exit(1);
-    }
+// Where an atomic access goes. Atomic cells are naturally aligned, so they
+// never straddle a page or the end of a segment.
+Err lvm_memory_cell(LVM *lvm, Memory_Addr addr, size_t size, bool write, void **cell)
+{
+  if (addr % size != 0) {
+    return ERR_ILLEGAL_MEMORY_ACCESS;
+  }
+  if (addr < LVM_MEMORY_CAPACITY) {
+    *cell = &lvm_memory_page_for_write(lvm, addr / LVM_PAGE_SIZE)->bytes[addr % LVM_PAGE_SIZE];
+    return ERR_OK;
+  }
+  *cell = lvm_segment_bytes(lvm, addr, size, write);
+  return *cell != NULL ? ERR_OK : ERR_ILLEGAL_MEMORY_ACCESS;
+}
 
-  lvm->program_size = fread(lvm->program, sizeof(lvm->program[0]), (size_t) m / sizeof(lvm->program[0]), f);
+#define LVM_LE32(x) (LVM_HOST_BIG_ENDIAN ? (uint32_t) (lvm_bswap64(x) >> 32) : (uint32_t) (x))
+#define LVM_LE64(x) (LVM_HOST_BIG_ENDIAN ? lvm_bswap64(x) : (uint64_t) (x))
+
+// op: 0 aread, 1 awrite, 2 aadd, 3 acas. Cells hold little-endian values
+// like the rest of memory, so a big-endian host adds with a CAS loop.
+#define LVM_ATOMIC(name, type, le)                                            \
+  static uint64_t name(void *cell, size_t op, const Word *args)               \
+  {                                                                           \
+    _Atomic type *p = cell;                                                   \
+    type old;                                                                 \
+    switch (op) {                                                             \
+    case 0:                                                                   \
+      return le(atomic_load_explicit(p, memory_order_acquire));               \
+    case 1:                                                                   \
+      atomic_store_explicit(p, le(args[1].as_u64), memory_order_release);     \
+      return 0;                                                               \
+    case 2:                                                                   \
+      if (!LVM_HOST_BIG_ENDIAN) {                                             \
+        return atomic_fetch_add_explicit(p, (type) args[1].as_u64, memory_order_acq_rel); \
+      }                                                                       \
+      old = atomic_load_explicit(p, memory_order_relaxed);                    \
+      while (!atomic_compare_exchange_weak_explicit(p, &old, le(le(old) + args[1].as_u64), \
+                                                    memory_order_acq_rel, memory_order_relaxed)) {} \
+      return le(old);                                                         \
+    default:                                                                  \
+      old = le(args[1].as_u64);                                               \
+      atomic_compare_exchange_strong_explicit(p, &old, le(args[2].as_u64),    \
+                                              memory_order_acq_rel, memory_order_acquire); \
+      return le(old);                                                         \
+    }                                                                         \
+  }
 
-    if (ferror(f)) {
-        fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
-                file_path, strerror(errno));
-        exit(1);
-    }
+LVM_ATOMIC(lvm_atomic32, uint32_t, LVM_LE32)
+LVM_ATOMIC(lvm_atomic64, uint64_t, LVM_LE64)
 
-    fclose(f);
-}
+// aread   addr -- value                  load-acquire
+// awrite  addr value --                  store-release
+// aadd    addr delta -- old              fetch-add
+// acas    addr expected desired -- old   compare-exchange, stored if old == expected
+// fence   --                             sequentially consistent fence
+// The 32-bit forms zero-extend what they push.
+Err lvm_execute_atomic(LVM *lvm, Inst_Type type)
+{
+  static const uint64_t inputs[] = {1, 2, 2, 3};
+  static const uint64_t outputs[] = {1, 0, 1, 1};
 
-void lvm_save_program_to_file(const LVM* lvm, const char* file_path) {
-  FILE* f = fopen(file_path, "wb");
-  if (f==NULL) {
-    fprintf(stderr, "ERROR: Cound not open file `%s` : %s\n",
-	    file_path,strerror(errno));
-    exit(1);
+  if (type == INST_FENCE) {
+    atomic_thread_fence(memory_order_seq_cst);
+    return ERR_OK;
   }
 
-   fwrite(lvm->program, sizeof(lvm->program[0]), lvm->program_size, f);
+  const size_t op = (size_t) (type - INST_AREAD32) / 2;
+  const size_t size = (type - INST_AREAD32) % 2 ? 8 : 4;
+  if (lvm->stack_size < inputs[op]) {
+    return ERR_STACK_UNDERFLOW;
+  }
 
-    if (ferror(f)) {
-        fprintf(stderr, "ERROR: Could not write to file `%s`: %s\n",
-                file_path, strerror(errno));
-        exit(1);
+  Word *args = &lvm->stack[lvm->stack_size - inputs[op]];
+  void *cell = NULL;
+  const Err err = lvm_memory_cell(lvm, args[0].as_u64, size, op != 0, &cell);
+  if (err != ERR_OK) {
+    return err;
+  }
+
+  args[0].as_u64 = size == 8 ? lvm_atomic64(cell, op, args) : lvm_atomic32(cell, op, args);
+  lvm->stack_size = lvm->stack_size - inputs[op] + outputs[op];
+  return ERR_OK;
+}
+
+// The first branch is the common case: the access fits in a page this VM
+// already has. Everything else, including segments, takes the slow path.
+Err lvm_memory_read(const LVM *lvm, Memory_Addr addr, void *dst, size_t size)
+{
+  if (addr < LVM_MEMORY_CAPACITY - LVM_PAGE_SIZE) {
+    const LVM_Page *page = lvm->pages[addr / LVM_PAGE_SIZE];
+    if (page != NULL && addr % LVM_PAGE_SIZE + size <= LVM_PAGE_SIZE) {
+      memcpy(dst, &page->bytes[addr % LVM_PAGE_SIZE], size);
+      return ERR_OK;
+    }
+  }
+  return lvm_memory_read_slow(lvm, addr, dst, size);
+}
+
+Err lvm_memory_read_slow(const LVM *lvm, Memory_Addr addr, void *dst, size_t size)
+{
+  if (addr < LVM_MEMORY_CAPACITY && size <= LVM_MEMORY_CAPACITY - addr) {
+    uint8_t *bytes = dst;
+    for (size_t i = 0; i < size; ++i, ++addr) {
+      const LVM_Page *page = lvm->pages[addr / LVM_PAGE_SIZE];
+      bytes[i] = page != NULL ? page->bytes[addr % LVM_PAGE_SIZE] : 0;
     }
+    return ERR_OK;
+  }
 
-    fclose(f);
+  const uint8_t *bytes = lvm_segment_bytes(lvm, addr, size, false);
+  if (bytes == NULL) {
+    return ERR_ILLEGAL_MEMORY_ACCESS;
+  }
+  memcpy(dst, bytes, size);
+  return ERR_OK;
 }
 
-LVM lvm = {0};
+Err lvm_memory_write(LVM *lvm, Memory_Addr addr, const void *src, size_t size)
+{
+  if (addr < LVM_MEMORY_CAPACITY - LVM_PAGE_SIZE) {
+    LVM_Page *page = lvm->pages[addr / LVM_PAGE_SIZE];
+    if (page != NULL && page->refs == 1 && addr % LVM_PAGE_SIZE + size <= LVM_PAGE_SIZE) {
+      memcpy(&page->bytes[addr % LVM_PAGE_SIZE], src, size);
+      return ERR_OK;
+    }
+  }
+  return lvm_memory_write_slow(lvm, addr, src, size);
+}
 
+Err lvm_memory_write_slow(LVM *lvm, Memory_Addr addr, const void *src, size_t size)
+{
+  if (addr < LVM_MEMORY_CAPACITY && size <= LVM_MEMORY_CAPACITY - addr) {
+    const uint8_t *bytes = src;
+    for (size_t i = 0; i < size; ++i, ++addr) {
+      LVM_Page *page = lvm_memory_page_for_write(lvm, addr / LVM_PAGE_SIZE);
+      page->bytes[addr % LVM_PAGE_SIZE] = bytes[i];
+    }
+    return ERR_OK;
+  }
 
-typedef struct {
-  String_View name;
-  Word word;
-} Label;
+  uint8_t *bytes = lvm_segment_bytes(lvm, addr, size, true);
+  if (bytes == NULL) {
+    return ERR_ILLEGAL_MEMORY_ACCESS;
+  }
+  memcpy(bytes, src, size);
+  return ERR_OK;
+}
 
-typedef struct {
-  Inst_Addr addr;
-  String_View label;
-} Defered_Operand;
+// The page at `index` owned by this VM alone, allocated or copied if needed.
+LVM_Page *lvm_memory_page_for_write(LVM *lvm, size_t index)
+{
+  LVM_Page *page = lvm->pages[index];
+  if (page != NULL && page->refs == 1) {
+    return page;
+  }
 
-typedef struct {
-  Label labels[LASM_LABEL_CAPACITY];
-  size_t labels_size;
-  Defered_Operand defered_operands[LASM_DEFERED_OPERANDS_CAPACITY];
-  size_t defered_operands_size;
-  char memory[LASM_MEMORY_CAPACITY];
-  size_t memory_size;
-} Lasm;
+  LVM_Page *copy = page == NULL ? calloc(1, sizeof(LVM_Page)) : malloc(sizeof(LVM_Page));
+  if (copy == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate a memory page: %s\n", strerror(errno));
+    exit(1);
+  }
+  if (page != NULL) {
+    memcpy(copy->bytes, page->bytes, LVM_PAGE_SIZE);
+    // whoever shared it may have let go of it in the meantime
+    if (--page->refs == 0) {
+      free(page);
+    }
+  }
+  copy->refs = 1;
+  lvm->pages[index] = copy;
+  lvm->dirty[index / 64] |= 1ull << (index % 64);
+  return copy;
+}
 
-String_View slurp_file(Lasm* lasm, String_View file_path);
-void *lasm_alloc(Lasm *basm, size_t size);
-bool lasm_number_literal_as_word(Lasm* lt, String_View sv, Word *output);
+bool lvm_memory_equal(const LVM *a, const LVM *b)
+{
+  static const uint8_t zeros[LVM_PAGE_SIZE] = {0};
+  for (size_t i = 0; i < LVM_MEMORY_PAGES; ++i) {
+    const uint8_t *x = a->pages[i] != NULL ? a->pages[i]->bytes : zeros;
+    const uint8_t *y = b->pages[i] != NULL ? b->pages[i]->bytes : zeros;
+    if (x != y && memcmp(x, y, LVM_PAGE_SIZE) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
 
-bool  lasm_resolve_label(const Lasm *lt, String_View name,Word *output);
-bool  lasm_bind_label(Lasm *lt, String_View name, Word word);
-void label_table_push_defered_operand(Lasm *lt, Inst_Addr addr, String_View label);
+void lvm_memory_release(LVM *lvm)
+{
+  for (size_t i = 0; i < LVM_MEMORY_PAGES; ++i) {
+    if (lvm->pages[i] != NULL && --lvm->pages[i]->refs == 0) {
+      free(lvm->pages[i]);
+    }
+    lvm->pages[i] = NULL;
+  }
+  memset(lvm->dirty, 0, sizeof(lvm->dirty));
+  lvm_heap_release(&lvm->heap);
+}
 
-void lasm_translate_source(LVM *lvm, Lasm *lt, String_View input_file_path, size_t level);
+bool lvm_memory_contains(const LVM *lvm, Memory_Addr addr, uint64_t size)
+{
+  return (addr < LVM_MEMORY_CAPACITY && size <= LVM_MEMORY_CAPACITY - addr)
+    || lvm_segment_bytes(lvm, addr, size, false) != NULL;
+}
 
-void *lasm_alloc(Lasm *lasm, size_t size)
+// Where [addr, addr + size) lives in the host, or NULL if it is not
+// entirely inside one segment (or the segment is read-only and `write`).
+uint8_t *lvm_segment_bytes(const LVM *lvm, Memory_Addr addr, uint64_t size, bool write)
 {
-  assert(lasm->memory_size + size <= LASM_MEMORY_CAPACITY);
-  void* result = lasm->memory + lasm->memory_size;
-  lasm->memory_size += size;
-  return result;
+  const uint64_t index = addr >> LVM_SEGMENT_SHIFT;
+  if (index == 0 || index > lvm->segments_size) {
+    return NULL;
+  }
+
+  const LVM_Segment *segment = &lvm->segments[index - 1];
+  const uint64_t offset = addr & ((1ull << LVM_SEGMENT_SHIFT) - 1);
+  if (offset > segment->size || size > segment->size - offset || (write && !segment->writable)) {
+    return NULL;
+  }
+  return segment->data + offset;
 }
 
-bool lasm_number_literal_as_word(Lasm* lt, String_View sv, Word *output)
+// Maps the whole file as the next segment and returns its address, or 0
+// with errno set. Writes to a writable segment go straight to the file.
+Memory_Addr lvm_segment_map(LVM *lvm, const char *file_path, bool writable)
 {
-    char *cstr = lasm_alloc(lt, sv.count + 1);
+  if (lvm->segments_size >= LVM_SEGMENTS_CAPACITY) {
+    errno = ENOMEM;
+    return 0;
+  }
 
-    memcpy(cstr, sv.data, sv.count);
-    cstr[sv.count] = '\0';
+  const int fd = open(file_path, writable ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
 
-    char *endptr = 0;
-    Word result = {0};
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return 0;
+  }
+  if ((uint64_t) st.st_size >= (1ull << LVM_SEGMENT_SHIFT)) {
+    close(fd);
+    errno = EFBIG;
+    return 0;
+  }
 
-    result.as_u64 = strtoull(cstr, &endptr, 10);
-    if ((size_t) (endptr - cstr) != sv.count) {
-        result.as_f64 = strtod(cstr, &endptr);
-        if ((size_t) (endptr - cstr) != sv.count) {
-	  return false;
-        }
+  LVM_Segment segment = {
+    .data = NULL,
+    .size = (uint64_t) st.st_size,
+    .writable = writable,
+  };
+  if (segment.size > 0) {
+    void *data = mmap(NULL, segment.size,
+                      writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                      writable ? MAP_SHARED : MAP_PRIVATE,
+                      fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return 0;
     }
+    segment.data = data;
+  }
+  close(fd);
 
-    *output = result;
-    return true;
+  lvm->segments[lvm->segments_size++] = segment;
+  return (Memory_Addr) lvm->segments_size << LVM_SEGMENT_SHIFT;
 }
 
-
-// 复合字面量（Compound Literal）允许在代码中直接创建并初始化一个匿名对象
-// (type_name) { initializer-list }
-String_View cstr_as_sv(const char *cstr)
+void lvm_segments_unmap(LVM *lvm)
 {
-    return (String_View) {
-        .count = strlen(cstr),
-        .data = cstr,
-    };
-}
-String_View sv_trim_left(String_View sv) {
-  size_t i = 0;
-    while (i < sv.count && isspace(sv.data[i])) {
-        i += 1;
+  for (size_t i = 0; i < lvm->segments_size; ++i) {
+    if (lvm->segments[i].data != NULL) {
+      munmap(lvm->segments[i].data, lvm->segments[i].size);
     }
+  }
+  lvm->segments_size = 0;
+}
 
-    return (String_View) {
-        .count = sv.count - i,
-        .data = sv.data + i,
-    };
+// Makes `child` a copy of `parent` without copying its memory: the pages
+// are shared until either VM writes to them. The heap is copied. Release
+// the child's memory with lvm_memory_release() when done with it.
+void lvm_fork(LVM *child, const LVM *parent)
+{
+  memcpy(child, parent, sizeof(*child));
+  for (size_t i = 0; i < LVM_MEMORY_PAGES; ++i) {
+    if (child->pages[i] != NULL) {
+      child->pages[i]->refs += 1;
+    }
+  }
+  memset(child->dirty, 0, sizeof(child->dirty));
+  lvm_heap_copy(&child->heap, &parent->heap);
 }
 
-String_View sv_trim_right(String_View sv)
+// Makes `lvm`, forked from `pristine`, what it was right after the fork:
+// the dirty pages go back to the pristine ones, and the stack, the heap and
+// the segments the run mapped are dropped. The program, the natives, the
+// output and the trace stay. Costs about as much as the run wrote, however
+// big the memory is. A heap that was empty when forked keeps its buffers.
+void lvm_reset(LVM *lvm, const LVM *pristine)
 {
-    size_t i = 0;
-    while (i < sv.count && isspace(sv.data[sv.count - 1 - i])) {
-        i += 1;
+  for (size_t w = 0; w < LVM_DIRTY_WORDS; ++w) {
+    for (size_t i = w * 64; i < (w + 1) * 64 && lvm->dirty[w] >> (i % 64) != 0; ++i) {
+      if (!(lvm->dirty[w] >> (i % 64) & 1)) {
+        continue;
+      }
+      if (lvm->pages[i] != NULL && --lvm->pages[i]->refs == 0) {
+        free(lvm->pages[i]);
+      }
+      lvm->pages[i] = pristine->pages[i];
+      if (lvm->pages[i] != NULL) {
+        lvm->pages[i]->refs += 1;
+      }
     }
+    lvm->dirty[w] = 0;
+  }
 
-    return (String_View) {
-        .count = sv.count - i,
-        .data = sv.data
-    };
+  for (size_t i = pristine->segments_size; i < lvm->segments_size; ++i) {
+    if (lvm->segments[i].data != NULL) {
+      munmap(lvm->segments[i].data, lvm->segments[i].size);
+    }
+  }
+  lvm->segments_size = pristine->segments_size;
+
+  if (pristine->heap.bytes == NULL && !lvm->heap.borrowed) {
+    LVM_Heap *heap = &lvm->heap;
+    heap->size = heap->old = 0;
+    heap->handles_size = heap->free_handle = 0;
+    heap->remembered_size = heap->marks_size = 0;
+    heap->allocated = heap->minor_collections = heap->major_collections = 0;
+  } else {
+    lvm_heap_release(&lvm->heap);
+    lvm_heap_copy(&lvm->heap, &pristine->heap);
+  }
+
+  lvm->stack_size = pristine->stack_size;
+  memcpy(lvm->stack, pristine->stack, sizeof(lvm->stack[0]) * pristine->stack_size);
+  lvm->pc = pristine->pc;
+  lvm->halt = pristine->halt;
+  lvm->data_size = pristine->data_size;
 }
 
-String_View sv_trim(String_View sv)
+static uint64_t lvm_object_size(const LVM_Object *object)
 {
-    return sv_trim_right(sv_trim_left(sv));
+  const uint64_t payload = object->type == LVM_OBJECT_WORDS
+    ? object->length * sizeof(Word)
+    : (object->length + sizeof(Word) - 1) / sizeof(Word) * sizeof(Word);
+  return sizeof(LVM_Object) + payload;
 }
 
-//将str split，返回delim之前的str部分
-String_View sv_chop_by_delim(String_View *sv, char delim) {
-  size_t i = 0;
-  while (i < sv->count && sv->data[i] != delim) {
-    i += 1;
+static void *lvm_heap_grow_array(void *items, size_t item_size, size_t *capacity, size_t needed)
+{
+  if (needed <= *capacity) {
+    return items;
   }
+  size_t new_capacity = *capacity > 0 ? *capacity : 64;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+  items = realloc(items, new_capacity * item_size);
+  if (items == NULL) {
+    fprintf(stderr, "ERROR: Could not grow the heap: %s\n", strerror(errno));
+    exit(1);
+  }
+  *capacity = new_capacity;
+  return items;
+}
 
-  String_View result = {
-    .count = i,
-    .data = sv->data,
-  };
-
-  // 处理剩余部分offset
-  if (i < sv->count) {
-    sv->count -= i + 1;
-    sv->data  += i + 1;
-  } else {
-    sv->count -= i;
-    sv->data  += i;
+// NULL unless `handle` refers to a live object.
+LVM_Object *lvm_heap_object(const LVM_Heap *heap, Word handle)
+{
+  if ((handle.as_u64 & LVM_HEAP_HANDLE_MASK) != LVM_HEAP_HANDLE_TAG) {
+    return NULL;
   }
+  const uint64_t index = handle.as_u64 & LVM_HEAP_INDEX_MASK;
+  if (index >= heap->handles_size) {
+    return NULL;
+  }
+  const uint64_t slot = heap->handles[index];
+  if ((slot & LVM_HEAP_FREE_SLOT)
+      || (slot & LVM_HEAP_GENERATION_MASK) != (handle.as_u64 & LVM_HEAP_GENERATION_MASK)) {
+    return NULL;
+  }
+  return (LVM_Object*) (heap->bytes + (slot & LVM_HEAP_INDEX_MASK));
+}
 
-  return result;
+// The object of a slot that is known to be live.
+static LVM_Object *lvm_heap_slot_object(const LVM_Heap *heap, uint32_t index)
+{
+  return (LVM_Object*) (heap->bytes + (heap->handles[index] & LVM_HEAP_INDEX_MASK));
 }
 
-bool sv_eq(String_View a, String_View b)
+static void lvm_heap_mark(LVM_Heap *heap, Word word, uint64_t from)
 {
-  if (a.count != b.count) {
-    return false;
-  } else {
-    return memcmp(a.data, b.data, a.count) == 0;
+  LVM_Object *object = lvm_heap_object(heap, word);
+  if (object == NULL || (uint64_t) ((uint8_t*) object - heap->bytes) < from
+      || (object->flags & LVM_OBJECT_MARKED)) {
+    return;
   }
+  object->flags |= LVM_OBJECT_MARKED;
+  heap->marks = lvm_heap_grow_array(heap->marks, sizeof(heap->marks[0]),
+                                    &heap->marks_capacity, heap->marks_size + 1);
+  heap->marks[heap->marks_size++] = object->handle;
 }
 
+static void lvm_heap_mark_words(LVM_Heap *heap, uint32_t handle, uint64_t from)
+{
+  const LVM_Object *object = lvm_heap_slot_object(heap, handle);
+  if (object->type != LVM_OBJECT_WORDS) {
+    return;
+  }
+  const Word *words = (const Word*) (object + 1);
+  for (uint64_t i = 0; i < object->length; ++i) {
+    lvm_heap_mark(heap, words[i], from);
+  }
+}
 
-void lasm_translate_source(LVM *lvm, Lasm *lt,
-			  String_View input_file_path, size_t level){
-  String_View original_source = slurp_file(lt,input_file_path);
-  String_View source = original_source;
-  
-  lvm->program_size = 0;
-  int line_number = 0;
-  
-  while (source.count > 0) {
+// Marks what the stack reaches and slides the live objects of [from, size)
+// down over the dead ones. A minor collection starts at `old` and also
+// treats the remembered old arrays as roots; a major one starts at 0.
+// Either way every survivor is old afterwards.
+void lvm_heap_collect(LVM *lvm, bool major)
+{
+  LVM_Heap *heap = &lvm->heap;
+  const uint64_t from = major ? 0 : heap->old;
+
+  for (uint64_t i = 0; i < lvm->stack_size; ++i) {
+    lvm_heap_mark(heap, lvm->stack[i], from);
+  }
+  for (size_t i = 0; i < heap->remembered_size; ++i) {
+    LVM_Object *object = lvm_heap_slot_object(heap, heap->remembered[i]);
+    object->flags &= (uint8_t) ~LVM_OBJECT_REMEMBERED;
+    if (!major) {
+      lvm_heap_mark_words(heap, heap->remembered[i], from);
+    }
+  }
+  heap->remembered_size = 0;
+  while (heap->marks_size > 0) {
+    lvm_heap_mark_words(heap, heap->marks[--heap->marks_size], from);
+  }
+
+  uint64_t dst = from;
+  for (uint64_t src = from; src < heap->size;) {
+    LVM_Object *object = (LVM_Object*) (heap->bytes + src);
+    const uint64_t size = lvm_object_size(object);
+    if (object->flags & LVM_OBJECT_MARKED) {
+      object->flags &= (uint8_t) ~LVM_OBJECT_MARKED;
+      heap->handles[object->handle] = (heap->handles[object->handle] & LVM_HEAP_GENERATION_MASK) | dst;
+      memmove(heap->bytes + dst, object, size);
+      dst += size;
+    } else {
+      const uint64_t generation = (heap->handles[object->handle] + (1ull << 32)) & LVM_HEAP_GENERATION_MASK;
+      heap->handles[object->handle] = LVM_HEAP_FREE_SLOT | generation | heap->free_handle;
+      heap->free_handle = (uint64_t) object->handle + 1;
+    }
+    src += size;
+  }
+  heap->size = dst;
+  heap->old = dst;
+
+  if (major) {
+    heap->major_collections += 1;
+  } else {
+    heap->minor_collections += 1;
+  }
+}
+
+// The write barrier of word arrays: an old array that now refers to the
+// nursery is a root of the next minor collection.
+void lvm_heap_remember(LVM_Heap *heap, LVM_Object *array, Word value)
+{
+  const LVM_Object *target = lvm_heap_object(heap, value);
+  if (target == NULL
+      || (array->flags & LVM_OBJECT_REMEMBERED)
+      || (uint64_t) ((uint8_t*) array - heap->bytes) >= heap->old
+      || (uint64_t) ((const uint8_t*) target - heap->bytes) < heap->old) {
+    return;
+  }
+  array->flags |= LVM_OBJECT_REMEMBERED;
+  heap->remembered = lvm_heap_grow_array(heap->remembered, sizeof(heap->remembered[0]),
+                                         &heap->remembered_capacity, heap->remembered_size + 1);
+  heap->remembered[heap->remembered_size++] = array->handle;
+}
+
+// Makes every object old, so that no old object can refer to the nursery.
+void lvm_heap_promote(LVM_Heap *heap)
+{
+  for (size_t i = 0; i < heap->remembered_size; ++i) {
+    LVM_Object *object = lvm_heap_slot_object(heap, heap->remembered[i]);
+    object->flags &= (uint8_t) ~LVM_OBJECT_REMEMBERED;
+  }
+  heap->remembered_size = 0;
+  heap->old = heap->size;
+}
+
+// A zeroed object of `length` bytes or words.
+Err lvm_heap_alloc(LVM *lvm, LVM_Object_Type type, uint64_t length, Word *handle)
+{
+  LVM_Heap *heap = &lvm->heap;
+  if (heap->borrowed) {
+    return ERR_ILLEGAL_OPERAND;
+  }
+  if (length > (LVM_HEAP_CAPACITY - sizeof(LVM_Object)) / sizeof(Word)) {
+    return ERR_OUT_OF_HEAP;
+  }
+  const LVM_Object header = {.length = length, .handle = 0, .type = (uint8_t) type, .flags = 0};
+  const uint64_t size = lvm_object_size(&header);
+
+  if (heap->size > heap->old && heap->size - heap->old + size > LVM_HEAP_NURSERY_CAPACITY) {
+    lvm_heap_collect(lvm, false);
+  }
+  if (heap->size + size > heap->capacity && heap->size > 0) {
+    lvm_heap_collect(lvm, true);
+  }
+  if (heap->size + size + LVM_HEAP_NURSERY_CAPACITY > heap->capacity) {
+    uint64_t capacity = heap->capacity > 0 ? heap->capacity * 2 : LVM_HEAP_INITIAL_CAPACITY;
+    while (capacity < heap->size + size + LVM_HEAP_NURSERY_CAPACITY) {
+      capacity *= 2;
+    }
+    if (capacity > LVM_HEAP_CAPACITY) {
+      capacity = LVM_HEAP_CAPACITY;
+    }
+    if (heap->size + size > capacity) {
+      return ERR_OUT_OF_HEAP;
+    }
+    if (capacity > heap->capacity) {
+      uint8_t *bytes = realloc(heap->bytes, capacity);
+      if (bytes == NULL) {
+        return ERR_OUT_OF_HEAP;
+      }
+      heap->bytes = bytes;
+      heap->capacity = capacity;
+    }
+  }
+
+  uint64_t index;
+  uint64_t generation = 0;
+  if (heap->free_handle == 0) {
+    // the next free slot, counting from 1, has to fit the index bits
+    if (heap->handles_size >= UINT32_MAX) {
+      return ERR_OUT_OF_HEAP;
+    }
+    heap->handles = lvm_heap_grow_array(heap->handles, sizeof(heap->handles[0]),
+                                        &heap->handles_capacity, heap->handles_size + 1);
+    index = heap->handles_size++;
+  } else {
+    index = heap->free_handle - 1;
+    heap->free_handle = heap->handles[index] & LVM_HEAP_INDEX_MASK;
+    generation = heap->handles[index] & LVM_HEAP_GENERATION_MASK;
+  }
+
+  LVM_Object *object = (LVM_Object*) (heap->bytes + heap->size);
+  *object = header;
+  object->handle = (uint32_t) index;
+  memset(object + 1, 0, size - sizeof(LVM_Object));
+  heap->handles[index] = generation | heap->size;
+  heap->size += size;
+  heap->allocated += size;
+
+  handle->as_u64 = LVM_HEAP_HANDLE_TAG | generation | index;
+  return ERR_OK;
+}
+
+void lvm_heap_copy(LVM_Heap *dst, const LVM_Heap *src)
+{
+  *dst = *src;
+  dst->bytes = NULL;
+  dst->handles = NULL;
+  dst->remembered = NULL;
+  dst->marks = NULL;
+  dst->marks_size = 0;
+  dst->marks_capacity = 0;
+  dst->borrowed = false;
+  if (src->bytes == NULL) {
+    return;
+  }
+
+  dst->bytes = malloc(src->capacity);
+  dst->handles = malloc(src->handles_capacity * sizeof(src->handles[0]));
+  dst->remembered = malloc((src->remembered_capacity > 0 ? src->remembered_capacity : 1) * sizeof(src->remembered[0]));
+  if (dst->bytes == NULL || dst->handles == NULL || dst->remembered == NULL) {
+    fprintf(stderr, "ERROR: Could not copy the heap: %s\n", strerror(errno));
+    exit(1);
+  }
+  memcpy(dst->bytes, src->bytes, src->size);
+  memcpy(dst->handles, src->handles, src->handles_size * sizeof(src->handles[0]));
+  memcpy(dst->remembered, src->remembered, src->remembered_size * sizeof(src->remembered[0]));
+}
+
+bool lvm_heap_equal(const LVM_Heap *a, const LVM_Heap *b)
+{
+  return a->size == b->size
+    && a->old == b->old
+    && a->handles_size == b->handles_size
+    && (a->size == 0 || memcmp(a->bytes, b->bytes, a->size) == 0)
+    && (a->handles_size == 0 || memcmp(a->handles, b->handles, a->handles_size * sizeof(a->handles[0])) == 0);
+}
+
+void lvm_heap_release(LVM_Heap *heap)
+{
+  if (!heap->borrowed) {
+    free(heap->bytes);
+    free(heap->handles);
+    free(heap->remembered);
+    free(heap->marks);
+  }
+  memset(heap, 0, sizeof(*heap));
+}
+
+static void lvm_output_write_all(int fd, const char *data, size_t size)
+{
+  while (size > 0) {
+    const ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    data += n;
+    size -= (size_t) n;
+  }
+}
+
+void lvm_output_write(LVM_Output *output, const void *data, size_t size)
+{
+  if (size > LVM_OUTPUT_CAPACITY - output->size) {
+    lvm_output_flush(output);
+  }
+  if (size >= LVM_OUTPUT_CAPACITY) {
+    lvm_output_write_all(output->fd, data, size);
+    return;
+  }
+  memcpy(output->bytes + output->size, data, size);
+  output->size += size;
+}
+
+void lvm_output_flush(LVM_Output *output)
+{
+  lvm_output_write_all(output->fd, output->bytes, output->size);
+  output->size = 0;
+}
+
+void lvm_output_word(LVM_Output *output, Word word)
+{
+  const uint64_t bytes = LVM_HOST_BIG_ENDIAN ? lvm_bswap64(word.as_u64) : word.as_u64;
+  lvm_output_write(output, &bytes, sizeof(bytes));
+}
+
+void lvm_printf(LVM *lvm, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  if (lvm->output == NULL) {
+    vprintf(format, args);
+  } else {
+    char text[LVM_FORMAT_CAPACITY];
+    const int n = vsnprintf(text, sizeof(text), format, args);
+    if (n > 0) {
+      lvm_output_write(lvm->output, text, (size_t) n < sizeof(text) ? (size_t) n : sizeof(text) - 1);
+    }
+  }
+  va_end(args);
+}
+
+// The lvm_format_* functions write no terminator and return the length.
+
+size_t lvm_format_u64(char *text, uint64_t x)
+{
+  char digits[20];
+  size_t n = 0;
+  do {
+    digits[n++] = (char) ('0' + x % 10);
+    x /= 10;
+  } while (x > 0);
+  for (size_t i = 0; i < n; ++i) {
+    text[i] = digits[n - 1 - i];
+  }
+  return n;
+}
+
+size_t lvm_format_i64(char *text, int64_t x)
+{
+  if (x < 0) {
+    text[0] = '-';
+    return 1 + lvm_format_u64(text + 1, 0 - (uint64_t) x);
+  }
+  return lvm_format_u64(text, (uint64_t) x);
+}
+
+// Same text as printf("%lf"). Below 2^53 the integer part and the fraction
+// are exact doubles and the fraction times 10^6 is off by far less than
+// 1e-6, so it rounds like printf unless it is that close to a tie. Ties,
+// big numbers, infinities and NaNs go to snprintf.
+size_t lvm_format_f64(char *text, double x)
+{
+  const double a = fabs(x);
+  if (a < 9007199254740992.0) {
+    uint64_t whole = (uint64_t) a;
+    const double scaled = (a - (double) whole) * 1e6;
+    const double below = floor(scaled);
+    if (fabs(scaled - below - 0.5) > 1e-6) {
+      uint64_t fraction = (uint64_t) below + (scaled - below > 0.5);
+      if (fraction == 1000000) {
+        whole += 1;
+        fraction = 0;
+      }
+
+      size_t n = 0;
+      if (signbit(x)) {
+        text[n++] = '-';
+      }
+      n += lvm_format_u64(text + n, whole);
+      text[n++] = '.';
+      for (size_t i = 6; i > 0; --i) {
+        text[n + i - 1] = (char) ('0' + fraction % 10);
+        fraction /= 10;
+      }
+      return n + 6;
+    }
+  }
+  return (size_t) snprintf(text, LVM_FORMAT_CAPACITY, "%lf", x);
+}
+
+void lvm_trace_record(LVM *lvm, Inst_Addr pc, uint32_t type)
+{
+  LVM_Trace *trace = lvm->trace;
+  LVM_Trace_Entry *entry = &trace->entries[trace->count++ & (LVM_TRACE_CAPACITY - 1)];
+  entry->top = lvm->stack_size > 0 ? lvm->stack[lvm->stack_size - 1].as_u64 : 0;
+  entry->pc = (uint32_t) pc;
+  entry->next = (uint32_t) lvm->pc;
+  entry->stack_size = (uint32_t) lvm->stack_size;
+  entry->type = type;
+}
+
+#define LVM_INTERP_NAME lvm_execute_inst
+#define LVM_INTERP_STEP 1
+#define LVM_INTERP_FUEL (lvm->fuel_limit != 0)
+#define LVM_INTERP_TRACE (lvm->trace != NULL)
+#define LVM_INTERP_PROFILE 0
+#include "./lvm_interp.h"
+
+// The variants lvm_execute_program() picks from, indexed by LVM_RUN_* flags:
+// a run only pays for the features it uses.
+#define LVM_INTERP_NAME lvm_run
+#define LVM_INTERP_STEP 0
+#define LVM_INTERP_FUEL 0
+#define LVM_INTERP_TRACE 0
+#define LVM_INTERP_PROFILE 0
+#include "./lvm_interp.h"
+#define LVM_INTERP_NAME lvm_run_fuel
+#define LVM_INTERP_STEP 0
+#define LVM_INTERP_FUEL 1
+#define LVM_INTERP_TRACE 0
+#define LVM_INTERP_PROFILE 0
+#include "./lvm_interp.h"
+#define LVM_INTERP_NAME lvm_run_trace
+#define LVM_INTERP_STEP 0
+#define LVM_INTERP_FUEL 0
+#define LVM_INTERP_TRACE 1
+#define LVM_INTERP_PROFILE 0
+#include "./lvm_interp.h"
+#define LVM_INTERP_NAME lvm_run_fuel_trace
+#define LVM_INTERP_STEP 0
+#define LVM_INTERP_FUEL 1
+#define LVM_INTERP_TRACE 1
+#define LVM_INTERP_PROFILE 0
+#include "./lvm_interp.h"
+#define LVM_INTERP_NAME lvm_run_profile
+#define LVM_INTERP_STEP 0
+#define LVM_INTERP_FUEL 0
+#define LVM_INTERP_TRACE 0
+#define LVM_INTERP_PROFILE 1
+#include "./lvm_interp.h"
+#define LVM_INTERP_NAME lvm_run_fuel_profile
+#define LVM_INTERP_STEP 0
+#define LVM_INTERP_FUEL 1
+#define LVM_INTERP_TRACE 0
+#define LVM_INTERP_PROFILE 1
+#include "./lvm_interp.h"
+#define LVM_INTERP_NAME lvm_run_trace_profile
+#define LVM_INTERP_STEP 0
+#define LVM_INTERP_FUEL 0
+#define LVM_INTERP_TRACE 1
+#define LVM_INTERP_PROFILE 1
+#include "./lvm_interp.h"
+#define LVM_INTERP_NAME lvm_run_fuel_trace_profile
+#define LVM_INTERP_STEP 0
+#define LVM_INTERP_FUEL 1
+#define LVM_INTERP_TRACE 1
+#define LVM_INTERP_PROFILE 1
+#include "./lvm_interp.h"
+
+const LVM_Run lvm_runs[LVM_RUN_VARIANTS] = {
+  lvm_run,
+  lvm_run_fuel,
+  lvm_run_trace,
+  lvm_run_fuel_trace,
+  lvm_run_profile,
+  lvm_run_fuel_profile,
+  lvm_run_trace_profile,
+  lvm_run_fuel_trace_profile,
+};
+
+// Charges the fuel after the instruction at `last`, of type `type`, sent
+// control somewhere else than last + 1, and stops the VM at back-edges and
+// calls once it is out of fuel or interrupted.
+Err lvm_transfer(LVM *lvm, Inst_Addr last, Inst_Type type)
+{
+  if (lvm->fuel_limit != 0) {
+    lvm->fuel_used += last + 1 - lvm->fuel_run;
+    lvm->fuel_run = lvm->pc;
+  }
+  if (lvm->halt || (lvm->pc > last && type != INST_CALL)) {
+    return ERR_OK;
+  }
+  if (lvm_interrupt) {
+    return ERR_INTERRUPTED;
+  }
+  if (lvm->fuel_limit != 0 && lvm->fuel_used >= lvm->fuel_limit) {
+    return ERR_OUT_OF_FUEL;
+  }
+  return ERR_OK;
+}
+
+// A negative `limit` is no limit.
+void lvm_fuel_begin(LVM *lvm, int64_t limit)
+{
+  lvm->fuel_limit = limit < 0 ? 0 : (uint64_t) limit;
+  lvm->fuel_used = 0;
+  lvm->fuel_run = lvm->pc;
+}
+
+// Running out of fuel is how a run with a limit ends, not an error.
+Err lvm_fuel_end(LVM *lvm, Err err)
+{
+  lvm->fuel_limit = 0;
+  return err == ERR_OUT_OF_FUEL ? ERR_OK : err;
+}
+
+// How many instructions the last run with a limit executed, including the
+// straight-line stretch it stopped in on a halt, an error or a native that
+// would block.
+uint64_t lvm_fuel_spent(const LVM *lvm)
+{
+  return lvm->fuel_used + (lvm->pc > lvm->fuel_run ? lvm->pc - lvm->fuel_run : 0);
+}
+
+static const struct {
+  Inst_Type quick;
+  Inst_Type type;
+  uint64_t operand;
+} inst_quick_forms[] = {
+  {INST_PUSH0, INST_PUSH, 0},
+  {INST_PUSH1, INST_PUSH, 1},
+  {INST_DUP0,  INST_DUP,  0},
+  {INST_DUP1,  INST_DUP,  1},
+  {INST_DUP2,  INST_DUP,  2},
+  {INST_SWAP1, INST_SWAP, 1},
+  {INST_SWAP2, INST_SWAP, 2},
+};
+
+// The quickened form of `inst`, or `inst` itself if it has none.
+Inst inst_quicken(Inst inst)
+{
+  for (size_t i = 0; i < sizeof(inst_quick_forms) / sizeof(inst_quick_forms[0]); ++i) {
+    if (inst_quick_forms[i].type == inst.type && inst_quick_forms[i].operand == inst.operand.as_u64) {
+      inst.type = inst_quick_forms[i].quick;
+      break;
+    }
+  }
+  return inst;
+}
+
+Inst inst_dequicken(Inst inst)
+{
+  for (size_t i = 0; i < sizeof(inst_quick_forms) / sizeof(inst_quick_forms[0]); ++i) {
+    if (inst_quick_forms[i].quick == inst.type) {
+      inst.type = inst_quick_forms[i].type;
+      inst.operand.as_u64 = inst_quick_forms[i].operand;
+      break;
+    }
+  }
+  return inst;
+}
+
+// Replaces every instruction that has a quickened form with it. Returns how
+// many were replaced.
+size_t lvm_quicken(LVM *lvm)
+{
+  size_t quickened = 0;
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    lvm->program[i] = inst_quicken(lvm->program[i]);
+    quickened += inst_is_quickened(lvm->program[i].type);
+  }
+  return quickened;
+}
+
+void lvm_dequicken(LVM *lvm)
+{
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    lvm->program[i] = inst_dequicken(lvm->program[i]);
+  }
+}
+
+Err lvm_execute_program(LVM *lvm, int64_t limit) {
+  return lvm_execute_program_counted(lvm, limit, NULL);
+}
+
+// Also counts how often every instruction runs in `counts`, unless it is
+// NULL.
+Err lvm_execute_program_counted(LVM *lvm, int64_t limit, uint64_t *counts)
+{
+  if (limit == 0) {
+    return ERR_OK;
+  }
+
+  lvm_fuel_begin(lvm, limit);
+  Err err = ERR_OK;
+  if (!lvm->halt) {
+    const size_t variant = (lvm->fuel_limit != 0 ? LVM_RUN_FUEL : 0)
+      | (lvm->trace != NULL ? LVM_RUN_TRACE : 0)
+      | (counts != NULL ? LVM_RUN_PROFILE : 0);
+    err = lvm_runs[variant](lvm, counts);
+  }
+
+  return lvm_fuel_end(lvm, err);
+}
+
+
+void lvm_dump_stack(FILE* stream, const LVM* lvm) {
+  fprintf(stream, "Stack:\n");
+  if (lvm->stack_size > 0) {
+    for (Inst_Addr i = 0; i < lvm->stack_size; ++i) {
+      fprintf(stream, "  u64: %" PRIu64 ", i64: %" PRId64 ", f64: %lf, ptr: %p\n",
+              lvm->stack[i].as_u64,
+              lvm->stack[i].as_i64,
+              lvm->stack[i].as_f64,
+              lvm->stack[i].as_ptr);
+    }
+  }else {
+    fprintf(stream, "  [empty]\n");
+  }
+}
+
+
+void lvm_load_program_from_memory(LVM* lvm, Inst * program,size_t program_size) {
+  assert(program_size < LVM_PROGRAM_CAPACITY);
+  memcpy(lvm->program,program,sizeof(program[0])* program_size);
+  lvm->program_size = program_size;
+}
+
+// Reads a program in the .lvm format from `f` into `lvm`. On failure the
+// reason, naming `file_path`, goes to `error` and `lvm` is left half loaded.
+bool lvm_read_program(LVM *lvm, FILE *f, const char *file_path, char *error, size_t error_size) {
+  LVM_File_Meta meta = {0};
+  size_t n = fread(&meta, offsetof(LVM_File_Meta, symbols_size), 1, f);
+  if (n == 1 && meta.version >= 2) {
+    n = fread(&meta.symbols_size, sizeof(meta.symbols_size), 1, f);
+  }
+  if (n == 1 && meta.version >= 3) {
+    n = fread(&meta.data_size, sizeof(meta.data_size), 1, f);
+  }
+  if (n < 1) {
+    snprintf(error, error_size, "Could not read meta data from file `%s`: %s",
+            file_path, ferror(f) ? strerror(errno) : "unexpected end of file");
+    return false;
+  }
+
+  if (meta.magic != LVM_FILE_MAGIC) {
+    snprintf(error, error_size, "`%s` is not a valid lvm file: unexpected magic %08" PRIX32,
+            file_path, meta.magic);
+    return false;
+  }
+
+  if (meta.version < 1 || meta.version > LVM_FILE_VERSION) {
+    snprintf(error, error_size, "`%s`: unsupported file version %" PRIu32 ", expected at most %d",
+            file_path, meta.version, LVM_FILE_VERSION);
+    return false;
+  }
+
+  if (meta.symbols_size > LVM_SYMBOLS_CAPACITY) {
+    snprintf(error, error_size, "`%s` has %" PRIu64 " symbols, the capacity is %d",
+            file_path, meta.symbols_size, LVM_SYMBOLS_CAPACITY);
+    return false;
+  }
+
+  if (meta.data_size > LVM_MEMORY_CAPACITY) {
+    snprintf(error, error_size, "`%s` has %" PRIu64 " bytes of data, the memory capacity is %d",
+            file_path, meta.data_size, LVM_MEMORY_CAPACITY);
+    return false;
+  }
+
+  if (meta.natives_size > LVM_NATIVES_CAPACITY) {
+    snprintf(error, error_size, "`%s` imports %" PRIu64 " natives, the capacity is %d",
+            file_path, meta.natives_size, LVM_NATIVES_CAPACITY);
+    return false;
+  }
+
+  if (meta.program_size > LVM_PROGRAM_CAPACITY) {
+    snprintf(error, error_size, "`%s` has %" PRIu64 " instructions, the capacity is %d",
+            file_path, meta.program_size, LVM_PROGRAM_CAPACITY);
+    return false;
+  }
+
+  lvm->natives_size = 0;
+  for (uint64_t i = 0; i < meta.natives_size; ++i) {
+    char name[LVM_NATIVE_NAME_CAPACITY];
+    if (fread(name, sizeof(name), 1, f) < 1) {
+      snprintf(error, error_size, "Could not read native imports from file `%s`",
+              file_path);
+      return false;
+    }
+    name[LVM_NATIVE_NAME_CAPACITY - 1] = '\0';
+    lvm_push_import(lvm, cstr_as_sv(name));
+  }
+
+  lvm->symbols_size = fread(lvm->symbols, sizeof(lvm->symbols[0]), meta.symbols_size, f);
+  if (lvm->symbols_size != meta.symbols_size) {
+    snprintf(error, error_size, "Could not read symbols from file `%s`", file_path);
+    return false;
+  }
+  for (size_t i = 0; i < lvm->symbols_size; ++i) {
+    lvm->symbols[i].name[LVM_SYMBOL_NAME_CAPACITY - 1] = '\0';
+  }
+
+  lvm->program_size = fread(lvm->program, sizeof(lvm->program[0]), meta.program_size, f);
+
+    if (ferror(f)) {
+        snprintf(error, error_size, "Could not read file `%s`: %s",
+                file_path, strerror(errno));
+        return false;
+    }
+
+    if (lvm->program_size != meta.program_size) {
+        snprintf(error, error_size, "`%s` is truncated: expected %" PRIu64 " instructions, got %" PRIu64,
+                file_path, meta.program_size, lvm->program_size);
+        return false;
+    }
+    lvm_dequicken(lvm);
+
+    // the data goes straight into the pages, a page at a time
+    lvm->data_size = 0;
+    while (lvm->data_size < meta.data_size) {
+        const Memory_Addr addr = lvm->data_size;
+        uint64_t size = LVM_PAGE_SIZE - addr % LVM_PAGE_SIZE;
+        if (size > meta.data_size - addr) {
+            size = meta.data_size - addr;
+        }
+        LVM_Page *page = lvm_memory_page_for_write(lvm, addr / LVM_PAGE_SIZE);
+        if (fread(&page->bytes[addr % LVM_PAGE_SIZE], 1, size, f) != size) {
+            snprintf(error, error_size, "`%s` is truncated: expected %" PRIu64 " bytes of data",
+                    file_path, meta.data_size);
+            return false;
+        }
+        lvm->data_size += size;
+    }
+    return true;
+}
+
+void lvm_load_program_from_file(LVM* lvm, const char* file_path) {
+  FILE* f = fopen(file_path, "rb");
+  if (f==NULL) {
+    fprintf(stderr, "ERROR: Cound not open file %s : %s\n",
+	    file_path,strerror(errno));
+    exit(1);
+  }
+
+  char error[LVM_FORMAT_CAPACITY];
+  if (!lvm_read_program(lvm, f, file_path, error, sizeof(error))) {
+    fprintf(stderr, "ERROR: %s\n", error);
+    exit(1);
+  }
+  fclose(f);
+}
+
+void lvm_save_program_to_file(const LVM* lvm, const char* file_path) {
+  FILE* f = fopen(file_path, "wb");
+  if (f==NULL) {
+    fprintf(stderr, "ERROR: Cound not open file `%s` : %s\n",
+	    file_path,strerror(errno));
+    exit(1);
+  }
+
+  LVM_File_Meta meta = {
+    .magic = LVM_FILE_MAGIC,
+    .version = LVM_FILE_VERSION,
+    .program_size = lvm->program_size,
+    .natives_size = lvm->natives_size,
+    .symbols_size = lvm->symbols_size,
+    .data_size = lvm->data_size,
+  };
+
+  fwrite(&meta, sizeof(meta), 1, f);
+  for (size_t i = 0; i < lvm->natives_size; ++i) {
+    fwrite(lvm->natives[i].name, sizeof(lvm->natives[i].name), 1, f);
+  }
+  fwrite(lvm->symbols, sizeof(lvm->symbols[0]), lvm->symbols_size, f);
+  // quickened instructions are private to a running VM
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    const Inst inst = inst_dequicken(lvm->program[i]);
+    fwrite(&inst, sizeof(inst), 1, f);
+  }
+  for (Memory_Addr addr = 0; addr < lvm->data_size; ++addr) {
+    uint8_t byte;
+    lvm_memory_read(lvm, addr, &byte, 1);
+    fputc(byte, f);
+  }
+
+    if (ferror(f)) {
+        fprintf(stderr, "ERROR: Could not write to file `%s`: %s\n",
+                file_path, strerror(errno));
+        exit(1);
+    }
+
+    fclose(f);
+}
+
+// Names longer than LVM_SYMBOL_NAME_CAPACITY - 1 are truncated.
+void lvm_push_symbol(LVM *lvm, String_View name, Inst_Addr addr)
+{
+  if (lvm->symbols_size >= LVM_SYMBOLS_CAPACITY) {
+    return;
+  }
+
+  LVM_Symbol *symbol = &lvm->symbols[lvm->symbols_size++];
+  memset(symbol, 0, sizeof(*symbol));
+  const size_t n = name.count < LVM_SYMBOL_NAME_CAPACITY - 1
+    ? name.count
+    : LVM_SYMBOL_NAME_CAPACITY - 1;
+  memcpy(symbol->name, name.data, n);
+  symbol->addr = addr;
+}
+
+// The closest label at or before `addr`.
+const LVM_Symbol *lvm_find_symbol(const LVM *lvm, Inst_Addr addr)
+{
+  const LVM_Symbol *result = NULL;
+  for (size_t i = 0; i < lvm->symbols_size; ++i) {
+    const LVM_Symbol *symbol = &lvm->symbols[i];
+    if (symbol->addr <= addr && (result == NULL || symbol->addr > result->addr)) {
+      result = symbol;
+    }
+  }
+  return result;
+}
+
+void lvm_trace_init(LVM_Trace *trace)
+{
+  memset(trace, 0, sizeof(*trace));
+  trace->magic = LVM_TRACE_MAGIC;
+  trace->version = LVM_TRACE_VERSION;
+  trace->capacity = LVM_TRACE_CAPACITY;
+}
+
+void lvm_trace_save(const LVM_Trace *trace, const char *file_path)
+{
+  FILE *f = fopen(file_path, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not open file `%s`: %s\n",
+            file_path, strerror(errno));
+    exit(1);
+  }
+
+  fwrite(trace, sizeof(*trace), 1, f);
+  if (ferror(f)) {
+    fprintf(stderr, "ERROR: Could not write to file `%s`: %s\n",
+            file_path, strerror(errno));
+    exit(1);
+  }
+
+  fclose(f);
+}
+
+void lvm_trace_load(LVM_Trace *trace, const char *file_path)
+{
+  FILE *f = fopen(file_path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not open file `%s`: %s\n",
+            file_path, strerror(errno));
+    exit(1);
+  }
+
+  if (fread(trace, sizeof(*trace), 1, f) < 1) {
+    fprintf(stderr, "ERROR: Could not read trace from file `%s`: %s\n",
+            file_path, ferror(f) ? strerror(errno) : "unexpected end of file");
+    exit(1);
+  }
+
+  if (trace->magic != LVM_TRACE_MAGIC || trace->version != LVM_TRACE_VERSION
+      || trace->capacity != LVM_TRACE_CAPACITY) {
+    fprintf(stderr, "ERROR: `%s` is not a trace of this version of lvm\n", file_path);
+    exit(1);
+  }
+
+  fclose(f);
+}
+
+LVM lvm = {0};
+
+
+typedef struct {
+  String_View name;
+  Word word;
+  // bound to an instruction address
+  bool code;
+  // a %label whose value is a float
+  bool f64;
+} Label;
+
+typedef struct {
+  Inst_Addr addr;
+  String_View label;
+} Defered_Operand;
+
+// `%macro name params...` up to `%endmacro`. Expanding it translates the
+// body with every parameter replaced by its argument and every label the
+// body defines renamed to one of its own.
+typedef struct {
+  String_View name;
+  String_View params[LASM_MACRO_PARAMS_CAPACITY];
+  size_t params_size;
+  String_View body;
+} Lasm_Macro;
+
+typedef struct {
+  Label labels[LASM_LABEL_CAPACITY];
+  size_t labels_size;
+  Defered_Operand defered_operands[LASM_DEFERED_OPERANDS_CAPACITY];
+  size_t defered_operands_size;
+  // data addresses of %u64 words holding instruction addresses
+  Memory_Addr code_words[LASM_CODE_WORDS_CAPACITY];
+  size_t code_words_size;
+  Lasm_Macro macros[LASM_MACROS_CAPACITY];
+  size_t macros_size;
+  // the macro whose body is being read, and the include level it started at
+  Lasm_Macro *defining;
+  size_t defining_level;
+  size_t expansions;
+  size_t macro_level;
+  // routines named by %inline
+  String_View inlines[LASM_INLINES_CAPACITY];
+  size_t inlines_size;
+  char memory[LASM_MEMORY_CAPACITY];
+  size_t memory_size;
+} Lasm;
+
+typedef struct {
+  Word word;
+  bool f64;
+} Lasm_Value;
+
+typedef enum {
+  LASM_EXPR_OK = 0,
+  LASM_EXPR_UNKNOWN_LABEL,
+  LASM_EXPR_INVALID,
+} Lasm_Expr_Status;
+
+// A constant expression in an operand, a %label or a data value, and why
+// it could not be evaluated.
+typedef struct {
+  const Lasm *lt;
+  String_View text;
+  // what is left of `text` to parse
+  String_View rest;
+  Lasm_Expr_Status status;
+  String_View label;
+  const char *reason;
+} Lasm_Expr;
+
+String_View slurp_file(Lasm* lasm, String_View file_path);
+void *lasm_alloc(Lasm *basm, size_t size);
+bool lasm_number_literal_as_word(Lasm* lt, String_View sv, Word *output);
+
+bool  lasm_resolve_label(const Lasm *lt, String_View name,Word *output);
+bool  lasm_bind_label(Lasm *lt, String_View name, Word word);
+bool  lasm_label_is_code(const Lasm *lt, String_View name);
+void label_table_push_defered_operand(Lasm *lt, Inst_Addr addr, String_View label);
+bool lasm_is_data_directive(String_View directive);
+void lasm_emit_data(LVM *lvm, const void *bytes, size_t size, size_t alignment,
+                    String_View file_path, int line_number);
+void lasm_translate_data(LVM *lvm, Lasm *lt, String_View directive, String_View line,
+                         String_View file_path, int line_number);
+
+void lasm_define_macro(Lasm *lt, String_View line, String_View file_path, int line_number, size_t level);
+void lasm_record_macro_line(Lasm *lt, String_View line, String_View file_path, int line_number);
+const Lasm_Macro *lasm_find_macro(const Lasm *lt, String_View name);
+void lasm_expand_macro(LVM *lvm, Lasm *lt, const Lasm_Macro *macro, String_View args,
+                       String_View file_path, int line_number, size_t level);
+bool lasm_is_inline(const Lasm *lt, String_View name);
+bool lasm_inline_call(LVM *lvm, Lasm *lt, Inst_Addr routine);
+bool lasm_eval_expr(Lasm_Expr *expr, Lasm_Value *value);
+void lasm_report_expr(const Lasm_Expr *expr, String_View file_path, int line_number);
+void lasm_translate_line(LVM *lvm, Lasm *lt, String_View line,
+                         String_View input_file_path, int line_number, size_t level);
+void lasm_translate_source(LVM *lvm, Lasm *lt, String_View input_file_path, size_t level);
+
+void *lasm_alloc(Lasm *lasm, size_t size)
+{
+  assert(lasm->memory_size + size <= LASM_MEMORY_CAPACITY);
+  void* result = lasm->memory + lasm->memory_size;
+  lasm->memory_size += size;
+  return result;
+}
+
+bool lasm_number_literal_as_word(Lasm* lt, String_View sv, Word *output)
+{
+    char *cstr = lasm_alloc(lt, sv.count + 1);
+
+    memcpy(cstr, sv.data, sv.count);
+    cstr[sv.count] = '\0';
+
+    char *endptr = 0;
+    Word result = {0};
+
+    result.as_u64 = strtoull(cstr, &endptr, 10);
+    if ((size_t) (endptr - cstr) != sv.count) {
+        result.as_f64 = strtod(cstr, &endptr);
+        if ((size_t) (endptr - cstr) != sv.count) {
+	  return false;
+        }
+    }
+
+    *output = result;
+    return true;
+}
+
+
+// 复合字面量（Compound Literal）允许在代码中直接创建并初始化一个匿名对象
+// (type_name) { initializer-list }
+String_View cstr_as_sv(const char *cstr)
+{
+    return (String_View) {
+        .count = strlen(cstr),
+        .data = cstr,
+    };
+}
+String_View sv_trim_left(String_View sv) {
+  size_t i = 0;
+    while (i < sv.count && isspace(sv.data[i])) {
+        i += 1;
+    }
+
+    return (String_View) {
+        .count = sv.count - i,
+        .data = sv.data + i,
+    };
+}
+
+String_View sv_trim_right(String_View sv)
+{
+    size_t i = 0;
+    while (i < sv.count && isspace(sv.data[sv.count - 1 - i])) {
+        i += 1;
+    }
+
+    return (String_View) {
+        .count = sv.count - i,
+        .data = sv.data
+    };
+}
+
+String_View sv_trim(String_View sv)
+{
+    return sv_trim_right(sv_trim_left(sv));
+}
+
+//将str split，返回delim之前的str部分
+String_View sv_chop_by_delim(String_View *sv, char delim) {
+  size_t i = 0;
+  while (i < sv->count && sv->data[i] != delim) {
+    i += 1;
+  }
+
+  String_View result = {
+    .count = i,
+    .data = sv->data,
+  };
+
+  // 处理剩余部分offset
+  if (i < sv->count) {
+    sv->count -= i + 1;
+    sv->data  += i + 1;
+  } else {
+    sv->count -= i;
+    sv->data  += i;
+  }
+
+  return result;
+}
+
+bool sv_eq(String_View a, String_View b)
+{
+  if (a.count != b.count) {
+    return false;
+  } else {
+    return memcmp(a.data, b.data, a.count) == 0;
+  }
+}
+
+
+void lasm_translate_line(LVM *lvm, Lasm *lt, String_View line,
+                         String_View input_file_path, int line_number, size_t level)
+{
     assert(lvm->program_size < LVM_PROGRAM_CAPACITY);
-    String_View line = sv_trim(sv_chop_by_delim(&source, '\n'));
-    line_number += 1;
+    if (lt->defining != NULL) {
+      lasm_record_macro_line(lt, line, input_file_path, line_number);
+      return;
+    }
+
     if (line.count > 0 && *line.data != LASM_COMMENT_SYMBOL) {
       String_View token = sv_trim(sv_chop_by_delim(&line, ' '));
       // Pre-processor
@@ -907,33 +2770,47 @@ void lasm_translate_source(LVM *lvm, Lasm *lt,
           line = sv_trim(line);
           String_View label = sv_chop_by_delim(&line, ' ');
           if (label.count > 0) {
-            line = sv_trim(line);
-            String_View value = sv_chop_by_delim(&line, ' ');
-            Word word = {0};
-            if (!lasm_number_literal_as_word(lt,value, &word)) {
+            Lasm_Expr expr = {.lt = lt, .text = sv_chop_by_delim(&line, LASM_COMMENT_SYMBOL)};
+            Lasm_Value value = {0};
+            if (!lasm_eval_expr(&expr, &value)) {
+              lasm_report_expr(&expr, input_file_path, line_number);
+            }
+
+
+	    if (!lasm_bind_label(lt, label, value.word)) {
+              // TODO: label redefinition error does not tell where the first label was already defined
               fprintf(stderr,
-		      "%.*s:%d: ERROR: `%.*s` is not a number",
+		      "%.*s:%d: ERROR: label `%.*s` is already defined\n",
                       SV_FORMAT(input_file_path),
                       line_number,
-                      SV_FORMAT(value));
+                      SV_FORMAT(label));
 
               exit(1);
             }
-
-
-	    if (!lasm_bind_label(lt, label, word)) {
-              // TODO: label redefinition error does not tell where the first label was already defined
+            lt->labels[lt->labels_size - 1].f64 = value.f64;
+          } else {
+            fprintf(stderr,
+                    "%.*s:%d: ERROR: label name is not provided\n",
+                    SV_FORMAT(input_file_path), line_number);
+            exit(1);
+          }
+        } else if (sv_eq(token, cstr_as_sv("native"))) {
+          line = sv_trim(line);
+          String_View name = sv_chop_by_delim(&line, ' ');
+          if (name.count > 0) {
+            // the import slot is resolved by name when the program is linked
+            Word index = {.as_u64 = lvm_push_import(lvm, name)};
+            if (!lasm_bind_label(lt, name, index)) {
               fprintf(stderr,
 		      "%.*s:%d: ERROR: label `%.*s` is already defined\n",
                       SV_FORMAT(input_file_path),
                       line_number,
-                      SV_FORMAT(label));
-
+                      SV_FORMAT(name));
               exit(1);
             }
           } else {
             fprintf(stderr,
-                    "%.*s:%d: ERROR: label name is not provided\n",
+                    "%.*s:%d: ERROR: native name is not provided\n",
                     SV_FORMAT(input_file_path), line_number);
             exit(1);
           }
@@ -965,6 +2842,23 @@ void lasm_translate_source(LVM *lvm, Lasm *lt,
                     SV_FORMAT(input_file_path), line_number);
             exit(1);
           }
+        } else if (lasm_is_data_directive(token)) {
+          lasm_translate_data(lvm, lt, token, line, input_file_path, line_number);
+        } else if (sv_eq(token, cstr_as_sv("macro"))) {
+          lasm_define_macro(lt, line, input_file_path, line_number, level);
+        } else if (sv_eq(token, cstr_as_sv("endmacro"))) {
+          fprintf(stderr, "%.*s:%d: ERROR: %%endmacro without %%macro\n",
+                  SV_FORMAT(input_file_path), line_number);
+          exit(1);
+        } else if (sv_eq(token, cstr_as_sv("inline"))) {
+          line = sv_trim(sv_chop_by_delim(&line, LASM_COMMENT_SYMBOL));
+          if (line.count == 0) {
+            fprintf(stderr, "%.*s:%d: ERROR: %%inline requires a routine name\n",
+                    SV_FORMAT(input_file_path), line_number);
+            exit(1);
+          }
+          assert(lt->inlines_size < LASM_INLINES_CAPACITY);
+          lt->inlines[lt->inlines_size++] = line;
         }else {
           fprintf(stderr,
 		  "%.*s:%d: ERROR: unknown pre-processor directive `%.*s`\n",
@@ -972,170 +2866,995 @@ void lasm_translate_source(LVM *lvm, Lasm *lt,
                   line_number,
                   SV_FORMAT(token));
 
-          exit(1);
+          exit(1);
+
+        }
+      } else {
+      
+	if (token.count > 0 && token.data[token.count - 1] == ':') {
+          String_View label = {
+            .count = token.count - 1,
+            .data = token.data
+          };
+
+	  if (!lasm_bind_label(lt, label, (Word) {.as_u64 = lvm->program_size})) {
+            fprintf(stderr,
+		    "%.*s:%d: ERROR: label `%.*s` is already defined\n",
+                    SV_FORMAT(input_file_path),
+                    line_number,
+                    SV_FORMAT(label));
+
+            exit(1);
+          }
+          lt->labels[lt->labels_size - 1].code = true;
+          lvm_push_symbol(lvm, label, lvm->program_size);
+	  token = sv_trim(sv_chop_by_delim(&line, ' '));
+	}
+	if (token.count > 0) {
+	  // 处理 # 和 inst 在同一行，且 #在尾部的情况
+	  String_View operand = sv_trim(sv_chop_by_delim(&line, LASM_COMMENT_SYMBOL));
+	  Inst_Type inst_type = INST_NOP;
+	  const Lasm_Macro *macro = lasm_find_macro(lt, token);
+	  Word target = {0};
+	  if (macro != NULL) {
+	    lasm_expand_macro(lvm, lt, macro, operand, input_file_path, line_number, level);
+	  } else if (inst_by_name(token, &inst_type) && inst_type == INST_CALL
+	             && lasm_is_inline(lt, operand) && lasm_label_is_code(lt, operand)
+	             && lasm_resolve_label(lt, operand, &target)
+	             && lasm_inline_call(lvm, lt, target.as_u64)) {
+	    // the routine's body took the place of the call
+	  } else if (inst_by_name(token, &inst_type)) {
+            lvm->program[lvm->program_size].type = inst_type;
+
+            if (inst_has_operand(inst_type)) {
+	      if (operand.count == 0) {
+		fprintf(stderr, "%.*s:%d: ERROR: instruction `%.*s` requires an operand\n",
+                        SV_FORMAT(input_file_path),
+                        line_number,
+			SV_FORMAT(token));
+
+		exit(1);
+	      }
+	      // expressions with labels defined further down are evaluated at the end
+	      Lasm_Expr expr = {.lt = lt, .text = operand};
+	      Lasm_Value value = {0};
+	      if (lasm_eval_expr(&expr, &value)) {
+		lvm->program[lvm->program_size].operand = value.word;
+	      } else if (expr.status == LASM_EXPR_UNKNOWN_LABEL) {
+		label_table_push_defered_operand(lt, lvm->program_size, operand);
+	      } else {
+		lasm_report_expr(&expr, input_file_path, line_number);
+              }
+	    }
+	    lvm->program_size += 1;
+	  } else {
+	    fprintf(stderr, "%.*s:%d: ERROR: unknown instruction `%.*s`\n",
+                    SV_FORMAT(input_file_path),
+                    line_number,
+                    SV_FORMAT(token));
+
+            exit(1);
+	  }
+	}
+      }
+    }
+}
+
+void lasm_translate_source(LVM *lvm, Lasm *lt,
+			  String_View input_file_path, size_t level){
+  String_View original_source = slurp_file(lt,input_file_path);
+  String_View source = original_source;
+  
+  lvm->program_size = 0;
+  int line_number = 0;
+  
+  while (source.count > 0) {
+    String_View line = sv_trim(sv_chop_by_delim(&source, '\n'));
+    line_number += 1;
+    lasm_translate_line(lvm, lt, line, input_file_path, line_number, level);
+  }
+
+  if (lt->defining != NULL && lt->defining_level == level) {
+    fprintf(stderr, "%.*s: ERROR: %%macro `%.*s` is not closed with %%endmacro\n",
+            SV_FORMAT(input_file_path), SV_FORMAT(lt->defining->name));
+    exit(1);
+  }
+
+  for (size_t i = 0; i < lt->defered_operands_size;i++) {
+    //inst 从0开始， 替换jmp指令的地址为解析label的inst地址
+    Lasm_Expr expr = {.lt = lt, .text = lt->defered_operands[i].label};
+    Lasm_Value value = {0};
+    if (!lasm_eval_expr(&expr, &value)) {
+      // TODO: second pass label resolution errors don't report the location in the source code
+      lasm_report_expr(&expr, input_file_path, 0);
+    }
+    lvm->program[lt->defered_operands[i].addr].operand = value.word;
+  }
+ //  free((void*) original_source.data);
+}
+String_View slurp_file(Lasm* lasm, String_View file_path)
+{
+  char *file_path_cstr = lasm_alloc(lasm,file_path.count + 1);
+  if (file_path_cstr == NULL) {
+    fprintf(stderr,
+            "ERROR: Could not allocate memory for the file path `%.*s`: %s\n",
+            SV_FORMAT(file_path), strerror(errno));
+    exit(1);
+  }
+
+  memcpy(file_path_cstr, file_path.data, file_path.count);
+  file_path_cstr[file_path.count] = '\0';
+
+  FILE *f = fopen(file_path_cstr, "r");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
+            file_path_cstr, strerror(errno));
+    exit(1);
+  }
+
+  if (fseek(f, 0, SEEK_END) < 0) {
+    fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
+            file_path_cstr, strerror(errno));
+    exit(1);
+  }
+
+  long m = ftell(f);
+  if (m < 0) {
+    fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
+            file_path_cstr, strerror(errno));
+    exit(1);
+  }
+
+  char *buffer = lasm_alloc(lasm,m);
+  if (buffer == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory for file: %s\n",
+            strerror(errno));
+    exit(1);
+  }
+
+  if (fseek(f, 0, SEEK_SET) < 0) {
+    fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
+            file_path_cstr, strerror(errno));
+    exit(1);
+  }
+
+  size_t n = fread(buffer, 1, m, f);
+  if (ferror(f)) {
+    fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
+            file_path_cstr, strerror(errno));
+    exit(1);
+  }
+
+  fclose(f);
+//  free(file_path_cstr);
+
+  return (String_View) {
+    .count = n,
+    .data = buffer,
+  };
+}
+
+bool lasm_resolve_label(const Lasm *lt, String_View name, Word *output)
+{
+  for (size_t i = 0; i < lt->labels_size; ++i) {
+    if (sv_eq(lt->labels[i].name, name)) {
+      *output = lt->labels[i].word;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool lasm_label_is_code(const Lasm *lt, String_View name)
+{
+  for (size_t i = 0; i < lt->labels_size; ++i) {
+    if (sv_eq(lt->labels[i].name, name)) {
+      return lt->labels[i].code;
+    }
+  }
+
+  return false;
+}
+
+bool lasm_bind_label(Lasm *lt, String_View name, Word word)
+{
+  assert(lt->labels_size < LASM_LABEL_CAPACITY);
+  Word ignore = {0};
+  if (lasm_resolve_label(lt, name, &ignore)) {
+    return false;
+  }
+
+  lt->labels[lt->labels_size++] = (Label) {.name = name, .word = word};
+  return true;
+}
+
+void label_table_push_defered_operand(Lasm *lt, Inst_Addr addr, String_View label)
+{
+    assert(lt->defered_operands_size < LASM_DEFERED_OPERANDS_CAPACITY);
+    lt->defered_operands[lt->defered_operands_size++] =
+        (Defered_Operand) {.addr = addr, .label = label};
+}
+
+void lasm_define_macro(Lasm *lt, String_View line, String_View file_path, int line_number, size_t level)
+{
+  if (lt->macro_level > 0) {
+    fprintf(stderr, "%.*s:%d: ERROR: %%macro can't be defined by a macro\n",
+            SV_FORMAT(file_path), line_number);
+    exit(1);
+  }
+
+  line = sv_trim(sv_chop_by_delim(&line, LASM_COMMENT_SYMBOL));
+  const String_View name = sv_chop_by_delim(&line, ' ');
+  Inst_Type ignore;
+  if (name.count == 0) {
+    fprintf(stderr, "%.*s:%d: ERROR: macro name is not provided\n",
+            SV_FORMAT(file_path), line_number);
+    exit(1);
+  }
+  if (inst_by_name(name, &ignore) || lasm_find_macro(lt, name) != NULL) {
+    fprintf(stderr, "%.*s:%d: ERROR: `%.*s` is already an instruction or a macro\n",
+            SV_FORMAT(file_path), line_number, SV_FORMAT(name));
+    exit(1);
+  }
+
+  assert(lt->macros_size < LASM_MACROS_CAPACITY);
+  Lasm_Macro *macro = &lt->macros[lt->macros_size++];
+  memset(macro, 0, sizeof(*macro));
+  macro->name = name;
+  while ((line = sv_trim(line)).count > 0) {
+    if (macro->params_size >= LASM_MACRO_PARAMS_CAPACITY) {
+      fprintf(stderr, "%.*s:%d: ERROR: a macro takes at most %d parameters\n",
+              SV_FORMAT(file_path), line_number, LASM_MACRO_PARAMS_CAPACITY);
+      exit(1);
+    }
+    macro->params[macro->params_size++] = sv_chop_by_delim(&line, ' ');
+  }
+
+  lt->defining = macro;
+  lt->defining_level = level;
+}
+
+// The body is kept as the span of the source from its first line to its
+// last one.
+void lasm_record_macro_line(Lasm *lt, String_View line, String_View file_path, int line_number)
+{
+  String_View rest = line;
+  const String_View token = sv_trim(sv_chop_by_delim(&rest, ' '));
+  if (sv_eq(token, cstr_as_sv("%endmacro"))) {
+    lt->defining = NULL;
+    return;
+  }
+  if (sv_eq(token, cstr_as_sv("%macro"))) {
+    fprintf(stderr, "%.*s:%d: ERROR: %%macro inside of %%macro `%.*s`\n",
+            SV_FORMAT(file_path), line_number, SV_FORMAT(lt->defining->name));
+    exit(1);
+  }
+
+  Lasm_Macro *macro = lt->defining;
+  if (macro->body.data == NULL) {
+    macro->body.data = line.data;
+  }
+  macro->body.count = (size_t) (line.data + line.count - macro->body.data);
+}
+
+const Lasm_Macro *lasm_find_macro(const Lasm *lt, String_View name)
+{
+  for (size_t i = 0; i < lt->macros_size; ++i) {
+    if (sv_eq(lt->macros[i].name, name)) {
+      return &lt->macros[i];
+    }
+  }
+  return NULL;
+}
+
+// A macro argument ends at a space outside of parentheses, strings and
+// character literals. An argument in parentheses, such as `(call f)`, is
+// passed without them.
+static String_View lasm_chop_argument(String_View *sv)
+{
+  size_t depth = 0;
+  char quote = 0;
+  size_t i = 0;
+  for (; i < sv->count; ++i) {
+    const char c = sv->data[i];
+    const bool quoted = quote != 0;
+    if (c == '\\' && quoted) {
+      i += 1;
+    } else if ((c == '"' || c == '\'') && (!quoted || c == quote)) {
+      quote = quoted ? 0 : c;
+    } else if (!quoted && c == '(') {
+      depth += 1;
+    } else if (!quoted && c == ')' && depth > 0) {
+      depth -= 1;
+    } else if (!quoted && depth == 0 && isspace(c)) {
+      break;
+    }
+  }
+
+  String_View result = {.count = i, .data = sv->data};
+  sv->data += i;
+  sv->count -= i;
+
+  depth = 0;
+  for (size_t j = 0; j < result.count; ++j) {
+    depth += result.data[j] == '(';
+    depth -= result.data[j] == ')';
+    if (depth == 0 && j + 1 < result.count) {
+      return result;
+    }
+  }
+  if (result.count >= 2 && result.data[0] == '(' && result.data[result.count - 1] == ')') {
+    result.data += 1;
+    result.count -= 2;
+  }
+  return result;
+}
+
+static bool lasm_is_name_char(char c)
+{
+  return isalnum(c) || c == '_' || c == '.';
+}
+
+// Writes `line` with the macro's parameters and labels replaced into
+// `output`, if it's not NULL, and returns the size of the result. Strings,
+// character literals and comments are left alone.
+static size_t lasm_substitute(char *output, String_View line, const Lasm_Macro *macro,
+                              const String_View *args, const String_View *locals,
+                              size_t locals_size, size_t expansion)
+{
+  char suffix[32];
+  const size_t suffix_size = (size_t) snprintf(suffix, sizeof(suffix), ".%zu", expansion);
+
+  size_t size = 0;
+  char quote = 0;
+  size_t i = 0;
+  while (i < line.count) {
+    const char c = line.data[i];
+    if (c == LASM_COMMENT_SYMBOL && quote == 0) {
+      break;
+    }
+    if (quote != 0 || !lasm_is_name_char(c)) {
+      if ((c == '"' || c == '\'') && (quote == 0 || c == quote)
+          && (i == 0 || line.data[i - 1] != '\\')) {
+        quote = quote == 0 ? c : 0;
+      }
+      if (output != NULL) {
+        output[size] = c;
+      }
+      size += 1;
+      i += 1;
+      continue;
+    }
+
+    String_View name = {.count = 0, .data = line.data + i};
+    while (i < line.count && lasm_is_name_char(line.data[i])) {
+      name.count += 1;
+      i += 1;
+    }
+
+    String_View replacement = name;
+    bool local = false;
+    for (size_t j = 0; j < macro->params_size; ++j) {
+      if (sv_eq(name, macro->params[j])) {
+        replacement = args[j];
+      }
+    }
+    for (size_t j = 0; j < locals_size; ++j) {
+      local = local || sv_eq(name, locals[j]);
+    }
+
+    if (output != NULL) {
+      memcpy(output + size, replacement.data, replacement.count);
+      if (local) {
+        memcpy(output + size + replacement.count, suffix, suffix_size);
+      }
+    }
+    size += replacement.count + (local ? suffix_size : 0);
+  }
+  return size;
+}
+
+void lasm_expand_macro(LVM *lvm, Lasm *lt, const Lasm_Macro *macro, String_View args,
+                       String_View file_path, int line_number, size_t level)
+{
+  String_View values[LASM_MACRO_PARAMS_CAPACITY];
+  size_t values_size = 0;
+  while ((args = sv_trim(args)).count > 0) {
+    const String_View value = lasm_chop_argument(&args);
+    if (values_size < LASM_MACRO_PARAMS_CAPACITY) {
+      values[values_size] = value;
+    }
+    values_size += 1;
+  }
+  if (values_size != macro->params_size) {
+    fprintf(stderr, "%.*s:%d: ERROR: macro `%.*s` takes %zu arguments, but %zu were given\n",
+            SV_FORMAT(file_path), line_number, SV_FORMAT(macro->name),
+            macro->params_size, values_size);
+    exit(1);
+  }
+  if (lt->macro_level >= LASM_MAX_MACRO_LEVEL) {
+    fprintf(stderr, "%.*s:%d: ERROR: exceeded maximum macro expansion level in `%.*s`\n",
+            SV_FORMAT(file_path), line_number, SV_FORMAT(macro->name));
+    exit(1);
+  }
+
+  // every label the body defines gets renamed
+  static String_View locals[LASM_MAX_MACRO_LEVEL][LASM_LABEL_CAPACITY];
+  String_View *own = locals[lt->macro_level];
+  size_t own_size = 0;
+  String_View body = macro->body;
+  while (body.count > 0) {
+    String_View line = sv_trim(sv_chop_by_delim(&body, '\n'));
+    const String_View token = sv_chop_by_delim(&line, ' ');
+    if (token.count > 1 && token.data[token.count - 1] == ':' && own_size < LASM_LABEL_CAPACITY) {
+      own[own_size++] = (String_View) {.count = token.count - 1, .data = token.data};
+    }
+  }
+
+  const size_t expansion = lt->expansions++;
+  lt->macro_level += 1;
+  body = macro->body;
+  while (body.count > 0) {
+    const String_View line = sv_chop_by_delim(&body, '\n');
+    const size_t size = lasm_substitute(NULL, line, macro, values, own, own_size, expansion);
+    char *text = lasm_alloc(lt, size);
+    lasm_substitute(text, line, macro, values, own, own_size, expansion);
+    lasm_translate_line(lvm, lt, sv_trim((String_View) {.count = size, .data = text}),
+                        file_path, line_number, level);
+  }
+  lt->macro_level -= 1;
+}
+
+bool lasm_is_inline(const Lasm *lt, String_View name)
+{
+  for (size_t i = 0; i < lt->inlines_size; ++i) {
+    if (sv_eq(lt->inlines[i], name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void lasm_emit_copy(LVM *lvm, Lasm *lt, Inst inst, Inst_Addr from)
+{
+  assert(lvm->program_size < LVM_PROGRAM_CAPACITY);
+  for (size_t i = 0; i < lt->defered_operands_size; ++i) {
+    if (lt->defered_operands[i].addr == from) {
+      label_table_push_defered_operand(lt, lvm->program_size, lt->defered_operands[i].label);
+      break;
+    }
+  }
+  lvm->program[lvm->program_size++] = inst;
+}
+
+// Puts a copy of the routine at `routine` where a call to it would go, if
+// it is short, straight-line code ending with ret. The return address the
+// call would push is followed through the body: when the body only ever
+// moves it with swap 1 or swap 2, it goes away and the dup and swap
+// operands reaching past it shrink by one. Otherwise the copy pushes a
+// stand-in address and drops it where the routine returns.
+bool lasm_inline_call(LVM *lvm, Lasm *lt, Inst_Addr routine)
+{
+  Inst_Addr end = routine;
+  while (end < lvm->program_size && lvm->program[end].type != INST_RET) {
+    const Inst_Type type = lvm->program[end].type;
+    if (inst_is_jump(type) || type == INST_HALT || end - routine >= LASM_INLINE_CAPACITY) {
+      return false;
+    }
+    end += 1;
+  }
+  if (end >= lvm->program_size) {
+    return false;
+  }
 
+  Inst body[LASM_INLINE_CAPACITY];
+  Inst_Addr from[LASM_INLINE_CAPACITY];
+  size_t body_size = 0;
+  // how deep the return address is
+  uint64_t depth = 0;
+  bool direct = true;
+  for (Inst_Addr i = routine; i < end && direct; ++i) {
+    Inst inst = lvm->program[i];
+    uint64_t inputs, outputs;
+    if (inst.type == INST_DUP || inst.type == INST_SWAP) {
+      const uint64_t k = inst.operand.as_u64;
+      if (inst.type == INST_SWAP && (depth == 0 || k == depth)) {
+        // moving the return address over one word is a no-op without it,
+        // over two words a swap 1, anything further a rotation
+        direct = k <= 2;
+        depth = depth == 0 ? k : 0;
+        if (k == 2) {
+          inst.operand.as_u64 = 1;
+          body[body_size] = inst;
+          from[body_size] = i;
+          body_size += 1;
         }
-      } else {
-      
-	if (token.count > 0 && token.data[token.count - 1] == ':') {
-          String_View label = {
-            .count = token.count - 1,
-            .data = token.data
-          };
+        continue;
+      }
+      direct = k != depth;
+      inst.operand.as_u64 = k > depth ? k - 1 : k;
+      depth += inst.type == INST_DUP;
+    } else if (inst_stack_effect(inst.type, inst.operand, &inputs, &outputs) && inputs <= depth) {
+      depth = depth - inputs + outputs;
+    } else {
+      direct = false;
+    }
+    body[body_size] = inst;
+    from[body_size] = i;
+    body_size += 1;
+  }
 
-	  if (!lasm_bind_label(lt, label, (Word) {.as_u64 = lvm->program_size})) {
-            fprintf(stderr,
-		    "%.*s:%d: ERROR: label `%.*s` is already defined\n",
-                    SV_FORMAT(input_file_path),
-                    line_number,
-                    SV_FORMAT(label));
+  if (direct && depth == 0) {
+    for (size_t i = 0; i < body_size; ++i) {
+      lasm_emit_copy(lvm, lt, body[i], from[i]);
+    }
+    return true;
+  }
 
-            exit(1);
-          }
-	  token = sv_trim(sv_chop_by_delim(&line, ' '));
-	}
-	if (token.count > 0) {
-	  // 处理 # 和 inst 在同一行，且 #在尾部的情况
-	  String_View operand = sv_trim(sv_chop_by_delim(&line, LASM_COMMENT_SYMBOL));
-	  Inst_Type inst_type = INST_NOP;
-	  if (inst_by_name(token, &inst_type)) {
-            lvm->program[lvm->program_size].type = inst_type;
+  const Inst_Addr after = lvm->program_size + (end - routine) + 2;
+  lasm_emit_copy(lvm, lt, (Inst) {.type = INST_PUSH, .operand = {.as_u64 = after}}, (Inst_Addr) -1);
+  for (Inst_Addr i = routine; i < end; ++i) {
+    lasm_emit_copy(lvm, lt, lvm->program[i], i);
+  }
+  lasm_emit_copy(lvm, lt, (Inst) {.type = INST_DROP}, (Inst_Addr) -1);
+  return true;
+}
 
-            if (inst_has_operand(inst_type)) {
-	      if (operand.count == 0) {
-		fprintf(stderr, "%.*s:%d: ERROR: instruction `%.*s` requires an operand\n",
-                        SV_FORMAT(input_file_path),
-                        line_number,
-			SV_FORMAT(token));
+// Constant expressions: numbers (`42`, `0x2A`, `0b101010`, `4.2e1`),
+// characters (`'*'`, `'\n'`), labels, parentheses, unary `-` and `~`, and
+// the binary operators of C from `*` `/` `%` down to `|`, with C's
+// precedence. Integers are 64-bit words: + - * wrap around, and / % >> are
+// unsigned like divi, modi and shr. A float on either side of + - * / makes
+// it a float operation, and bit operations need integers.
 
-		exit(1);
-	      }
-	      //不能转成word， 则是 jmp/call 指令中的 label
-              if (!lasm_number_literal_as_word(lt,operand,
-					  &lvm->program[lvm->program_size].operand)) {
-		label_table_push_defered_operand(lt, lvm->program_size, operand);
-              }
-	    }
-	    lvm->program_size += 1;
-	  } else {
-	    fprintf(stderr, "%.*s:%d: ERROR: unknown instruction `%.*s`\n",
-                    SV_FORMAT(input_file_path),
-                    line_number,
-                    SV_FORMAT(token));
+static bool lasm_expr_fail(Lasm_Expr *expr, const char *reason)
+{
+  if (expr->status == LASM_EXPR_OK) {
+    expr->status = LASM_EXPR_INVALID;
+    expr->reason = reason;
+  }
+  return false;
+}
 
-            exit(1);
-	  }
-	}
+static const Label *lasm_find_label(const Lasm *lt, String_View name)
+{
+  for (size_t i = 0; i < lt->labels_size; ++i) {
+    if (sv_eq(lt->labels[i].name, name)) {
+      return &lt->labels[i];
+    }
+  }
+  return NULL;
+}
+
+static bool lasm_expr_number(Lasm_Expr *expr, Lasm_Value *value)
+{
+  const String_View sv = expr->rest;
+  size_t start = 0;
+  size_t n = 0;
+  int base = 10;
+  bool f64 = false;
+  if (sv.count >= 2 && sv.data[0] == '0' && strchr("xXbB", sv.data[1]) != NULL) {
+    base = tolower(sv.data[1]) == 'x' ? 16 : 2;
+    start = n = 2;
+    while (n < sv.count && (base == 16 ? isxdigit(sv.data[n]) : sv.data[n] == '0' || sv.data[n] == '1')) {
+      n += 1;
+    }
+  } else {
+    while (n < sv.count && isdigit(sv.data[n])) {
+      n += 1;
+    }
+    if (n < sv.count && sv.data[n] == '.') {
+      f64 = true;
+      n += 1;
+      while (n < sv.count && isdigit(sv.data[n])) {
+        n += 1;
+      }
+    }
+    if (n + 1 < sv.count && (sv.data[n] == 'e' || sv.data[n] == 'E')) {
+      f64 = true;
+      n += 1;
+      if (sv.data[n] == '+' || sv.data[n] == '-') {
+        n += 1;
+      }
+      while (n < sv.count && isdigit(sv.data[n])) {
+        n += 1;
       }
     }
   }
 
-  for (size_t i = 0; i < lt->defered_operands_size;i++) {
-    String_View label = lt->defered_operands[i].label;
-    //inst 从0开始， 替换jmp指令的地址为解析label的inst地址
-    if (!lasm_resolve_label(
-			    lt,
-			    label,
-			    &lvm->program[lt->defered_operands[i].addr].operand)) {
-      // TODO: second pass label resolution errors don't report the location in the source code
-      fprintf(stderr, "%.*s: ERROR: unknown label `%.*s`\n",
-	      SV_FORMAT(input_file_path), SV_FORMAT(label));
-      exit(1);
+  char digits[64];
+  if (n == start || n - start >= sizeof(digits)
+      || (n < sv.count && lasm_is_name_char(sv.data[n]))) {
+    return lasm_expr_fail(expr, "malformed number");
+  }
+  memcpy(digits, sv.data + start, n - start);
+  digits[n - start] = '\0';
+
+  char *end = NULL;
+  value->f64 = f64;
+  if (f64) {
+    value->word.as_f64 = strtod(digits, &end);
+  } else {
+    value->word.as_u64 = strtoull(digits, &end, base);
+  }
+  if (*end != '\0') {
+    return lasm_expr_fail(expr, "malformed number");
+  }
+
+  expr->rest.data += n;
+  expr->rest.count -= n;
+  return true;
+}
+
+static bool lasm_expr_char(Lasm_Expr *expr, Lasm_Value *value)
+{
+  const String_View sv = expr->rest;
+  size_t n = 1;
+  char c = n < sv.count ? sv.data[n] : '\0';
+  if (c == '\\' && n + 1 < sv.count) {
+    n += 1;
+    switch (sv.data[n]) {
+    case 'n':  c = '\n'; break;
+    case 't':  c = '\t'; break;
+    case '0':  c = '\0'; break;
+    case '\\': c = '\\'; break;
+    case '\'': c = '\''; break;
+    case '"':  c = '"';  break;
+    default:
+      return lasm_expr_fail(expr, "unknown escape");
     }
   }
- //  free((void*) original_source.data);
+  if (n + 1 >= sv.count || sv.data[n + 1] != '\'') {
+    return lasm_expr_fail(expr, "malformed character");
+  }
+
+  value->word.as_u64 = (uint8_t) c;
+  value->f64 = false;
+  expr->rest.data += n + 2;
+  expr->rest.count -= n + 2;
+  return true;
 }
-String_View slurp_file(Lasm* lasm, String_View file_path)
+
+static bool lasm_expr_binary(Lasm_Expr *expr, int min_precedence, Lasm_Value *value);
+
+static bool lasm_expr_primary(Lasm_Expr *expr, Lasm_Value *value)
 {
-  char *file_path_cstr = lasm_alloc(lasm,file_path.count + 1);
-  if (file_path_cstr == NULL) {
-    fprintf(stderr,
-            "ERROR: Could not allocate memory for the file path `%.*s`: %s\n",
-            SV_FORMAT(file_path), strerror(errno));
-    exit(1);
+  expr->rest = sv_trim_left(expr->rest);
+  if (expr->rest.count == 0) {
+    return lasm_expr_fail(expr, "a value is missing");
   }
 
-  memcpy(file_path_cstr, file_path.data, file_path.count);
-  file_path_cstr[file_path.count] = '\0';
+  const char c = expr->rest.data[0];
+  if (c == '(' || c == '-' || c == '+' || c == '~') {
+    expr->rest.data += 1;
+    expr->rest.count -= 1;
+    if (c != '(') {
+      if (!lasm_expr_primary(expr, value)) {
+        return false;
+      }
+      if (c == '~' && value->f64) {
+        return lasm_expr_fail(expr, "`~` needs an integer");
+      }
+      if (c == '-' && value->f64) {
+        value->word.as_f64 = -value->word.as_f64;
+      } else if (c == '-') {
+        value->word.as_u64 = 0 - value->word.as_u64;
+      } else if (c == '~') {
+        value->word.as_u64 = ~value->word.as_u64;
+      }
+      return true;
+    }
 
-  FILE *f = fopen(file_path_cstr, "r");
-  if (f == NULL) {
-    fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
-            file_path_cstr, strerror(errno));
-    exit(1);
+    if (!lasm_expr_binary(expr, 1, value)) {
+      return false;
+    }
+    expr->rest = sv_trim_left(expr->rest);
+    if (expr->rest.count == 0 || expr->rest.data[0] != ')') {
+      return lasm_expr_fail(expr, "`)` is missing");
+    }
+    expr->rest.data += 1;
+    expr->rest.count -= 1;
+    return true;
   }
 
-  if (fseek(f, 0, SEEK_END) < 0) {
-    fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
-            file_path_cstr, strerror(errno));
-    exit(1);
+  if (isdigit(c) || (c == '.' && expr->rest.count > 1 && isdigit(expr->rest.data[1]))) {
+    return lasm_expr_number(expr, value);
+  }
+  if (c == '\'') {
+    return lasm_expr_char(expr, value);
+  }
+  if (!lasm_is_name_char(c)) {
+    return lasm_expr_fail(expr, "unexpected character");
   }
 
-  long m = ftell(f);
-  if (m < 0) {
-    fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
-            file_path_cstr, strerror(errno));
-    exit(1);
+  String_View name = {.count = 0, .data = expr->rest.data};
+  while (name.count < expr->rest.count && lasm_is_name_char(name.data[name.count])) {
+    name.count += 1;
   }
+  expr->rest.data += name.count;
+  expr->rest.count -= name.count;
 
-  char *buffer = lasm_alloc(lasm,m);
-  if (buffer == NULL) {
-    fprintf(stderr, "ERROR: Could not allocate memory for file: %s\n",
-            strerror(errno));
-    exit(1);
+  if (sv_eq(name, cstr_as_sv("inf")) || sv_eq(name, cstr_as_sv("nan"))) {
+    value->word.as_f64 = *name.data == 'i' ? INFINITY : NAN;
+    value->f64 = true;
+    return true;
   }
 
-  if (fseek(f, 0, SEEK_SET) < 0) {
-    fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
-            file_path_cstr, strerror(errno));
-    exit(1);
+  const Label *label = lasm_find_label(expr->lt, name);
+  if (label == NULL) {
+    if (expr->status == LASM_EXPR_OK) {
+      expr->status = LASM_EXPR_UNKNOWN_LABEL;
+      expr->label = name;
+    }
+    return false;
   }
+  value->word = label->word;
+  value->f64 = label->f64;
+  return true;
+}
 
-  size_t n = fread(buffer, 1, m, f);
-  if (ferror(f)) {
-    fprintf(stderr, "ERROR: Could not read file `%s`: %s\n",
-            file_path_cstr, strerror(errno));
-    exit(1);
+// The precedence of the binary operator `sv` starts with, 0 if it doesn't.
+static int lasm_expr_precedence(String_View sv, size_t *size)
+{
+  *size = 1;
+  if (sv.count == 0) {
+    return 0;
+  }
+  switch (sv.data[0]) {
+  case '*': case '/': case '%': return 6;
+  case '+': case '-':           return 5;
+  case '<': case '>':
+    *size = 2;
+    return sv.count >= 2 && sv.data[1] == sv.data[0] ? 4 : 0;
+  case '&':                     return 3;
+  case '^':                     return 2;
+  case '|':                     return 1;
+  default:                      return 0;
   }
+}
 
-  fclose(f);
-//  free(file_path_cstr);
+static bool lasm_expr_apply(Lasm_Expr *expr, char op, Lasm_Value *a, Lasm_Value b)
+{
+  if (a->f64 || b.f64) {
+    const double x = a->f64 ? a->word.as_f64 : (double) a->word.as_i64;
+    const double y = b.f64 ? b.word.as_f64 : (double) b.word.as_i64;
+    switch (op) {
+    case '+': a->word.as_f64 = x + y; break;
+    case '-': a->word.as_f64 = x - y; break;
+    case '*': a->word.as_f64 = x * y; break;
+    case '/': a->word.as_f64 = x / y; break;
+    default:
+      return lasm_expr_fail(expr, "bit operations and `%` need integers");
+    }
+    a->f64 = true;
+    return true;
+  }
 
-  return (String_View) {
-    .count = n,
-    .data = buffer,
-  };
+  const uint64_t x = a->word.as_u64;
+  const uint64_t y = b.word.as_u64;
+  if ((op == '/' || op == '%') && y == 0) {
+    return lasm_expr_fail(expr, "division by zero");
+  }
+  if ((op == '<' || op == '>') && y >= 64) {
+    return lasm_expr_fail(expr, "shift by 64 or more");
+  }
+  switch (op) {
+  case '*': a->word.as_u64 = x * y;  break;
+  case '/': a->word.as_u64 = x / y;  break;
+  case '%': a->word.as_u64 = x % y;  break;
+  case '+': a->word.as_u64 = x + y;  break;
+  case '-': a->word.as_u64 = x - y;  break;
+  case '<': a->word.as_u64 = x << y; break;
+  case '>': a->word.as_u64 = x >> y; break;
+  case '&': a->word.as_u64 = x & y;  break;
+  case '^': a->word.as_u64 = x ^ y;  break;
+  case '|': a->word.as_u64 = x | y;  break;
+  default:  assert(false && "unreachable");
+  }
+  return true;
 }
 
-bool lasm_resolve_label(const Lasm *lt, String_View name, Word *output)
+static bool lasm_expr_binary(Lasm_Expr *expr, int min_precedence, Lasm_Value *value)
 {
-  for (size_t i = 0; i < lt->labels_size; ++i) {
-    if (sv_eq(lt->labels[i].name, name)) {
-      *output = lt->labels[i].word;
+  if (!lasm_expr_primary(expr, value)) {
+    return false;
+  }
+
+  for (;;) {
+    expr->rest = sv_trim_left(expr->rest);
+    size_t size = 0;
+    const int precedence = lasm_expr_precedence(expr->rest, &size);
+    if (precedence == 0 || precedence < min_precedence) {
       return true;
     }
-  }
 
-  return false;
+    const char op = expr->rest.data[0];
+    expr->rest.data += size;
+    expr->rest.count -= size;
+    Lasm_Value rhs = {0};
+    if (!lasm_expr_binary(expr, precedence + 1, &rhs) || !lasm_expr_apply(expr, op, value, rhs)) {
+      return false;
+    }
+  }
 }
 
-bool lasm_bind_label(Lasm *lt, String_View name, Word word)
+// A label is looked up by the whole text first, so names that read like
+// expressions, such as `a-b`, still work as operands.
+bool lasm_eval_expr(Lasm_Expr *expr, Lasm_Value *value)
 {
-  assert(lt->labels_size < LASM_LABEL_CAPACITY);
-  Word ignore = {0};
-  if (lasm_resolve_label(lt, name, &ignore)) {
-    return false;
+  expr->text = sv_trim(expr->text);
+  expr->rest = expr->text;
+  expr->status = LASM_EXPR_OK;
+
+  const Label *label = lasm_find_label(expr->lt, expr->text);
+  if (label != NULL) {
+    value->word = label->word;
+    value->f64 = label->f64;
+    return true;
   }
 
-  lt->labels[lt->labels_size++] = (Label) {.name = name, .word = word};
+  if (!lasm_expr_binary(expr, 1, value)) {
+    return false;
+  }
+  expr->rest = sv_trim(expr->rest);
+  if (expr->rest.count > 0) {
+    return lasm_expr_fail(expr, "unexpected text after the expression");
+  }
   return true;
 }
 
-void label_table_push_defered_operand(Lasm *lt, Inst_Addr addr, String_View label)
+// line_number is 0 when the expression was deferred to the end of the file.
+void lasm_report_expr(const Lasm_Expr *expr, String_View file_path, int line_number)
 {
-    assert(lt->defered_operands_size < LASM_DEFERED_OPERANDS_CAPACITY);
-    lt->defered_operands[lt->defered_operands_size++] =
-        (Defered_Operand) {.addr = addr, .label = label};
+  char location[32] = "";
+  if (line_number > 0) {
+    snprintf(location, sizeof(location), ":%d", line_number);
+  }
+
+  if (expr->status == LASM_EXPR_UNKNOWN_LABEL) {
+    fprintf(stderr, "%.*s%s: ERROR: unknown label `%.*s`\n",
+            SV_FORMAT(file_path), location, SV_FORMAT(expr->label));
+  } else {
+    fprintf(stderr, "%.*s%s: ERROR: `%.*s` is not a valid expression: %s\n",
+            SV_FORMAT(file_path), location, SV_FORMAT(expr->text), expr->reason);
+  }
+  exit(1);
+}
+
+// Data directives: `%<directive> <name> <values>...` appends the values to
+// the data segment and binds <name> to the memory address of the first one.
+//   %byte   numbers 0..255
+//   %u64    numbers, 8 byte aligned
+//   %f64    floating point numbers, 8 byte aligned
+// Values are constant expressions of labels defined before them and are
+// separated by spaces, so one with spaces in it goes in parentheses.
+//   %string "text" with \n \t \0 \\ \" escapes, no terminator is added
+//   %incbin "path" the contents of a file
+bool lasm_is_data_directive(String_View directive)
+{
+  return sv_eq(directive, cstr_as_sv("byte"))
+    || sv_eq(directive, cstr_as_sv("u64"))
+    || sv_eq(directive, cstr_as_sv("f64"))
+    || sv_eq(directive, cstr_as_sv("string"))
+    || sv_eq(directive, cstr_as_sv("incbin"));
+}
+
+void lasm_emit_data(LVM *lvm, const void *bytes, size_t size, size_t alignment,
+                    String_View file_path, int line_number)
+{
+  const uint64_t addr = (lvm->data_size + alignment - 1) / alignment * alignment;
+  if (addr > LVM_MEMORY_CAPACITY || size > LVM_MEMORY_CAPACITY - addr) {
+    fprintf(stderr, "%.*s:%d: ERROR: data segment exceeds the memory capacity of %d bytes\n",
+            SV_FORMAT(file_path), line_number, LVM_MEMORY_CAPACITY);
+    exit(1);
+  }
+
+  static const uint8_t zeros[8] = {0};
+  lvm_memory_write(lvm, lvm->data_size, zeros, addr - lvm->data_size);
+  if (size > 0) {
+    lvm_memory_write(lvm, addr, bytes, size);
+  }
+  lvm->data_size = addr + size;
+}
+
+void lasm_translate_data(LVM *lvm, Lasm *lt, String_View directive, String_View line,
+                         String_View file_path, int line_number)
+{
+  line = sv_trim(line);
+  String_View name = sv_chop_by_delim(&line, ' ');
+  line = sv_trim(line);
+  if (name.count == 0) {
+    fprintf(stderr, "%.*s:%d: ERROR: %%%.*s requires a name\n",
+            SV_FORMAT(file_path), line_number, SV_FORMAT(directive));
+    exit(1);
+  }
+
+  const bool aligned = sv_eq(directive, cstr_as_sv("u64")) || sv_eq(directive, cstr_as_sv("f64"));
+  if (aligned) {
+    lasm_emit_data(lvm, NULL, 0, 8, file_path, line_number);
+  }
+  if (!lasm_bind_label(lt, name, (Word) {.as_u64 = lvm->data_size})) {
+    fprintf(stderr, "%.*s:%d: ERROR: label `%.*s` is already defined\n",
+            SV_FORMAT(file_path), line_number, SV_FORMAT(name));
+    exit(1);
+  }
+
+  if (sv_eq(directive, cstr_as_sv("string")) || sv_eq(directive, cstr_as_sv("incbin"))) {
+    if (line.count < 2 || line.data[0] != '"') {
+      fprintf(stderr, "%.*s:%d: ERROR: %%%.*s expects a quoted string\n",
+              SV_FORMAT(file_path), line_number, SV_FORMAT(directive));
+      exit(1);
+    }
+
+    char *text = lasm_alloc(lt, line.count);
+    size_t size = 0;
+    size_t i = 1;
+    for (; i < line.count && line.data[i] != '"'; ++i) {
+      char c = line.data[i];
+      if (c == '\\' && i + 1 < line.count) {
+        i += 1;
+        switch (line.data[i]) {
+        case 'n':  c = '\n'; break;
+        case 't':  c = '\t'; break;
+        case '0':  c = '\0'; break;
+        case '\\': c = '\\'; break;
+        case '"':  c = '"';  break;
+        default:
+          fprintf(stderr, "%.*s:%d: ERROR: unknown escape `\\%c`\n",
+                  SV_FORMAT(file_path), line_number, line.data[i]);
+          exit(1);
+        }
+      }
+      text[size++] = c;
+    }
+    if (i >= line.count) {
+      fprintf(stderr, "%.*s:%d: ERROR: unterminated string\n",
+              SV_FORMAT(file_path), line_number);
+      exit(1);
+    }
+
+    if (sv_eq(directive, cstr_as_sv("string"))) {
+      lasm_emit_data(lvm, text, size, 1, file_path, line_number);
+    } else {
+      const String_View contents = slurp_file(lt, (String_View) {.count = size, .data = text});
+      lasm_emit_data(lvm, contents.data, contents.count, 1, file_path, line_number);
+    }
+    return;
+  }
+
+  line = sv_trim(sv_chop_by_delim(&line, LASM_COMMENT_SYMBOL));
+  while (line.count > 0) {
+    const String_View value = lasm_chop_argument(&line);
+    line = sv_trim(line);
+
+    Lasm_Expr expr = {.lt = lt, .text = value};
+    Lasm_Value result = {0};
+    if (!lasm_eval_expr(&expr, &result)) {
+      lasm_report_expr(&expr, file_path, line_number);
+    }
+    Word word = result.word;
+    if (sv_eq(directive, cstr_as_sv("f64")) && !result.f64) {
+      word.as_f64 = (double) word.as_i64;
+    }
+
+    if (sv_eq(directive, cstr_as_sv("byte")) && word.as_u64 > 0xFF) {
+      fprintf(stderr, "%.*s:%d: ERROR: `%.*s` is not a valid %%%.*s value\n",
+              SV_FORMAT(file_path), line_number, SV_FORMAT(value), SV_FORMAT(directive));
+      exit(1);
+    }
+
+    if (sv_eq(directive, cstr_as_sv("byte"))) {
+      const uint8_t byte = (uint8_t) word.as_u64;
+      lasm_emit_data(lvm, &byte, 1, 1, file_path, line_number);
+    } else {
+      lasm_emit_data(lvm, &word, sizeof(word), 8, file_path, line_number);
+      if (lasm_label_is_code(lt, value)) {
+        assert(lt->code_words_size < LASM_CODE_WORDS_CAPACITY);
+        lt->code_words[lt->code_words_size++] = lvm->data_size - sizeof(word);
+      }
+    }
+  }
 }
 
 #endif
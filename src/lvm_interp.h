@@ -0,0 +1,896 @@
+// The instruction interpreter. lvm.h includes it once per variant, with
+// these defined:
+//
+//   LVM_INTERP_NAME     the function to define
+//   LVM_INTERP_STEP     1: Err NAME(LVM *lvm) runs one instruction
+//                       0: Err NAME(LVM *lvm, uint64_t *counts) runs until
+//                          the VM halts or fails, and must not be entered
+//                          halted
+//   LVM_INTERP_FUEL     charge fuel and stop when it runs out
+//   LVM_INTERP_TRACE    record control transfers in the trace
+//   LVM_INTERP_PROFILE  count how often every instruction runs in counts[pc]
+//
+// FUEL and TRACE may be expressions of `lvm`, checked at every control
+// transfer. A variant that has them at 0 has no code for them at all.
+// Control transfers are handled as in lvm_transfer().
+
+#if LVM_INTERP_STEP
+Err LVM_INTERP_NAME(LVM *lvm);
+Err LVM_INTERP_NAME(LVM *lvm)
+#else
+Err LVM_INTERP_NAME(LVM *lvm, uint64_t *counts);
+Err LVM_INTERP_NAME(LVM *lvm, uint64_t *counts)
+#endif
+{
+#if !LVM_INTERP_STEP && !LVM_INTERP_PROFILE
+  (void) counts;
+#endif
+  do {
+    if (lvm->pc >= lvm->program_size) {
+      return ERR_ILLEGAL_INST_ACCESS;
+    }
+
+    const Inst_Addr pc = lvm->pc;
+    Inst inst = lvm->program[pc];
+#if LVM_INTERP_PROFILE
+    counts[pc] += 1;
+#endif
+
+    switch (inst.type) {
+    case INST_NOP: 
+      lvm->pc += 1;
+      break;
+
+    case INST_PUSH:
+      if (lvm->stack_size >= LVM_STACK_CAPACITY) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size++]= inst.operand;
+      lvm->pc += 1;
+      break;
+    case INST_DROP:
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_PLUSI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 += lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -=1;
+      lvm->pc +=1;
+      break;
+    case INST_MINUSI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 -= lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -=1;
+      lvm->pc +=1;
+      break;
+    case INST_DIVI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size -1].as_u64 == 0) {
+        return ERR_DIV_BY_ZERO;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 /= lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -=1;
+      lvm->pc +=1;
+      break;
+    case INST_MULTI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 *= lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -=1;
+      lvm->pc +=1;
+      break;
+    case INST_PLUSF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 2].as_f64 += lvm->stack[lvm->stack_size - 1].as_f64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_MINUSF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 2].as_f64 -= lvm->stack[lvm->stack_size - 1].as_f64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_MULTF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 2].as_f64 *= lvm->stack[lvm->stack_size - 1].as_f64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_DIVF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 2].as_f64 /= lvm->stack[lvm->stack_size - 1].as_f64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_JMP:
+      lvm->pc = inst.operand.as_u64;
+      break;
+    case INST_RET:
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->pc = lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      break;
+    case INST_CALL:
+      if (lvm->stack_size >= LVM_STACK_CAPACITY) {
+        return ERR_STACK_OVERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size++].as_u64 = lvm->pc + 1;
+      lvm->pc = inst.operand.as_u64;
+      break;
+    case INST_NATIVE: {
+      if (inst.operand.as_u64 >= lvm->natives_size) {
+        return ERR_ILLEGAL_OPERAND;
+      }
+      const LVM_Native_Def *def = &lvm->natives[inst.operand.as_u64];
+      if (def->native != NULL) {
+        const Err err = def->native(lvm);
+        if (err != ERR_OK) {
+          return err;
+        }
+      } else if (def->plugin != NULL) {
+        if (lvm->stack_size < def->inputs) {
+          return ERR_STACK_UNDERFLOW;
+        }
+        if (lvm->stack_size - def->inputs + def->outputs > LVM_STACK_CAPACITY) {
+          return ERR_STACK_OVERFLOW;
+        }
+        const Err err = def->plugin(&lvm->stack[lvm->stack_size - def->inputs]);
+        if (err != ERR_OK) {
+          return err;
+        }
+        lvm->stack_size = lvm->stack_size - def->inputs + def->outputs;
+      } else {
+        return ERR_ILLEGAL_OPERAND;
+      }
+      lvm->pc += 1;
+    } break;
+    case INST_HALT:
+      lvm->halt = 1;
+      break;
+    case INST_EQ:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 1].as_u64 == lvm->stack[lvm->stack_size - 2].as_u64;
+      lvm->stack_size -=1;
+      lvm->pc +=1;
+      break;
+    case INST_GEF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 1].as_f64 >= lvm->stack[lvm->stack_size - 2].as_f64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_JMP_IF:
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size -1].as_u64) {
+        lvm->pc = inst.operand.as_u64;
+      }else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 1;
+      break;
+    case INST_PRINT_DEBUG:
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      fprintf(stdout, "  u64: %" PRIu64 ", i64: %" PRId64 ", f64: %lf, ptr: %p\n",
+              lvm->stack[lvm->stack_size - 1].as_u64,
+              lvm->stack[lvm->stack_size - 1].as_i64,
+              lvm->stack[lvm->stack_size - 1].as_f64,
+              lvm->stack[lvm->stack_size - 1].as_ptr);
+      lvm->stack_size -=1;
+      lvm->pc +=1;
+      break;
+    case INST_DUP:
+      if (lvm->stack_size >= LVM_STACK_CAPACITY) {
+        return ERR_STACK_OVERFLOW;
+      }
+      if (inst.operand.as_u64 >= lvm->stack_size) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size] = lvm->stack[lvm->stack_size - 1 - inst.operand.as_u64];
+      lvm->stack_size += 1;
+      lvm->pc += 1;
+      break;
+    case INST_SWAP:
+      if (inst.operand.as_u64 >= lvm->stack_size) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const uint64_t a = lvm->stack_size - 1;
+      const uint64_t b = lvm->stack_size - 1 - inst.operand.as_u64;
+      Word t = lvm->stack[a];
+      lvm->stack[a] = lvm->stack[b];
+      lvm->stack[b] = t;
+      lvm->pc += 1;
+      break;
+    case INST_NOT:
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 1].as_u64 = !lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->pc += 1;
+      break;
+    case INST_ANDB:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 & lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+
+      break;
+
+    case INST_ORB:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 | lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+
+    case INST_XOR:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 ^ lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+
+    case INST_SHR:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 >> lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+
+    case INST_SHL:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 << lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+
+    case INST_NOTB:
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+
+      lvm->stack[lvm->stack_size - 1].as_u64 = ~lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->pc += 1;
+      break;
+    case INST_READ8: {
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_load(lvm, lvm->stack[lvm->stack_size - 1].as_u64, 1, false,
+                                      &lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->pc += 1;
+    } break;
+
+    case INST_READ16: {
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_load(lvm, lvm->stack[lvm->stack_size - 1].as_u64, 2, false,
+                                      &lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->pc += 1;
+    } break;
+
+    case INST_READ32: {
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_load(lvm, lvm->stack[lvm->stack_size - 1].as_u64, 4, false,
+                                      &lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->pc += 1;
+    } break;
+
+    case INST_READ64: {
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_load(lvm, lvm->stack[lvm->stack_size - 1].as_u64, 8, false,
+                                      &lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->pc += 1;
+    } break;
+
+    case INST_WRITE8: {
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_store(lvm, lvm->stack[lvm->stack_size - 2].as_u64, 1, false,
+                                       lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->stack_size -= 2;
+      lvm->pc += 1;
+    } break;
+
+    case INST_WRITE16: {
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_store(lvm, lvm->stack[lvm->stack_size - 2].as_u64, 2, false,
+                                       lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->stack_size -= 2;
+      lvm->pc += 1;
+    } break;
+
+    case INST_WRITE32: {
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_store(lvm, lvm->stack[lvm->stack_size - 2].as_u64, 4, false,
+                                       lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->stack_size -= 2;
+      lvm->pc += 1;
+    } break;
+
+    case INST_WRITE64: {
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_store(lvm, lvm->stack[lvm->stack_size - 2].as_u64, 8, false,
+                                       lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->stack_size -= 2;
+      lvm->pc += 1;
+    } break;
+
+    case INST_NE:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 != lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_LTI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_i64 < lvm->stack[lvm->stack_size - 1].as_i64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_LEI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_i64 <= lvm->stack[lvm->stack_size - 1].as_i64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_GTI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_i64 > lvm->stack[lvm->stack_size - 1].as_i64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_GEI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_i64 >= lvm->stack[lvm->stack_size - 1].as_i64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_LTU:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 < lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_LEU:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 <= lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_GTU:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 > lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_GEU:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_u64 >= lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_EQF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_f64 == lvm->stack[lvm->stack_size - 1].as_f64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_NEF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_f64 != lvm->stack[lvm->stack_size - 1].as_f64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_LTF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_f64 < lvm->stack[lvm->stack_size - 1].as_f64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_LEF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_f64 <= lvm->stack[lvm->stack_size - 1].as_f64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_GTF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 2].as_u64 = lvm->stack[lvm->stack_size - 2].as_f64 > lvm->stack[lvm->stack_size - 1].as_f64;
+      lvm->stack_size -= 1;
+      lvm->pc += 1;
+      break;
+    case INST_JEQ:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_u64 == lvm->stack[lvm->stack_size - 1].as_u64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JNE:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_u64 != lvm->stack[lvm->stack_size - 1].as_u64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JLTI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_i64 < lvm->stack[lvm->stack_size - 1].as_i64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JLEI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_i64 <= lvm->stack[lvm->stack_size - 1].as_i64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JGTI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_i64 > lvm->stack[lvm->stack_size - 1].as_i64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JGEI:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_i64 >= lvm->stack[lvm->stack_size - 1].as_i64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JLTU:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_u64 < lvm->stack[lvm->stack_size - 1].as_u64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JLEU:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_u64 <= lvm->stack[lvm->stack_size - 1].as_u64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JGTU:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_u64 > lvm->stack[lvm->stack_size - 1].as_u64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JGEU:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_u64 >= lvm->stack[lvm->stack_size - 1].as_u64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JLTF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_f64 < lvm->stack[lvm->stack_size - 1].as_f64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JLEF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_f64 <= lvm->stack[lvm->stack_size - 1].as_f64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JGTF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_f64 > lvm->stack[lvm->stack_size - 1].as_f64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_JGEF:
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      if (lvm->stack[lvm->stack_size - 2].as_f64 >= lvm->stack[lvm->stack_size - 1].as_f64) {
+        lvm->pc = inst.operand.as_u64;
+      } else {
+        lvm->pc += 1;
+      }
+      lvm->stack_size -= 2;
+      break;
+    case INST_I2F:
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 1].as_f64 = (double) lvm->stack[lvm->stack_size - 1].as_i64;
+      lvm->pc += 1;
+      break;
+    case INST_U2F:
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 1].as_f64 = (double) lvm->stack[lvm->stack_size - 1].as_u64;
+      lvm->pc += 1;
+      break;
+    case INST_F2I:
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 1].as_i64 = lvm_f64_to_i64(lvm->stack[lvm->stack_size - 1].as_f64);
+      lvm->pc += 1;
+      break;
+    case INST_F2U:
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size - 1].as_u64 = lvm_f64_to_u64(lvm->stack[lvm->stack_size - 1].as_f64);
+      lvm->pc += 1;
+      break;
+    case INST_FMAF:
+      if (lvm->stack_size < 3) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      // a b c fmaf => a * b + c, rounded once
+      lvm->stack[lvm->stack_size - 3].as_f64 = fma(lvm->stack[lvm->stack_size - 3].as_f64,
+                                                   lvm->stack[lvm->stack_size - 2].as_f64,
+                                                   lvm->stack[lvm->stack_size - 1].as_f64);
+      lvm->stack_size -= 2;
+      lvm->pc += 1;
+      break;
+
+    case INST_READ16BE: {
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_load(lvm, lvm->stack[lvm->stack_size - 1].as_u64, 2, true,
+                                      &lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->pc += 1;
+    } break;
+
+    case INST_READ32BE: {
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_load(lvm, lvm->stack[lvm->stack_size - 1].as_u64, 4, true,
+                                      &lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->pc += 1;
+    } break;
+
+    case INST_READ64BE: {
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_load(lvm, lvm->stack[lvm->stack_size - 1].as_u64, 8, true,
+                                      &lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->pc += 1;
+    } break;
+
+    case INST_WRITE16BE: {
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_store(lvm, lvm->stack[lvm->stack_size - 2].as_u64, 2, true,
+                                       lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->stack_size -= 2;
+      lvm->pc += 1;
+    } break;
+
+    case INST_WRITE32BE: {
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_store(lvm, lvm->stack[lvm->stack_size - 2].as_u64, 4, true,
+                                       lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->stack_size -= 2;
+      lvm->pc += 1;
+    } break;
+
+    case INST_WRITE64BE: {
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Err err = lvm_memory_store(lvm, lvm->stack[lvm->stack_size - 2].as_u64, 8, true,
+                                       lvm->stack[lvm->stack_size - 1].as_u64);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->stack_size -= 2;
+      lvm->pc += 1;
+    } break;
+
+    case INST_AREAD32:
+    case INST_AREAD64:
+    case INST_AWRITE32:
+    case INST_AWRITE64:
+    case INST_AADD32:
+    case INST_AADD64:
+    case INST_ACAS32:
+    case INST_ACAS64:
+    case INST_FENCE: {
+      const Err err = lvm_execute_atomic(lvm, inst.type);
+      if (err != ERR_OK) {
+        return err;
+      }
+      lvm->pc += 1;
+    } break;
+
+    // same checks and errors as push, dup and swap
+    case INST_PUSH0:
+    case INST_PUSH1:
+      if (lvm->stack_size >= LVM_STACK_CAPACITY) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size++].as_u64 = inst.type == INST_PUSH1;
+      lvm->pc += 1;
+      break;
+    case INST_DUP0:
+      if (lvm->stack_size >= LVM_STACK_CAPACITY) {
+        return ERR_STACK_OVERFLOW;
+      }
+      if (lvm->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size] = lvm->stack[lvm->stack_size - 1];
+      lvm->stack_size += 1;
+      lvm->pc += 1;
+      break;
+    case INST_DUP1:
+      if (lvm->stack_size >= LVM_STACK_CAPACITY) {
+        return ERR_STACK_OVERFLOW;
+      }
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size] = lvm->stack[lvm->stack_size - 2];
+      lvm->stack_size += 1;
+      lvm->pc += 1;
+      break;
+    case INST_DUP2:
+      if (lvm->stack_size >= LVM_STACK_CAPACITY) {
+        return ERR_STACK_OVERFLOW;
+      }
+      if (lvm->stack_size < 3) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      lvm->stack[lvm->stack_size] = lvm->stack[lvm->stack_size - 3];
+      lvm->stack_size += 1;
+      lvm->pc += 1;
+      break;
+    case INST_SWAP1: {
+      if (lvm->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Word top = lvm->stack[lvm->stack_size - 1];
+      lvm->stack[lvm->stack_size - 1] = lvm->stack[lvm->stack_size - 2];
+      lvm->stack[lvm->stack_size - 2] = top;
+      lvm->pc += 1;
+    } break;
+    case INST_SWAP2: {
+      if (lvm->stack_size < 3) {
+        return ERR_STACK_UNDERFLOW;
+      }
+      const Word top = lvm->stack[lvm->stack_size - 1];
+      lvm->stack[lvm->stack_size - 1] = lvm->stack[lvm->stack_size - 3];
+      lvm->stack[lvm->stack_size - 3] = top;
+      lvm->pc += 1;
+    } break;
+
+    case NUMBER_OF_INSTS:
+    default:
+      return ERR_ILLEGAL_INST;
+    }
+
+    if (lvm->pc != pc + 1) {
+      if (LVM_INTERP_TRACE) {
+        lvm_trace_record(lvm, pc, inst.type);
+      }
+      if (LVM_INTERP_FUEL) {
+        lvm->fuel_used += pc + 1 - lvm->fuel_run;
+        lvm->fuel_run = lvm->pc;
+      }
+      if (!lvm->halt && (lvm->pc <= pc || inst.type == INST_CALL)) {
+        if (lvm_interrupt) {
+          return ERR_INTERRUPTED;
+        }
+        if (LVM_INTERP_FUEL && lvm->fuel_used >= lvm->fuel_limit) {
+          return ERR_OUT_OF_FUEL;
+        }
+      }
+    }
+  } while (!LVM_INTERP_STEP && !lvm->halt);
+
+  return ERR_OK;
+}
+
+#undef LVM_INTERP_NAME
+#undef LVM_INTERP_STEP
+#undef LVM_INTERP_FUEL
+#undef LVM_INTERP_TRACE
+#undef LVM_INTERP_PROFILE
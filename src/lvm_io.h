@@ -0,0 +1,468 @@
+#ifndef LVM_IO_H
+#define LVM_IO_H
+#include "./lvm.h"
+#include "./lvm_reg.h"
+#include <poll.h>
+#include <pthread.h>
+
+// Non-blocking I/O natives and the scheduler that runs VM contexts while
+// others wait for it.
+//
+// A context is a VM; `spawn` starts a new one as a fork of the caller. The
+// scheduler runs the contexts round-robin, LVM_IO_SLICE instructions at a
+// time. When an io_* native would block, it parks its context on the file
+// descriptor and returns ERR_WOULD_BLOCK with the pc still on the native;
+// once poll() reports the descriptor ready the native simply runs again.
+// The process only sleeps when every context is parked.
+//
+// poll() reports regular files as always ready, however slow the disk, so
+// when another context could run meanwhile a read or write of a regular
+// file is handed to a helper thread instead. The context parks on a pipe
+// the helper writes to once the transfer is done, and the native, running
+// again, picks up the result.
+//
+// Outside of the scheduler (--check-reg, --perf, lbench) and in parallel_for
+// workers the io_* natives block and spawn fails.
+
+#define LVM_IO_CONTEXTS_CAPACITY 64
+#define LVM_IO_SLICE 4096
+#define LVM_IO_CHUNK 4096
+
+typedef enum {
+  LVM_IO_READ = 0,
+  LVM_IO_WRITE,
+  LVM_IO_APPEND,
+} LVM_Io_Mode;
+
+typedef struct {
+  pthread_t thread;
+  int fd;
+  bool write;
+  uint8_t chunk[LVM_IO_CHUNK];
+  size_t count;
+  ssize_t result;
+  // the helper writes a byte to done[1] when it is finished
+  int done[2];
+} LVM_Io_Request;
+
+typedef struct {
+  LVM *vm;
+  // instructions left, negative for no limit
+  int64_t budget;
+  // -1 unless the context is parked
+  int wait_fd;
+  short wait_events;
+  // NULL unless a helper thread is doing a transfer for the context
+  LVM_Io_Request *request;
+} LVM_Context;
+
+typedef struct {
+  LVM_Context contexts[LVM_IO_CONTEXTS_CAPACITY];
+  size_t contexts_size;
+  size_t current;
+  bool running;
+} LVM_Scheduler;
+
+LVM_Scheduler scheduler = {0};
+
+Err lvm_io_open(LVM *lvm);
+Err lvm_io_close(LVM *lvm);
+Err lvm_io_read(LVM *lvm);
+Err lvm_io_write(LVM *lvm);
+Err lvm_io_spawn(LVM *lvm);
+void lvm_io_register_natives(LVM_Native_Table *table);
+Err lvm_io_run(LVM *lvm, const Reg_Program *rp, int64_t limit);
+
+// ERR_OK once `fd` is ready. Under the scheduler a context that would have
+// to wait is parked instead. VMs that are not the running context, such as
+// parallel_for workers, just wait.
+static Err lvm_io_wait(const LVM *lvm, int fd, short events)
+{
+  struct pollfd p = {.fd = fd, .events = events, .revents = 0};
+  if (!scheduler.running || scheduler.contexts[scheduler.current].vm != lvm) {
+    while (poll(&p, 1, -1) < 0 && errno == EINTR) {}
+    return ERR_OK;
+  }
+  if (poll(&p, 1, 0) > 0) {
+    return ERR_OK;
+  }
+
+  LVM_Context *context = &scheduler.contexts[scheduler.current];
+  context->wait_fd = fd;
+  context->wait_events = events;
+  return ERR_WOULD_BLOCK;
+}
+
+static void *lvm_io_transfer(void *arg)
+{
+  LVM_Io_Request *request = arg;
+  do {
+    request->result = request->write
+      ? write(request->fd, request->chunk, request->count)
+      : read(request->fd, request->chunk, request->count);
+  } while (request->result < 0 && errno == EINTR);
+
+  const uint8_t byte = 0;
+  while (write(request->done[1], &byte, 1) < 0 && errno == EINTR) {}
+  return NULL;
+}
+
+// Waits for the helper thread, if it is still running, and frees the request.
+static void lvm_io_finish(LVM_Context *context)
+{
+  LVM_Io_Request *request = context->request;
+  if (request == NULL) {
+    return;
+  }
+  pthread_join(request->thread, NULL);
+  close(request->done[0]);
+  close(request->done[1]);
+  free(request);
+  context->request = NULL;
+}
+
+// Transfers `count` bytes between `chunk` and the regular file `fd` on a
+// helper thread when the running context could otherwise hold up the others.
+// Returns false if the caller should do the transfer itself. Otherwise `*err`
+// is ERR_WOULD_BLOCK with the context parked until the transfer is done, and
+// then, once the native runs again, ERR_OK with the result in `*n`.
+static bool lvm_io_offload(const LVM *lvm, int fd, bool write, uint8_t *chunk, size_t count, ssize_t *n, Err *err)
+{
+  if (!scheduler.running || scheduler.contexts[scheduler.current].vm != lvm) {
+    return false;
+  }
+
+  LVM_Context *context = &scheduler.contexts[scheduler.current];
+  if (context->request != NULL) {
+    *n = context->request->result;
+    if (!write && *n > 0) {
+      memcpy(chunk, context->request->chunk, (size_t) *n);
+    }
+    lvm_io_finish(context);
+    *err = ERR_OK;
+    return true;
+  }
+
+  // with nothing else to run, blocking on the file costs nothing
+  struct stat st;
+  if (scheduler.contexts_size < 2 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+
+  LVM_Io_Request *request = malloc(sizeof(LVM_Io_Request));
+  if (request == NULL) {
+    return false;
+  }
+  request->fd = fd;
+  request->write = write;
+  request->count = count;
+  request->result = -1;
+  if (write) {
+    memcpy(request->chunk, chunk, count);
+  }
+  if (pipe(request->done) < 0) {
+    free(request);
+    return false;
+  }
+  if (pthread_create(&request->thread, NULL, lvm_io_transfer, request) != 0) {
+    close(request->done[0]);
+    close(request->done[1]);
+    free(request);
+    return false;
+  }
+
+  context->request = request;
+  context->wait_fd = request->done[0];
+  context->wait_events = POLLIN;
+  *err = ERR_WOULD_BLOCK;
+  return true;
+}
+
+// path_addr path_size mode -- fd
+// mode is an LVM_Io_Mode. Pushes -1 if the file can't be opened.
+Err lvm_io_open(LVM *lvm)
+{
+  if (lvm->stack_size < 3) {
+    return ERR_STACK_UNDERFLOW;
+  }
+
+  const Memory_Addr path_addr = lvm->stack[lvm->stack_size - 3].as_u64;
+  const uint64_t path_size = lvm->stack[lvm->stack_size - 2].as_u64;
+  const uint64_t mode = lvm->stack[lvm->stack_size - 1].as_u64;
+
+  int flags = O_NONBLOCK;
+  if (mode == LVM_IO_READ) {
+    flags |= O_RDONLY;
+  } else if (mode == LVM_IO_WRITE) {
+    flags |= O_WRONLY | O_CREAT | O_TRUNC;
+  } else if (mode == LVM_IO_APPEND) {
+    flags |= O_WRONLY | O_CREAT | O_APPEND;
+  } else {
+    return ERR_ILLEGAL_OPERAND;
+  }
+
+  char path[LVM_SEGMENT_PATH_CAPACITY];
+  if (path_size >= sizeof(path)) {
+    return ERR_ILLEGAL_OPERAND;
+  }
+  const Err err = lvm_memory_read(lvm, path_addr, path, path_size);
+  if (err != ERR_OK) {
+    return err;
+  }
+  path[path_size] = '\0';
+
+  lvm->stack[lvm->stack_size - 3].as_i64 = open(path, flags, 0644);
+  lvm->stack_size -= 2;
+  return ERR_OK;
+}
+
+// fd --
+Err lvm_io_close(LVM *lvm)
+{
+  if (lvm->stack_size < 1) {
+    return ERR_STACK_UNDERFLOW;
+  }
+
+  close((int) lvm->stack[lvm->stack_size - 1].as_i64);
+  lvm->stack_size -= 1;
+  return ERR_OK;
+}
+
+// fd addr size -- n
+// Reads up to `size` bytes, at most LVM_IO_CHUNK at a time. n is 0 at the
+// end of the file and -1 on an error.
+Err lvm_io_read(LVM *lvm)
+{
+  if (lvm->stack_size < 3) {
+    return ERR_STACK_UNDERFLOW;
+  }
+
+  const int fd = (int) lvm->stack[lvm->stack_size - 3].as_i64;
+  const Memory_Addr addr = lvm->stack[lvm->stack_size - 2].as_u64;
+  const uint64_t size = lvm->stack[lvm->stack_size - 1].as_u64;
+  if (!lvm_memory_contains(lvm, addr, size)) {
+    return ERR_ILLEGAL_MEMORY_ACCESS;
+  }
+
+  uint8_t chunk[LVM_IO_CHUNK];
+  const size_t count = size < sizeof(chunk) ? (size_t) size : sizeof(chunk);
+  ssize_t n;
+  Err err;
+  if (lvm_io_offload(lvm, fd, false, chunk, count, &n, &err)) {
+    if (err != ERR_OK) {
+      return err;
+    }
+  } else {
+    do {
+      err = lvm_io_wait(lvm, fd, POLLIN);
+      if (err != ERR_OK) {
+        return err;
+      }
+      n = read(fd, chunk, count);
+    } while (n < 0 && (errno == EAGAIN || errno == EINTR));
+  }
+
+  if (n > 0) {
+    err = lvm_memory_write(lvm, addr, chunk, (size_t) n);
+    if (err != ERR_OK) {
+      return err;
+    }
+  }
+  lvm->stack[lvm->stack_size - 3].as_i64 = n;
+  lvm->stack_size -= 2;
+  return ERR_OK;
+}
+
+// fd addr size -- n
+// Writes up to `size` bytes, at most LVM_IO_CHUNK at a time. n is -1 on
+// an error.
+Err lvm_io_write(LVM *lvm)
+{
+  if (lvm->stack_size < 3) {
+    return ERR_STACK_UNDERFLOW;
+  }
+
+  const int fd = (int) lvm->stack[lvm->stack_size - 3].as_i64;
+  const Memory_Addr addr = lvm->stack[lvm->stack_size - 2].as_u64;
+  const uint64_t size = lvm->stack[lvm->stack_size - 1].as_u64;
+
+  uint8_t chunk[LVM_IO_CHUNK];
+  const size_t count = size < sizeof(chunk) ? (size_t) size : sizeof(chunk);
+  Err err = lvm_memory_read(lvm, addr, chunk, count);
+  if (err != ERR_OK) {
+    return err;
+  }
+
+  // what the VM printed so far has to come out first, whether the print
+  // natives went through an LVM_Output or through stdio
+  if (fd == STDOUT_FILENO || fd == STDERR_FILENO) {
+    if (lvm->output != NULL) {
+      lvm_output_flush(lvm->output);
+    } else {
+      fflush(stdout);
+    }
+  }
+
+  ssize_t n;
+  if (lvm_io_offload(lvm, fd, true, chunk, count, &n, &err)) {
+    if (err != ERR_OK) {
+      return err;
+    }
+  } else {
+    do {
+      err = lvm_io_wait(lvm, fd, POLLOUT);
+      if (err != ERR_OK) {
+        return err;
+      }
+      n = write(fd, chunk, count);
+    } while (n < 0 && (errno == EAGAIN || errno == EINTR));
+  }
+
+  lvm->stack[lvm->stack_size - 3].as_i64 = n;
+  lvm->stack_size -= 2;
+  return ERR_OK;
+}
+
+// addr --
+// Starts a new context at `addr` with a copy of the caller's stack and
+// memory.
+Err lvm_io_spawn(LVM *lvm)
+{
+  if (lvm->stack_size < 1) {
+    return ERR_STACK_UNDERFLOW;
+  }
+  if (!scheduler.running
+      || scheduler.contexts[scheduler.current].vm != lvm
+      || scheduler.contexts_size >= LVM_IO_CONTEXTS_CAPACITY) {
+    return ERR_ILLEGAL_OPERAND;
+  }
+
+  const Inst_Addr addr = lvm->stack[lvm->stack_size - 1].as_u64;
+  lvm->stack_size -= 1;
+
+  LVM *child = malloc(sizeof(LVM));
+  if (child == NULL) {
+    return ERR_ILLEGAL_OPERAND;
+  }
+  lvm_fork(child, lvm);
+  child->pc = addr;
+
+  scheduler.contexts[scheduler.contexts_size++] = (LVM_Context) {
+    .vm = child,
+    .budget = scheduler.contexts[scheduler.current].budget,
+    .wait_fd = -1,
+    .wait_events = 0,
+    .request = NULL,
+  };
+  return ERR_OK;
+}
+
+void lvm_io_register_natives(LVM_Native_Table *table)
+{
+  lvm_register_native(table, "io_open",  lvm_io_open,  3, 1);
+  lvm_register_native(table, "io_close", lvm_io_close, 1, 0);
+  lvm_register_native(table, "io_read",  lvm_io_read,  3, 1);
+  lvm_register_native(table, "io_write", lvm_io_write, 3, 1);
+  lvm_register_native(table, "spawn",    lvm_io_spawn, 1, 0);
+}
+
+// Wakes up the parked contexts whose descriptors are ready. Sleeps only if
+// no context could run otherwise.
+static void lvm_io_poll(void)
+{
+  struct pollfd fds[LVM_IO_CONTEXTS_CAPACITY];
+  size_t parked[LVM_IO_CONTEXTS_CAPACITY];
+  size_t fds_size = 0;
+  bool runnable = false;
+
+  for (size_t i = 0; i < scheduler.contexts_size; ++i) {
+    const LVM_Context *context = &scheduler.contexts[i];
+    if (context->wait_fd < 0) {
+      runnable = true;
+      continue;
+    }
+    fds[fds_size] = (struct pollfd) {.fd = context->wait_fd, .events = context->wait_events, .revents = 0};
+    parked[fds_size++] = i;
+  }
+
+  if (fds_size == 0 || poll(fds, fds_size, runnable ? 0 : -1) <= 0) {
+    return;
+  }
+  for (size_t i = 0; i < fds_size; ++i) {
+    if (fds[i].revents != 0) {
+      scheduler.contexts[parked[i]].wait_fd = -1;
+    }
+  }
+}
+
+// Runs `lvm` and everything it spawns until all of them halt or run out of
+// `limit`, charging every context the instructions it actually ran, parked
+// or not. The first error stops the whole run, and so does
+// lvm_interrupt when every context is parked.
+Err lvm_io_run(LVM *lvm, const Reg_Program *rp, int64_t limit)
+{
+  scheduler.contexts[0] = (LVM_Context) {.vm = lvm, .budget = limit, .wait_fd = -1, .wait_events = 0, .request = NULL};
+  scheduler.contexts_size = 1;
+  scheduler.running = true;
+
+  Err err = ERR_OK;
+  while (err == ERR_OK && scheduler.contexts_size > 0) {
+    lvm_io_poll();
+    if (lvm_interrupt) {
+      err = ERR_INTERRUPTED;
+      break;
+    }
+
+    for (size_t i = 0; i < scheduler.contexts_size && err == ERR_OK; ++i) {
+      LVM_Context *context = &scheduler.contexts[i];
+      if (context->wait_fd >= 0 || context->vm->halt || context->budget == 0) {
+        continue;
+      }
+
+      const int64_t slice = context->budget < 0 || context->budget > LVM_IO_SLICE ? LVM_IO_SLICE : context->budget;
+      scheduler.current = i;
+      err = rp != NULL
+        ? lvm_reg_execute_program(context->vm, rp, slice)
+        : lvm_execute_program(context->vm, slice);
+      if (context->budget > 0) {
+        const uint64_t spent = lvm_fuel_spent(context->vm);
+        context->budget = spent >= (uint64_t) context->budget ? 0 : context->budget - (int64_t) spent;
+      }
+      if (err == ERR_WOULD_BLOCK) {
+        err = ERR_OK;
+      }
+    }
+
+    if (err != ERR_OK) {
+      break;
+    }
+
+    size_t alive = 0;
+    for (size_t i = 0; i < scheduler.contexts_size; ++i) {
+      LVM_Context *context = &scheduler.contexts[i];
+      if (!context->vm->halt && context->budget != 0) {
+        scheduler.contexts[alive++] = *context;
+        continue;
+      }
+      lvm_io_finish(context);
+      if (context->vm != lvm) {
+        lvm_memory_release(context->vm);
+        free(context->vm);
+      }
+    }
+    scheduler.contexts_size = alive;
+  }
+
+  for (size_t i = 0; i < scheduler.contexts_size; ++i) {
+    lvm_io_finish(&scheduler.contexts[i]);
+    if (scheduler.contexts[i].vm != lvm) {
+      lvm_memory_release(scheduler.contexts[i].vm);
+      free(scheduler.contexts[i].vm);
+    }
+  }
+  scheduler.contexts_size = 0;
+  scheduler.running = false;
+  return err;
+}
+
+#endif
@@ -0,0 +1,321 @@
+#ifndef LVM_MEMPROF_H
+#define LVM_MEMPROF_H
+#include "./lvm.h"
+
+// Memory access profile for `lvm --memprof`.
+//
+// Every read*, write* and atomic instruction is recorded before it runs:
+// per 64-byte line of memory, split into reads and writes, and per width.
+// aadd and acas count as a read and a write. Accesses to mapped segments
+// are only counted. Natives that touch memory are not seen.
+//
+// Each instruction that accesses memory is a site. A site remembers the
+// distance between its last two addresses, the stride, and how often the
+// next access kept it. The longest run of accesses at one stride is what
+// the suggestions are about: a hot site that mostly keeps its stride is a
+// loop walking memory, and byte or halfword walks are the ones worth
+// moving to wider accesses or to a bulk native.
+//
+// The report goes to stderr: totals by width, a heat map with one row per
+// page that was touched and one column per line, the hottest sites, and
+// the suggestions.
+
+#define LVM_MEMPROF_LINE 64
+#define LVM_MEMPROF_LINES ((LVM_MEMORY_CAPACITY + LVM_MEMPROF_LINE - 1) / LVM_MEMPROF_LINE)
+#define LVM_MEMPROF_LINES_PER_PAGE (LVM_PAGE_SIZE / LVM_MEMPROF_LINE)
+#define LVM_MEMPROF_WIDTHS 4
+#define LVM_MEMPROF_SITES_SHOWN 16
+// a site makes a suggestion if it has at least this many accesses and 1%
+// of all of them, and keeps its stride at least 90% of the time
+#define LVM_MEMPROF_HOT_ACCESSES 64
+
+typedef struct {
+  Inst_Type type;
+  size_t width_log2;
+  bool read;
+  bool write;
+  uint64_t accesses;
+  Memory_Addr last;
+  int64_t stride;
+  // accesses at the same stride as the access before
+  uint64_t kept;
+  // accesses in the current and the longest run at one stride
+  uint64_t run;
+  uint64_t longest_run;
+  int64_t longest_stride;
+} LVM_Memprof_Site;
+
+typedef struct {
+  uint64_t reads[LVM_MEMPROF_LINES];
+  uint64_t writes[LVM_MEMPROF_LINES];
+  // by log2 of the width
+  uint64_t width_reads[LVM_MEMPROF_WIDTHS];
+  uint64_t width_writes[LVM_MEMPROF_WIDTHS];
+  uint64_t segment_reads;
+  uint64_t segment_writes;
+  LVM_Memprof_Site sites[LVM_PROGRAM_CAPACITY];
+} LVM_Memprof;
+
+Err lvm_memprof_execute_program(LVM *lvm, LVM_Memprof *memprof, int64_t limit);
+void lvm_memprof_report(FILE *stream, const LVM *lvm, const LVM_Memprof *memprof);
+
+// Where and how wide the access of `type` is, if it has one, given the
+// stack it is about to run on.
+static bool lvm_memprof_access(const LVM *lvm, Inst_Type type, Memory_Addr *addr,
+                               size_t *width_log2, bool *read, bool *write)
+{
+  uint64_t inputs = 0;
+  if (type >= INST_READ8 && type <= INST_READ64) {
+    inputs = 1;
+    *width_log2 = (size_t) (type - INST_READ8);
+  } else if (type >= INST_READ16BE && type <= INST_READ64BE) {
+    inputs = 1;
+    *width_log2 = (size_t) (type - INST_READ16BE) + 1;
+  } else if (type >= INST_WRITE8 && type <= INST_WRITE64) {
+    inputs = 2;
+    *width_log2 = (size_t) (type - INST_WRITE8);
+  } else if (type >= INST_WRITE16BE && type <= INST_WRITE64BE) {
+    inputs = 2;
+    *width_log2 = (size_t) (type - INST_WRITE16BE) + 1;
+  } else if (type >= INST_AREAD32 && type <= INST_ACAS64) {
+    static const uint64_t atomic_inputs[] = {1, 2, 2, 3};
+    inputs = atomic_inputs[(type - INST_AREAD32) / 2];
+    *width_log2 = (type - INST_AREAD32) % 2 ? 3 : 2;
+  } else {
+    return false;
+  }
+
+  if (lvm->stack_size < inputs) {
+    return false;
+  }
+  *addr = lvm->stack[lvm->stack_size - inputs].as_u64;
+  *read = inputs == 1 || type == INST_AADD32 || type == INST_AADD64
+    || type == INST_ACAS32 || type == INST_ACAS64;
+  *write = inputs > 1;
+  return true;
+}
+
+static void lvm_memprof_record(LVM_Memprof *memprof, Inst_Addr pc, Inst_Type type, Memory_Addr addr,
+                               size_t width_log2, bool read, bool write)
+{
+  if (addr < LVM_MEMORY_CAPACITY) {
+    memprof->reads[addr / LVM_MEMPROF_LINE] += read;
+    memprof->writes[addr / LVM_MEMPROF_LINE] += write;
+  } else {
+    memprof->segment_reads += read;
+    memprof->segment_writes += write;
+  }
+  memprof->width_reads[width_log2] += read;
+  memprof->width_writes[width_log2] += write;
+
+  LVM_Memprof_Site *site = &memprof->sites[pc];
+  const int64_t stride = (int64_t) (addr - site->last);
+  site->type = type;
+  site->width_log2 = width_log2;
+  site->read = read;
+  site->write = write;
+  if (site->accesses == 0) {
+    site->run = 1;
+  } else if (site->accesses > 1 && stride == site->stride) {
+    site->kept += 1;
+    site->run += 1;
+  } else {
+    site->stride = stride;
+    site->run = 2;
+  }
+  if (site->run > site->longest_run) {
+    site->longest_run = site->run;
+    site->longest_stride = site->stride;
+  }
+  site->last = addr;
+  site->accesses += 1;
+}
+
+// Runs on the stack interpreter, one instruction at a time.
+Err lvm_memprof_execute_program(LVM *lvm, LVM_Memprof *memprof, int64_t limit)
+{
+  while (limit != 0 && !lvm->halt) {
+    Memory_Addr addr = 0;
+    size_t width_log2 = 0;
+    bool read = false;
+    bool write = false;
+    if (lvm->pc < lvm->program_size
+        && lvm_memprof_access(lvm, lvm->program[lvm->pc].type, &addr, &width_log2, &read, &write)) {
+      lvm_memprof_record(memprof, lvm->pc, lvm->program[lvm->pc].type, addr, width_log2, read, write);
+    }
+    const Err err = lvm_execute_inst(lvm);
+    if (err != ERR_OK) {
+      return err;
+    }
+    if (limit > 0) {
+      --limit;
+    }
+  }
+
+  return ERR_OK;
+}
+
+static void lvm_memprof_location(const LVM *lvm, Inst_Addr addr, char *location, size_t location_size)
+{
+  const LVM_Symbol *symbol = lvm_find_symbol(lvm, addr);
+  if (symbol == NULL) {
+    snprintf(location, location_size, "%" PRIu64, addr);
+  } else if (symbol->addr == addr) {
+    snprintf(location, location_size, "%s", symbol->name);
+  } else {
+    snprintf(location, location_size, "%s+%" PRIu64, symbol->name, addr - symbol->addr);
+  }
+}
+
+// A site keeps its stride if at least 90% of its accesses after the second
+// one did.
+static bool lvm_memprof_regular(const LVM_Memprof_Site *site)
+{
+  return site->accesses > 2 && site->kept * 10 >= (site->accesses - 2) * 9;
+}
+
+static const LVM_Memprof *lvm_memprof_sorting = NULL;
+
+static int lvm_memprof_site_compare(const void *a, const void *b)
+{
+  const Inst_Addr x = *(const Inst_Addr *) a;
+  const Inst_Addr y = *(const Inst_Addr *) b;
+  const uint64_t ax = lvm_memprof_sorting->sites[x].accesses;
+  const uint64_t ay = lvm_memprof_sorting->sites[y].accesses;
+  if (ax != ay) {
+    return ax > ay ? -1 : 1;
+  }
+  return x < y ? -1 : x > y;
+}
+
+static char lvm_memprof_heat(uint64_t count, uint64_t hottest)
+{
+  static const char ramp[] = " .:-=+*#%@";
+  if (count == 0) {
+    return ramp[0];
+  }
+  // logarithmic, the hottest line is always '@' and any access shows
+  const double level = hottest > 1 ? log((double) count) / log((double) hottest) : 1.0;
+  return ramp[1 + (size_t) (level * (double) (sizeof(ramp) - 3) + 0.5)];
+}
+
+static void lvm_memprof_report_heat_map(FILE *stream, const LVM_Memprof *memprof)
+{
+  uint64_t hottest = 0;
+  for (size_t i = 0; i < LVM_MEMPROF_LINES; ++i) {
+    const uint64_t count = memprof->reads[i] + memprof->writes[i];
+    hottest = count > hottest ? count : hottest;
+  }
+
+  fprintf(stream, "MEMPROF: heat map, one column per %d-byte line, ` .:-=+*#%%@` from cold to the hottest (%" PRIu64 " accesses)\n",
+          LVM_MEMPROF_LINE, hottest);
+  for (size_t page = 0; page < LVM_MEMORY_PAGES; ++page) {
+    char row[LVM_MEMPROF_LINES_PER_PAGE + 1] = {0};
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    for (size_t j = 0; j < LVM_MEMPROF_LINES_PER_PAGE; ++j) {
+      const size_t line = page * LVM_MEMPROF_LINES_PER_PAGE + j;
+      const uint64_t r = line < LVM_MEMPROF_LINES ? memprof->reads[line] : 0;
+      const uint64_t w = line < LVM_MEMPROF_LINES ? memprof->writes[line] : 0;
+      reads += r;
+      writes += w;
+      row[j] = lvm_memprof_heat(r + w, hottest);
+    }
+    if (reads + writes > 0) {
+      fprintf(stream, "  0x%06zX |%s| r %-10" PRIu64 " w %" PRIu64 "\n",
+              page * LVM_PAGE_SIZE, row, reads, writes);
+    }
+  }
+}
+
+static void lvm_memprof_suggest(FILE *stream, const LVM *lvm, const LVM_Memprof_Site *site, Inst_Addr pc)
+{
+  static const char *const walks[LVM_MEMPROF_WIDTHS] = {"byte-wise", "16-bit", "32-bit", "word-wise"};
+
+  char location[LVM_SYMBOL_NAME_CAPACITY + 32];
+  lvm_memprof_location(lvm, pc, location, sizeof(location));
+  const char *name = inst_name(site->type);
+  const uint64_t width = 1ull << site->width_log2;
+  const uint64_t distance = site->longest_stride < 0
+    ? (uint64_t) -site->longest_stride
+    : (uint64_t) site->longest_stride;
+  const char *direction = site->longest_stride < 0 ? " backwards" : "";
+  const char *accesses = site->read && site->write ? "accesses" : site->write ? "writes" : "reads";
+
+  if (distance == 0) {
+    fprintf(stream, "  loop at %s does %s on one address %" PRIu64 " times in a row: keep the value on the stack\n",
+            location, name, site->longest_run);
+  } else if (distance == width) {
+    fprintf(stream, "  loop at %s does %s sequential %s%s over %" PRIu64 " bytes (%s x %" PRIu64 ")%s\n",
+            location, walks[site->width_log2], accesses, direction, site->longest_run * width,
+            name, site->accesses,
+            width < 8 ? ": move it to wider accesses or a bulk native" : ": a candidate for a bulk native");
+  } else if (distance >= LVM_MEMPROF_LINE) {
+    fprintf(stream, "  loop at %s %s with a stride of %" PRIu64 "%s (%s x %" PRIu64 "): every access is on another line\n",
+            location, accesses, distance, direction, name, site->accesses);
+  } else {
+    fprintf(stream, "  loop at %s %s %" PRIu64 " of every %" PRIu64 " bytes%s (%s x %" PRIu64 ")\n",
+            location, accesses, width, distance, direction, name, site->accesses);
+  }
+}
+
+void lvm_memprof_report(FILE *stream, const LVM *lvm, const LVM_Memprof *memprof)
+{
+  static Inst_Addr order[LVM_PROGRAM_CAPACITY];
+  size_t order_size = 0;
+  uint64_t total = 0;
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    if (memprof->sites[i].accesses > 0) {
+      order[order_size++] = i;
+      total += memprof->sites[i].accesses;
+    }
+  }
+  lvm_memprof_sorting = memprof;
+  qsort(order, order_size, sizeof(order[0]), lvm_memprof_site_compare);
+
+  uint64_t reads = 0;
+  uint64_t writes = 0;
+  for (size_t i = 0; i < LVM_MEMPROF_WIDTHS; ++i) {
+    reads += memprof->width_reads[i];
+    writes += memprof->width_writes[i];
+  }
+  fprintf(stream, "MEMPROF: %" PRIu64 " reads, %" PRIu64 " writes, %" PRIu64 " of them to mapped segments\n",
+          reads, writes, memprof->segment_reads + memprof->segment_writes);
+  fprintf(stream, "  %-8s %-14s %s\n", "width", "reads", "writes");
+  for (size_t i = 0; i < LVM_MEMPROF_WIDTHS; ++i) {
+    fprintf(stream, "  %-8" PRIu64 " %-14" PRIu64 " %" PRIu64 "\n",
+            (uint64_t) 1 << i, memprof->width_reads[i], memprof->width_writes[i]);
+  }
+  if (total == 0) {
+    return;
+  }
+
+  lvm_memprof_report_heat_map(stream, memprof);
+
+  fprintf(stream, "MEMPROF: hottest sites\n");
+  fprintf(stream, "  %-24s %-10s %-12s %-10s %s\n", "site", "inst", "accesses", "stride", "kept");
+  for (size_t i = 0; i < order_size && i < LVM_MEMPROF_SITES_SHOWN; ++i) {
+    const LVM_Memprof_Site *site = &memprof->sites[order[i]];
+    char location[LVM_SYMBOL_NAME_CAPACITY + 32];
+    lvm_memprof_location(lvm, order[i], location, sizeof(location));
+    fprintf(stream, "  %-24s %-10s %-12" PRIu64 " %-10" PRId64 " %.1f%%\n",
+            location, inst_name(site->type), site->accesses, site->longest_stride,
+            site->accesses > 2 ? 100.0 * (double) site->kept / (double) (site->accesses - 2) : 0.0);
+  }
+
+  bool suggested = false;
+  for (size_t i = 0; i < order_size; ++i) {
+    const LVM_Memprof_Site *site = &memprof->sites[order[i]];
+    if (site->accesses < LVM_MEMPROF_HOT_ACCESSES || site->accesses * 100 < total
+        || !lvm_memprof_regular(site)) {
+      continue;
+    }
+    if (!suggested) {
+      fprintf(stream, "MEMPROF: suggestions\n");
+      suggested = true;
+    }
+    lvm_memprof_suggest(stream, lvm, site, order[i]);
+  }
+}
+
+#endif
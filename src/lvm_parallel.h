@@ -0,0 +1,247 @@
+#ifndef LVM_PARALLEL_H
+#define LVM_PARALLEL_H
+#include "./lvm.h"
+#include "./lvm_reg.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+// parallel_for: runs a bytecode routine over index ranges on a pool of
+// threads.
+//
+// The routine is entered as if called with `begin end` of one chunk,
+// `begin end ret`, on the stack of a worker VM and returns with `ret`.
+// Workers are copies of the caller with their own stack. They share the
+// caller's memory and segments: before the work is handed out every page
+// of the caller is allocated and unshared, so the workers write straight
+// into the same pages and nothing is allocated or copied while they run.
+//
+// Memory accesses are plain loads and stores. Chunks that touch disjoint
+// memory give the same result in any order and on any number of threads.
+// Concurrent accesses to the same bytes, at least one of them a write,
+// race: what is read or left in memory is unspecified.
+//
+// Each worker prints into its own output buffer, written out when the
+// worker is done with the call, so the order of prints between chunks is
+// not defined. Workers run without a limit and without tracing, and any
+// other change a native makes to a worker VM is lost with it. A
+// parallel_for inside a routine runs its chunks on the calling worker.
+//
+// The heap is shared the same way: workers can read and write objects of
+// the caller, which are all made old first so that stores need no write
+// barrier, but can't allocate.
+
+#define LVM_PARALLEL_THREADS_CAPACITY 64
+
+typedef struct {
+  const LVM *parent;
+  // the engine to run on, NULL for the stack interpreter
+  const Reg_Program *rp;
+  Inst_Addr routine;
+  uint64_t end;
+  uint64_t chunk;
+  // start of the next chunk nobody took yet
+  _Atomic uint64_t next;
+} LVM_Parallel_Job;
+
+typedef struct {
+  pthread_t thread;
+  LVM vm;
+  LVM_Output output;
+} LVM_Worker;
+
+typedef struct {
+  // 0 means one per online CPU
+  size_t threads_size;
+  const Reg_Program *rp;
+
+  LVM_Worker *workers[LVM_PARALLEL_THREADS_CAPACITY];
+  size_t workers_size;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+
+  // bumping `generation` hands `job` out to every worker
+  uint64_t generation;
+  LVM_Parallel_Job *job;
+  size_t busy;
+  Err err;
+} LVM_Pool;
+
+LVM_Pool pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+static _Thread_local bool lvm_parallel_in_worker = false;
+
+Err lvm_parallel_run_chunks(LVM_Parallel_Job *job, LVM *vm, LVM_Output *output);
+Err lvm_parallel_for(LVM *lvm);
+void lvm_parallel_register_natives(LVM_Native_Table *table);
+
+// Takes chunks of `job` until there are none left or a routine fails. `vm`
+// becomes a copy of the parent, printing into `output` if both have a
+// buffer and into the parent's if only the parent does.
+Err lvm_parallel_run_chunks(LVM_Parallel_Job *job, LVM *vm, LVM_Output *output)
+{
+  memcpy(vm, job->parent, sizeof(*vm));
+  vm->trace = NULL;
+  vm->heap.borrowed = true;
+  if (job->parent->output != NULL && output != NULL) {
+    output->fd = job->parent->output->fd;
+    output->binary = job->parent->output->binary;
+    output->size = 0;
+    vm->output = output;
+  }
+
+  Err err = ERR_OK;
+  while (err == ERR_OK) {
+    const uint64_t begin = atomic_fetch_add(&job->next, job->chunk);
+    if (begin >= job->end) {
+      break;
+    }
+    const uint64_t end = job->end - begin < job->chunk ? job->end : begin + job->chunk;
+
+    // `ret` goes one past the program, where the engines stop with
+    // ERR_ILLEGAL_INST_ACCESS
+    vm->stack[0].as_u64 = begin;
+    vm->stack[1].as_u64 = end;
+    vm->stack[2].as_u64 = vm->program_size;
+    vm->stack_size = 3;
+    vm->pc = job->routine;
+    vm->halt = 0;
+    err = job->rp != NULL
+      ? lvm_reg_execute_program(vm, job->rp, -1)
+      : lvm_execute_program(vm, -1);
+    if (err == ERR_ILLEGAL_INST_ACCESS && vm->pc == vm->program_size) {
+      err = ERR_OK;
+    }
+  }
+
+  if (err != ERR_OK) {
+    // nobody needs to start another chunk
+    atomic_store(&job->next, job->end);
+  }
+  return err;
+}
+
+static void *lvm_parallel_worker(void *arg)
+{
+  LVM_Worker *worker = arg;
+  lvm_parallel_in_worker = true;
+
+  uint64_t seen = 0;
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.generation == seen) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+    }
+    seen = pool.generation;
+    LVM_Parallel_Job *job = pool.job;
+    pthread_mutex_unlock(&pool.lock);
+
+    const Err err = lvm_parallel_run_chunks(job, &worker->vm, &worker->output);
+
+    pthread_mutex_lock(&pool.lock);
+    if (worker->vm.output != NULL) {
+      lvm_output_flush(worker->vm.output);
+    }
+    if (err != ERR_OK && pool.err == ERR_OK) {
+      pool.err = err;
+    }
+    pool.busy -= 1;
+    if (pool.busy == 0) {
+      pthread_cond_signal(&pool.done);
+    }
+  }
+  return NULL;
+}
+
+static void lvm_parallel_start(void)
+{
+  if (pool.threads_size == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.threads_size = cpus > 0 ? (size_t) cpus : 1;
+  }
+  if (pool.threads_size > LVM_PARALLEL_THREADS_CAPACITY) {
+    pool.threads_size = LVM_PARALLEL_THREADS_CAPACITY;
+  }
+
+  for (size_t i = 0; i < pool.threads_size; ++i) {
+    LVM_Worker *worker = malloc(sizeof(LVM_Worker));
+    assert(worker != NULL);
+    const int error = pthread_create(&worker->thread, NULL, lvm_parallel_worker, worker);
+    if (error != 0) {
+      fprintf(stderr, "ERROR: Could not start a worker thread: %s\n", strerror(error));
+      exit(1);
+    }
+    pool.workers[pool.workers_size++] = worker;
+  }
+}
+
+// routine begin end chunk --
+Err lvm_parallel_for(LVM *lvm)
+{
+  if (lvm->stack_size < 4) {
+    return ERR_STACK_UNDERFLOW;
+  }
+
+  LVM_Parallel_Job job = {
+    .parent = lvm,
+    .rp = pool.rp,
+    .routine = lvm->stack[lvm->stack_size - 4].as_u64,
+    .end = lvm->stack[lvm->stack_size - 2].as_u64,
+    .chunk = lvm->stack[lvm->stack_size - 1].as_u64,
+  };
+  const uint64_t begin = lvm->stack[lvm->stack_size - 3].as_u64;
+  if (job.routine >= lvm->program_size || job.chunk == 0) {
+    return ERR_ILLEGAL_OPERAND;
+  }
+  atomic_init(&job.next, begin);
+  lvm->stack_size -= 4;
+  if (begin >= job.end) {
+    return ERR_OK;
+  }
+
+  for (size_t i = 0; i < LVM_MEMORY_PAGES; ++i) {
+    lvm_memory_page_for_write(lvm, i);
+  }
+  lvm_heap_promote(&lvm->heap);
+
+  if (lvm_parallel_in_worker) {
+    LVM *vm = malloc(sizeof(LVM));
+    assert(vm != NULL);
+    const Err err = lvm_parallel_run_chunks(&job, vm, NULL);
+    free(vm);
+    return err;
+  }
+
+  if (lvm->output != NULL) {
+    lvm_output_flush(lvm->output);
+  }
+
+  if (pool.workers_size == 0) {
+    lvm_parallel_start();
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.job = &job;
+  pool.busy = pool.workers_size;
+  pool.err = ERR_OK;
+  pool.generation += 1;
+  pthread_cond_broadcast(&pool.work);
+  while (pool.busy > 0) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+  const Err err = pool.err;
+  pthread_mutex_unlock(&pool.lock);
+
+  return err;
+}
+
+void lvm_parallel_register_natives(LVM_Native_Table *table)
+{
+  lvm_register_native(table, "parallel_for", lvm_parallel_for, 4, 0);
+}
+
+#endif
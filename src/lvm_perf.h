@@ -0,0 +1,335 @@
+#ifndef LVM_PERF_H
+#define LVM_PERF_H
+#include "./lvm.h"
+#include "./lvm_reg.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters for `lvm --perf`.
+//
+// Counters are opened with perf_event_open for the whole run and sampled
+// by the region_begin/region_end natives, which take a region id from the
+// stack and may nest. Any counter the kernel refuses (no PMU, a VM, a
+// restrictive perf_event_paranoid) is reported as n/a. The program runs
+// in the same run loops as without --perf, with fuel on, and the number of
+// VM instructions is read from the fuel counter.
+
+#define PERF_REGIONS_CAPACITY 64
+#define PERF_REGIONS_DEPTH 64
+
+typedef enum {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_TASK_CLOCK,
+  PERF_COUNTERS,
+} Perf_Counter;
+
+typedef struct {
+  uint64_t values[PERF_COUNTERS];
+  uint64_t vm_insts;
+} Perf_Sample;
+
+typedef struct {
+  uint64_t id;
+  uint64_t entries;
+  Perf_Sample total;
+} Perf_Region;
+
+typedef struct {
+  int fds[PERF_COUNTERS];
+  // instructions lvm_quicken replaced before the run
+  size_t quickened;
+
+  Perf_Region regions[PERF_REGIONS_CAPACITY];
+  size_t regions_size;
+  uint64_t open_ids[PERF_REGIONS_DEPTH];
+  Perf_Sample open_samples[PERF_REGIONS_DEPTH];
+  size_t open_size;
+} Perf;
+
+Perf perf = {0};
+
+const char *perf_counter_name(Perf_Counter counter);
+void perf_open(Perf *p);
+void perf_close(Perf *p);
+Perf_Sample perf_sample(const Perf *p, const LVM *lvm);
+void perf_report(FILE *stream, const Perf *p, const Perf_Sample *sample);
+Err perf_region_begin(LVM *lvm);
+Err perf_region_end(LVM *lvm);
+void perf_register_natives(LVM_Native_Table *table);
+Err lvm_perf_execute_program(LVM *lvm, const Reg_Program *rp, int64_t limit);
+
+const char *perf_counter_name(Perf_Counter counter)
+{
+  switch (counter) {
+  case PERF_CYCLES:        return "cycles";
+  case PERF_INSTRUCTIONS:  return "instructions";
+  case PERF_BRANCH_MISSES: return "branch-misses";
+  case PERF_L1D_MISSES:    return "L1d read misses";
+  case PERF_LLC_MISSES:    return "LLC misses";
+  case PERF_TASK_CLOCK:    return "task-clock ns";
+  case PERF_COUNTERS:
+  default:
+    assert(false && "perf_counter_name: unreachable");
+    return NULL;
+  }
+}
+
+#ifdef __linux__
+static int perf_open_counter(Perf_Counter counter)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  switch (counter) {
+  case PERF_CYCLES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case PERF_INSTRUCTIONS:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case PERF_BRANCH_MISSES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+    break;
+  case PERF_L1D_MISSES:
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_L1D
+      | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+      | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  case PERF_LLC_MISSES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    break;
+  case PERF_TASK_CLOCK:
+    // a software counter, usually there even when the PMU is not
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    break;
+  case PERF_COUNTERS:
+  default:
+    assert(false && "perf_open_counter: unreachable");
+  }
+
+  return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+void perf_open(Perf *p)
+{
+  int opened = 0;
+  int error = ENOSYS;
+  for (Perf_Counter c = 0; c < PERF_COUNTERS; ++c) {
+#ifdef __linux__
+    p->fds[c] = perf_open_counter(c);
+    if (p->fds[c] < 0) {
+      error = errno;
+    }
+#else
+    p->fds[c] = -1;
+#endif
+    if (p->fds[c] >= 0) {
+      opened += 1;
+    }
+  }
+
+  if (opened == 0) {
+    fprintf(stderr, "INFO: performance counters are not available (%s), only VM instructions are counted\n",
+            strerror(error));
+    return;
+  }
+  if (opened < PERF_COUNTERS) {
+    fprintf(stderr, "INFO: some performance counters are not available (%s)\n", strerror(error));
+  }
+
+#ifdef __linux__
+  for (Perf_Counter c = 0; c < PERF_COUNTERS; ++c) {
+    if (p->fds[c] >= 0) {
+      ioctl(p->fds[c], PERF_EVENT_IOC_RESET, 0);
+      ioctl(p->fds[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#endif
+}
+
+void perf_close(Perf *p)
+{
+  for (Perf_Counter c = 0; c < PERF_COUNTERS; ++c) {
+#ifdef __linux__
+    if (p->fds[c] >= 0) {
+      close(p->fds[c]);
+    }
+#endif
+    p->fds[c] = -1;
+  }
+}
+
+// Counter values so far, scaled up when the kernel had to multiplex them.
+Perf_Sample perf_sample(const Perf *p, const LVM *lvm)
+{
+  Perf_Sample sample = {0};
+  sample.vm_insts = lvm_fuel_spent(lvm);
+#ifdef __linux__
+  for (Perf_Counter c = 0; c < PERF_COUNTERS; ++c) {
+    uint64_t data[3] = {0};
+    if (p->fds[c] < 0 || read(p->fds[c], data, sizeof(data)) != (ssize_t) sizeof(data)) {
+      continue;
+    }
+    sample.values[c] = data[2] > 0 && data[2] < data[1]
+      ? (uint64_t) ((double) data[0] * (double) data[1] / (double) data[2])
+      : data[0];
+  }
+#endif
+  return sample;
+}
+
+void perf_report(FILE *stream, const Perf *p, const Perf_Sample *sample)
+{
+  for (Perf_Counter c = 0; c < PERF_COUNTERS; ++c) {
+    if (p->fds[c] >= 0) {
+      fprintf(stream, "  %-26s %" PRIu64 "\n", perf_counter_name(c), sample->values[c]);
+    } else {
+      fprintf(stream, "  %-26s n/a\n", perf_counter_name(c));
+    }
+  }
+
+  fprintf(stream, "  %-26s %" PRIu64 "\n", "VM instructions", sample->vm_insts);
+  if (p->fds[PERF_INSTRUCTIONS] >= 0 && sample->vm_insts > 0) {
+    fprintf(stream, "  %-26s %.2f\n", "host instructions/VM inst",
+            (double) sample->values[PERF_INSTRUCTIONS] / (double) sample->vm_insts);
+  }
+  if (p->fds[PERF_CYCLES] >= 0 && sample->vm_insts > 0) {
+    fprintf(stream, "  %-26s %.2f\n", "cycles/VM inst",
+            (double) sample->values[PERF_CYCLES] / (double) sample->vm_insts);
+  }
+  if (p->fds[PERF_TASK_CLOCK] >= 0 && sample->vm_insts > 0) {
+    fprintf(stream, "  %-26s %.2f\n", "ns/VM inst",
+            (double) sample->values[PERF_TASK_CLOCK] / (double) sample->vm_insts);
+  }
+}
+
+Err perf_region_begin(LVM *lvm)
+{
+  if (lvm->stack_size < 1) {
+    return ERR_STACK_UNDERFLOW;
+  }
+  if (perf.open_size >= PERF_REGIONS_DEPTH) {
+    return ERR_STACK_OVERFLOW;
+  }
+
+  perf.open_ids[perf.open_size] = lvm->stack[lvm->stack_size - 1].as_u64;
+  perf.open_samples[perf.open_size] = perf_sample(&perf, lvm);
+  perf.open_size += 1;
+  lvm->stack_size -= 1;
+  return ERR_OK;
+}
+
+Err perf_region_end(LVM *lvm)
+{
+  const Perf_Sample end = perf_sample(&perf, lvm);
+  if (lvm->stack_size < 1) {
+    return ERR_STACK_UNDERFLOW;
+  }
+
+  const uint64_t id = lvm->stack[lvm->stack_size - 1].as_u64;
+  if (perf.open_size == 0 || perf.open_ids[perf.open_size - 1] != id) {
+    return ERR_ILLEGAL_OPERAND;
+  }
+
+  Perf_Region *region = NULL;
+  for (size_t i = 0; i < perf.regions_size && region == NULL; ++i) {
+    if (perf.regions[i].id == id) {
+      region = &perf.regions[i];
+    }
+  }
+  if (region == NULL) {
+    if (perf.regions_size >= PERF_REGIONS_CAPACITY) {
+      return ERR_ILLEGAL_OPERAND;
+    }
+    region = &perf.regions[perf.regions_size++];
+    region->id = id;
+  }
+
+  const Perf_Sample *start = &perf.open_samples[--perf.open_size];
+  for (Perf_Counter c = 0; c < PERF_COUNTERS; ++c) {
+    region->total.values[c] += end.values[c] - start->values[c];
+  }
+  region->total.vm_insts += end.vm_insts - start->vm_insts;
+  region->entries += 1;
+
+  lvm->stack_size -= 1;
+  return ERR_OK;
+}
+
+void perf_register_natives(LVM_Native_Table *table)
+{
+  lvm_register_native(table, "region_begin", perf_region_begin, 1, 0);
+  lvm_register_native(table, "region_end",   perf_region_end,   1, 0);
+}
+
+// Runs the program with the counters enabled and reports to stderr. Fuel
+// is always on, with a limit nothing reaches when there is none, so both
+// engines count VM instructions block by block.
+Err lvm_perf_execute_program(LVM *lvm, const Reg_Program *rp, int64_t limit)
+{
+  if (limit < 0) {
+    limit = INT64_MAX;
+  }
+  lvm_fuel_begin(lvm, 0);
+  perf_open(&perf);
+
+  const Perf_Sample start = perf_sample(&perf, lvm);
+  const Err err = rp != NULL
+    ? lvm_reg_execute_program(lvm, rp, limit)
+    : lvm_execute_program(lvm, limit);
+  Perf_Sample total = perf_sample(&perf, lvm);
+
+  for (Perf_Counter c = 0; c < PERF_COUNTERS; ++c) {
+    total.values[c] -= start.values[c];
+  }
+  total.vm_insts -= start.vm_insts;
+
+  if (lvm->output != NULL) {
+    lvm_output_flush(lvm->output);
+  }
+  fprintf(stderr, "PERF: whole run\n");
+  perf_report(stderr, &perf, &total);
+  if (rp == NULL) {
+    fprintf(stderr, "  %-26s %zu of %zu\n", "quickened at load", perf.quickened, lvm->program_size);
+  }
+  if (lvm->heap.allocated > 0) {
+    fprintf(stderr, "  %-26s %" PRIu64 " bytes, %" PRIu64 " live\n", "heap allocated",
+            lvm->heap.allocated, lvm->heap.size);
+    fprintf(stderr, "  %-26s %" PRIu64 " minor, %" PRIu64 " major\n", "heap collections",
+            lvm->heap.minor_collections, lvm->heap.major_collections);
+  }
+  for (size_t i = 0; i < perf.regions_size; ++i) {
+    fprintf(stderr, "PERF: region %" PRIu64 ", entered %" PRIu64 " times\n",
+            perf.regions[i].id, perf.regions[i].entries);
+    perf_report(stderr, &perf, &perf.regions[i].total);
+  }
+  if (perf.open_size > 0) {
+    fprintf(stderr, "WARNING: %zu region(s) were never closed\n", perf.open_size);
+  }
+
+  perf_close(&perf);
+  return err;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef LVM_PLUGIN_H
+#define LVM_PLUGIN_H
+#include <assert.h>
+#include <stdint.h>
+
+// The only header a native plugin needs. Everything here is part of the
+// plugin ABI: new fields and error codes may only be appended, and any
+// incompatible change has to bump LVM_PLUGIN_ABI_VERSION.
+//
+// A plugin is a shared object exporting a `const LVM_Plugin lvm_plugin`:
+//
+//   static Err my_sqrt(Word *args) { args[0].as_f64 = sqrt(args[0].as_f64); return ERR_OK; }
+//   static const LVM_Plugin_Def defs[] = { {"sqrt", my_sqrt, 1, 1} };
+//   const LVM_Plugin lvm_plugin = { LVM_PLUGIN_ABI_VERSION, 1, defs };
+
+#define LVM_PLUGIN_ABI_VERSION 1
+#define LVM_PLUGIN_SYMBOL "lvm_plugin"
+
+typedef union {
+    uint64_t as_u64;
+    int64_t as_i64;
+    double as_f64;
+    void *as_ptr;
+} Word;
+
+static_assert(sizeof(Word) == 8,
+              "The LVM's Word is expected to be 64 bits");
+
+typedef enum {
+  ERR_OK = 0,
+  ERR_STACK_OVERFLOW,
+  ERR_STACK_UNDERFLOW,
+  ERR_ILLEGAL_INST,
+  ERR_ILLEGAL_INST_ACCESS,
+  ERR_ILLEGAL_OPERAND,
+  ERR_ILLEGAL_MEMORY_ACCESS,
+  ERR_DIV_BY_ZERO,
+  // The native can't finish without waiting. Under the scheduler the VM is
+  // parked and the native runs again later, elsewhere it is an error.
+  ERR_WOULD_BLOCK,
+  // The VM ran out of fuel, or lvm_interrupt was set. Both only stop a VM
+  // right after a back-edge or a call, which has already been taken, so
+  // running it again simply goes on.
+  ERR_OUT_OF_FUEL,
+  ERR_INTERRUPTED,
+  ERR_OUT_OF_HEAP,
+} Err;
+
+// `args` points at the deepest of the `inputs` words the native consumes.
+// The native leaves its `outputs` results starting at the same address.
+// Stack bounds are checked by the VM before the call.
+typedef Err (*LVM_Plugin_Native)(Word *args);
+
+typedef struct {
+  const char *name;
+  LVM_Plugin_Native native;
+  uint8_t inputs;
+  uint8_t outputs;
+} LVM_Plugin_Def;
+
+typedef struct {
+  uint32_t abi_version;
+  uint32_t natives_size;
+  const LVM_Plugin_Def *natives;
+} LVM_Plugin;
+
+#endif
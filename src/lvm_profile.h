@@ -0,0 +1,436 @@
+#ifndef LVM_PROFILE_H
+#define LVM_PROFILE_H
+#include "./lvm.h"
+
+// Block profiles and profile-guided code layout.
+//
+// `lvm --profile <file>` counts how many times every instruction runs and
+// writes one `<label> <count>` line per code label: how many times the
+// block starting at that label was entered.
+//
+// `lasm --profile <file>` reads such a file back and lays the program out
+// by blocks, a block being the code from one label up to the next. Blocks
+// that pass control to each other most often are placed one after another,
+// so the hot path falls through: the jmp at the end of a block is dropped
+// when its target follows it, and a signed or unsigned compare-and-jump is
+// negated when the block it jumps to ran more often than the one after it.
+// The block at address 0 stays first, blocks that never ran move to the end
+// in source order, and a jmp is added wherever a block that used to fall
+// through no longer sits in front of its successor.
+//
+// Like lopt, the layout assumes code addresses only come from labels, from
+// jump and call operands and from call's return address. Programs that
+// compute code addresses by other means are not supported.
+
+#define LASM_PROFILE_CAPACITY LVM_SYMBOLS_CAPACITY
+#define LASM_NO_BLOCK ((size_t) -1)
+
+typedef struct {
+  uint64_t counts[LVM_PROGRAM_CAPACITY];
+} LVM_Profile;
+
+typedef struct {
+  String_View label;
+  uint64_t count;
+} Lasm_Profile_Entry;
+
+typedef struct {
+  Lasm_Profile_Entry entries[LASM_PROFILE_CAPACITY];
+  size_t entries_size;
+} Lasm_Profile;
+
+typedef enum {
+  LASM_EDGE_FALLTHROUGH = 0,
+  // the jmp ending the block goes away
+  LASM_EDGE_JUMP,
+  // the compare-and-jump ending the block is negated
+  LASM_EDGE_BRANCH,
+} Lasm_Edge_Kind;
+
+typedef struct {
+  size_t from;
+  size_t to;
+  uint64_t weight;
+  Lasm_Edge_Kind kind;
+} Lasm_Edge;
+
+typedef struct {
+  Inst_Addr begin;
+  Inst_Addr end;
+  uint64_t count;
+  // neighbours in the layout
+  size_t prev;
+  size_t next;
+  Lasm_Edge_Kind glued_by;
+} Lasm_Block;
+
+typedef struct {
+  Lasm_Block blocks[LVM_PROGRAM_CAPACITY];
+  size_t blocks_size;
+  size_t block_at[LVM_PROGRAM_CAPACITY];
+  Lasm_Edge edges[2 * LVM_PROGRAM_CAPACITY];
+  size_t edges_size;
+  size_t order[LVM_PROGRAM_CAPACITY];
+  uint64_t chain_weight[LVM_PROGRAM_CAPACITY];
+
+  bool code_operand[LVM_PROGRAM_CAPACITY];
+  Inst program[LVM_PROGRAM_CAPACITY];
+  bool program_code_operand[LVM_PROGRAM_CAPACITY];
+  size_t program_size;
+  Inst_Addr new_addr[LVM_PROGRAM_CAPACITY + 1];
+} Lasm_Layout;
+
+Err lvm_profile_execute_program(LVM *lvm, LVM_Profile *profile, int64_t limit);
+void lvm_profile_save(const LVM *lvm, const LVM_Profile *profile, const char *file_path);
+void lasm_profile_load(Lasm *lt, Lasm_Profile *profile, const char *file_path);
+void lasm_layout(LVM *lvm, const Lasm *lt, const Lasm_Profile *profile);
+
+// Runs on the profiling variant of the stack interpreter.
+Err lvm_profile_execute_program(LVM *lvm, LVM_Profile *profile, int64_t limit)
+{
+  return lvm_execute_program_counted(lvm, limit, profile->counts);
+}
+
+void lvm_profile_save(const LVM *lvm, const LVM_Profile *profile, const char *file_path)
+{
+  FILE *f = fopen(file_path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not open file `%s`: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+
+  for (size_t i = 0; i < lvm->symbols_size; ++i) {
+    const LVM_Symbol *symbol = &lvm->symbols[i];
+    const uint64_t count = symbol->addr < lvm->program_size ? profile->counts[symbol->addr] : 0;
+    fprintf(f, "%s %" PRIu64 "\n", symbol->name, count);
+  }
+
+  if (ferror(f)) {
+    fprintf(stderr, "ERROR: Could not write to file `%s`: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+  fclose(f);
+}
+
+void lasm_profile_load(Lasm *lt, Lasm_Profile *profile, const char *file_path)
+{
+  String_View source = slurp_file(lt, cstr_as_sv(file_path));
+  int line_number = 0;
+
+  while (source.count > 0) {
+    String_View line = sv_trim(sv_chop_by_delim(&source, '\n'));
+    line_number += 1;
+    if (line.count == 0) {
+      continue;
+    }
+
+    const String_View label = sv_chop_by_delim(&line, ' ');
+    const String_View value = sv_trim(line);
+    Word count = {0};
+    if (value.count == 0 || !lasm_number_literal_as_word(lt, value, &count)) {
+      fprintf(stderr, "%s:%d: ERROR: expected `<label> <count>`\n", file_path, line_number);
+      exit(1);
+    }
+    if (profile->entries_size >= LASM_PROFILE_CAPACITY) {
+      fprintf(stderr, "%s:%d: ERROR: too many labels, the capacity is %d\n",
+              file_path, line_number, LASM_PROFILE_CAPACITY);
+      exit(1);
+    }
+    profile->entries[profile->entries_size++] = (Lasm_Profile_Entry) {.label = label, .count = count.as_u64};
+  }
+}
+
+static Lasm_Layout layout = {0};
+
+// The jump taking the other branch. Float compares are not negated since
+// `!(a < b)` is not `a >= b` once NaNs are involved.
+static bool lasm_negate_cond_jump(Inst_Type type, Inst_Type *output)
+{
+  static const Inst_Type pairs[][2] = {
+    {INST_JEQ,  INST_JNE},
+    {INST_JLTI, INST_JGEI},
+    {INST_JLEI, INST_JGTI},
+    {INST_JLTU, INST_JGEU},
+    {INST_JLEU, INST_JGTU},
+  };
+
+  for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); ++i) {
+    if (pairs[i][0] == type || pairs[i][1] == type) {
+      *output = pairs[i][0] == type ? pairs[i][1] : pairs[i][0];
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t lasm_profile_count(const Lasm_Profile *profile, const char *label)
+{
+  const String_View name = cstr_as_sv(label);
+  for (size_t i = 0; i < profile->entries_size; ++i) {
+    if (sv_eq(profile->entries[i].label, name)) {
+      return profile->entries[i].count;
+    }
+  }
+  return 0;
+}
+
+static void lasm_layout_push_edge(size_t from, size_t to, Lasm_Edge_Kind kind)
+{
+  const Lasm_Block *a = &layout.blocks[from];
+  const Lasm_Block *b = &layout.blocks[to];
+  layout.edges[layout.edges_size++] = (Lasm_Edge) {
+    .from = from,
+    .to = to,
+    .weight = a->count < b->count ? a->count : b->count,
+    .kind = kind,
+  };
+}
+
+// Heaviest first, a fallthrough before a change of the code on a tie, then
+// in source order.
+static int lasm_edge_compare(const void *a, const void *b)
+{
+  const Lasm_Edge *x = a;
+  const Lasm_Edge *y = b;
+  if (x->weight != y->weight) {
+    return x->weight > y->weight ? -1 : 1;
+  }
+  if (x->kind != y->kind) {
+    return x->kind < y->kind ? -1 : 1;
+  }
+  return x->from < y->from ? -1 : x->from > y->from;
+}
+
+static int lasm_chain_compare(const void *a, const void *b)
+{
+  const size_t x = *(const size_t *) a;
+  const size_t y = *(const size_t *) b;
+  if (layout.chain_weight[x] != layout.chain_weight[y]) {
+    return layout.chain_weight[x] > layout.chain_weight[y] ? -1 : 1;
+  }
+  return x < y ? -1 : x > y;
+}
+
+static void lasm_layout_find_blocks(const LVM *lvm, const Lasm_Profile *profile)
+{
+  static bool leader[LVM_PROGRAM_CAPACITY];
+  memset(leader, 0, sizeof(leader));
+  leader[0] = true;
+  for (size_t i = 0; i < lvm->symbols_size; ++i) {
+    if (lvm->symbols[i].addr < lvm->program_size) {
+      leader[lvm->symbols[i].addr] = true;
+    }
+  }
+
+  layout.blocks_size = 0;
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    if (leader[i]) {
+      layout.blocks[layout.blocks_size++] = (Lasm_Block) {
+        .begin = i,
+        .count = 0,
+        .prev = LASM_NO_BLOCK,
+        .next = LASM_NO_BLOCK,
+      };
+    }
+    layout.blocks[layout.blocks_size - 1].end = i + 1;
+    layout.block_at[i] = leader[i] ? layout.blocks_size - 1 : LASM_NO_BLOCK;
+  }
+
+  for (size_t i = 0; i < lvm->symbols_size; ++i) {
+    const LVM_Symbol *symbol = &lvm->symbols[i];
+    if (symbol->addr < lvm->program_size) {
+      Lasm_Block *block = &layout.blocks[layout.block_at[symbol->addr]];
+      const uint64_t count = lasm_profile_count(profile, symbol->name);
+      if (count > block->count) {
+        block->count = count;
+      }
+    }
+  }
+  // the entry always runs
+  if (layout.blocks[0].count == 0) {
+    layout.blocks[0].count = 1;
+  }
+}
+
+// Blocks ending in a jump to an unlabeled address are never glued to it.
+static size_t lasm_layout_block_of(const LVM *lvm, Word operand)
+{
+  return operand.as_u64 < lvm->program_size ? layout.block_at[operand.as_u64] : LASM_NO_BLOCK;
+}
+
+static void lasm_layout_find_edges(const LVM *lvm)
+{
+  layout.edges_size = 0;
+  for (size_t i = 0; i < layout.blocks_size; ++i) {
+    const Lasm_Block *block = &layout.blocks[i];
+    const Inst last = lvm->program[block->end - 1];
+    const size_t target = lasm_layout_block_of(lvm, last.operand);
+    Inst_Type negated = INST_NOP;
+
+    if (last.type == INST_JMP) {
+      if (target != LASM_NO_BLOCK && target != i && target != 0 && block->count > 0) {
+        lasm_layout_push_edge(i, target, LASM_EDGE_JUMP);
+      }
+    } else if (last.type != INST_RET && last.type != INST_HALT && i + 1 < layout.blocks_size) {
+      const Lasm_Block *succ = &layout.blocks[i + 1];
+      // a block that ran keeps its successor only if that ran as well, the
+      // rest is split off to the end
+      if (block->count == 0 || succ->count > 0) {
+        lasm_layout_push_edge(i, i + 1, LASM_EDGE_FALLTHROUGH);
+      }
+      if (lasm_negate_cond_jump(last.type, &negated)
+          && target != LASM_NO_BLOCK && target != i && target != i + 1 && target != 0
+          && layout.blocks[target].count > succ->count && block->count > 0) {
+        lasm_layout_push_edge(i, target, LASM_EDGE_BRANCH);
+      }
+    }
+  }
+}
+
+static void lasm_layout_glue(void)
+{
+  qsort(layout.edges, layout.edges_size, sizeof(layout.edges[0]), lasm_edge_compare);
+  for (size_t i = 0; i < layout.edges_size; ++i) {
+    const Lasm_Edge *edge = &layout.edges[i];
+    Lasm_Block *from = &layout.blocks[edge->from];
+    Lasm_Block *to = &layout.blocks[edge->to];
+    if (from->next != LASM_NO_BLOCK || to->prev != LASM_NO_BLOCK) {
+      continue;
+    }
+
+    // `from` ends its chain, so it is in the chain of `to` only if that
+    // chain ends with it
+    size_t tail = edge->to;
+    while (layout.blocks[tail].next != LASM_NO_BLOCK) {
+      tail = layout.blocks[tail].next;
+    }
+    if (tail == edge->from) {
+      continue;
+    }
+
+    from->next = edge->to;
+    from->glued_by = edge->kind;
+    to->prev = edge->from;
+  }
+}
+
+// Chains go out heaviest first with the entry in front of everything.
+static void lasm_layout_order(void)
+{
+  static size_t heads[LVM_PROGRAM_CAPACITY];
+  size_t heads_size = 0;
+  for (size_t i = 1; i < layout.blocks_size; ++i) {
+    if (layout.blocks[i].prev != LASM_NO_BLOCK) {
+      continue;
+    }
+    layout.chain_weight[i] = 0;
+    for (size_t j = i; j != LASM_NO_BLOCK; j = layout.blocks[j].next) {
+      if (layout.blocks[j].count > layout.chain_weight[i]) {
+        layout.chain_weight[i] = layout.blocks[j].count;
+      }
+    }
+    heads[heads_size++] = i;
+  }
+  qsort(heads, heads_size, sizeof(heads[0]), lasm_chain_compare);
+
+  size_t order_size = 0;
+  for (size_t j = 0; j != LASM_NO_BLOCK; j = layout.blocks[j].next) {
+    layout.order[order_size++] = j;
+  }
+  for (size_t i = 0; i < heads_size; ++i) {
+    for (size_t j = heads[i]; j != LASM_NO_BLOCK; j = layout.blocks[j].next) {
+      layout.order[order_size++] = j;
+    }
+  }
+  assert(order_size == layout.blocks_size);
+}
+
+static void lasm_layout_emit(Inst inst, bool code_operand)
+{
+  if (layout.program_size >= LVM_PROGRAM_CAPACITY) {
+    fprintf(stderr, "ERROR: the program does not fit into %d instructions once laid out\n",
+            LVM_PROGRAM_CAPACITY);
+    exit(1);
+  }
+  layout.program_code_operand[layout.program_size] = code_operand;
+  layout.program[layout.program_size++] = inst;
+}
+
+void lasm_layout(LVM *lvm, const Lasm *lt, const Lasm_Profile *profile)
+{
+  if (lvm->program_size == 0) {
+    return;
+  }
+
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    layout.code_operand[i] = inst_is_jump(lvm->program[i].type);
+  }
+  for (size_t i = 0; i < lt->defered_operands_size; ++i) {
+    if (lasm_label_is_code(lt, lt->defered_operands[i].label)) {
+      layout.code_operand[lt->defered_operands[i].addr] = true;
+    }
+  }
+
+  lasm_layout_find_blocks(lvm, profile);
+  lasm_layout_find_edges(lvm);
+  lasm_layout_glue();
+  lasm_layout_order();
+
+  layout.program_size = 0;
+  for (size_t k = 0; k < layout.blocks_size; ++k) {
+    const Lasm_Block *block = &layout.blocks[layout.order[k]];
+    const bool glued = block->next != LASM_NO_BLOCK;
+    Inst last = lvm->program[block->end - 1];
+
+    for (Inst_Addr i = block->begin; i + 1 < block->end; ++i) {
+      layout.new_addr[i] = layout.program_size;
+      lasm_layout_emit(lvm->program[i], layout.code_operand[i]);
+    }
+
+    // where the block goes on after its last instruction, if anywhere
+    Inst_Addr succ = block->end;
+    layout.new_addr[block->end - 1] = layout.program_size;
+    if (glued && block->glued_by == LASM_EDGE_JUMP) {
+      continue;
+    }
+    if (glued && block->glued_by == LASM_EDGE_BRANCH) {
+      succ = last.operand.as_u64;
+      lasm_negate_cond_jump(last.type, &last.type);
+      last.operand.as_u64 = block->end;
+    }
+    lasm_layout_emit(last, layout.code_operand[block->end - 1]);
+
+    const bool falls_through = last.type != INST_JMP && last.type != INST_RET && last.type != INST_HALT;
+    const bool last_one = k + 1 == layout.blocks_size;
+    if (falls_through && !(last_one && succ == lvm->program_size)
+        && (last_one || layout.blocks[layout.order[k + 1]].begin != succ)) {
+      lasm_layout_emit((Inst) {.type = INST_JMP, .operand = {.as_u64 = succ}}, true);
+    }
+  }
+  layout.new_addr[lvm->program_size] = layout.program_size;
+
+  for (size_t i = 0; i < layout.program_size; ++i) {
+    Inst *inst = &layout.program[i];
+    if (layout.program_code_operand[i] && inst->operand.as_u64 <= lvm->program_size) {
+      inst->operand.as_u64 = layout.new_addr[inst->operand.as_u64];
+    }
+  }
+  for (size_t i = 0; i < lt->code_words_size; ++i) {
+    Word word = {0};
+    lvm_memory_read(lvm, lt->code_words[i], &word, sizeof(word));
+    if (word.as_u64 <= lvm->program_size) {
+      word.as_u64 = layout.new_addr[word.as_u64];
+      lvm_memory_write(lvm, lt->code_words[i], &word, sizeof(word));
+    }
+  }
+  for (size_t i = 0; i < lvm->symbols_size; ++i) {
+    if (lvm->symbols[i].addr <= lvm->program_size) {
+      lvm->symbols[i].addr = layout.new_addr[lvm->symbols[i].addr];
+    }
+  }
+
+  memcpy(lvm->program, layout.program, sizeof(layout.program[0]) * layout.program_size);
+  lvm->program_size = layout.program_size;
+}
+
+#endif
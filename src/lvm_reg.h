@@ -0,0 +1,1000 @@
+#ifndef LVM_REG_H
+#define LVM_REG_H
+#include "./lvm.h"
+
+// Register engine.
+//
+// The stack bytecode is translated block by block into three-address code
+// over virtual registers. A register is a stack slot addressed relative to
+// the stack size at block entry (the frame), so `fp[-1]` is the top of the
+// stack the block started with. While translating, the operand stack is
+// tracked symbolically: push, dup, swap and drop only shuffle the symbolic
+// stack, constants are folded or turned into immediate operands, and the
+// real stack is brought up to date (flushed) once at the end of the block.
+//
+// Stack bounds are checked once per block on entry. Whenever that check
+// fails, or the pc is not at the start of a translated block, the engine
+// falls back to lvm_execute_inst, so errors are reported exactly like the
+// stack interpreter does. An op that fails in the middle of a block writes
+// the symbolic stack back as it was before its instruction, so the error
+// leaves the same stack too. Natives, print_debug and anything else that needs
+// the real stack end a block and are executed with lvm_execute_inst.
+
+#define REG_OPS_CAPACITY (LVM_PROGRAM_CAPACITY * 8)
+#define REG_NO_BLOCK -1
+
+// Binary ops come in pairs: the register-register form followed by the
+// register-immediate form, so `type + 1` is the immediate version.
+typedef enum {
+  REG_MOV = 0,
+  REG_MOVK,
+  REG_PLUSI,  REG_PLUSI_K,
+  REG_MINUSI, REG_MINUSI_K,
+  REG_MULTI,  REG_MULTI_K,
+  REG_DIVI,   REG_DIVI_K,
+  REG_PLUSF,  REG_PLUSF_K,
+  REG_MINUSF, REG_MINUSF_K,
+  REG_MULTF,  REG_MULTF_K,
+  REG_DIVF,   REG_DIVF_K,
+  REG_EQ,     REG_EQ_K,
+  REG_NE,     REG_NE_K,
+  REG_LTI,    REG_LTI_K,
+  REG_LEI,    REG_LEI_K,
+  REG_GTI,    REG_GTI_K,
+  REG_GEI,    REG_GEI_K,
+  REG_LTU,    REG_LTU_K,
+  REG_LEU,    REG_LEU_K,
+  REG_GTU,    REG_GTU_K,
+  REG_GEU,    REG_GEU_K,
+  REG_EQF,    REG_EQF_K,
+  REG_NEF,    REG_NEF_K,
+  REG_LTF,    REG_LTF_K,
+  REG_LEF,    REG_LEF_K,
+  REG_GTF,    REG_GTF_K,
+  REG_GEF,    REG_GEF_K,
+  REG_ANDB,   REG_ANDB_K,
+  REG_ORB,    REG_ORB_K,
+  REG_XOR,    REG_XOR_K,
+  REG_SHR,    REG_SHR_K,
+  REG_SHL,    REG_SHL_K,
+  REG_NOT,
+  REG_NOTB,
+  REG_I2F,
+  REG_U2F,
+  REG_F2I,
+  REG_F2U,
+  REG_FMAF,
+  REG_READ8,
+  REG_READ16,
+  REG_READ32,
+  REG_READ64,
+  REG_WRITE8,
+  REG_WRITE16,
+  REG_WRITE32,
+  REG_WRITE64,
+  REG_READ16BE,
+  REG_READ32BE,
+  REG_READ64BE,
+  REG_WRITE16BE,
+  REG_WRITE32BE,
+  REG_WRITE64BE,
+} Reg_Op_Type;
+
+// dst = a op b (or a op k). Slots are relative to the block's frame.
+// fmaf has a third operand and keeps its slot in `k`.
+// `addr` is the bytecode instruction the op came from, for errors.
+typedef struct {
+  Reg_Op_Type type;
+  int32_t dst;
+  int32_t a;
+  int32_t b;
+  Word k;
+  Inst_Addr addr;
+} Reg_Op;
+
+typedef enum {
+  REG_TERM_FALL = 0,
+  REG_TERM_JMP,
+  REG_TERM_JMP_IF,
+  REG_TERM_RET,
+  REG_TERM_HALT,
+  REG_TERM_STEP,
+} Reg_Term;
+
+typedef struct {
+  size_t ops_begin;
+  size_t ops_end;
+  // slots the block touches below and above the frame
+  uint64_t below;
+  uint64_t above;
+  int64_t delta;
+  // bytecode instructions the block covers
+  uint64_t insts;
+  Reg_Term term;
+  int32_t cond;      // jmp_if condition or ret address slot
+  Inst_Addr target;  // jmp/jmp_if target
+  Inst_Addr next;    // fallthrough, or the instruction to step
+} Reg_Block;
+
+// The stack right before an op that can fail: the frame plus `top` words,
+// with the moves in `fault_moves` bringing the pending slots up to date.
+typedef struct {
+  size_t op;
+  size_t moves_begin;
+  size_t moves_end;
+  int64_t top;
+} Reg_Fault;
+
+typedef struct {
+  Reg_Block blocks[LVM_PROGRAM_CAPACITY];
+  size_t blocks_size;
+  Reg_Op ops[REG_OPS_CAPACITY];
+  size_t ops_size;
+  Reg_Fault faults[LVM_PROGRAM_CAPACITY];
+  size_t faults_size;
+  Reg_Op fault_moves[REG_OPS_CAPACITY];
+  size_t fault_moves_size;
+  int64_t block_of[LVM_PROGRAM_CAPACITY];
+  uint64_t translated_insts;
+} Reg_Program;
+
+void lvm_reg_translate(const LVM *lvm, Reg_Program *rp);
+Err lvm_reg_execute_program(LVM *lvm, const Reg_Program *rp, int64_t limit);
+
+typedef struct {
+  bool is_const;
+  int64_t slot;
+  Word k;
+} Reg_Value;
+
+typedef struct {
+  Reg_Value values[LVM_STACK_CAPACITY * 2 + 1];
+  int64_t lo;
+  int64_t top;
+  int64_t scratch;
+  bool failed;
+} Reg_Translator;
+
+static Reg_Value *reg_value(Reg_Translator *t, int64_t pos)
+{
+  assert(pos >= t->lo && pos - t->lo < (int64_t) (sizeof(t->values) / sizeof(t->values[0])));
+  return &t->values[pos - t->lo];
+}
+
+static Reg_Value reg_slot(int64_t slot)
+{
+  return (Reg_Value) {.is_const = false, .slot = slot};
+}
+
+static Reg_Value reg_const(Word k)
+{
+  return (Reg_Value) {.is_const = true, .k = k};
+}
+
+static void reg_emit(Reg_Translator *t, Reg_Program *rp, Reg_Op op)
+{
+  if (rp->ops_size >= REG_OPS_CAPACITY) {
+    t->failed = true;
+    return;
+  }
+  rp->ops[rp->ops_size++] = op;
+}
+
+static int64_t reg_alloc_scratch(Reg_Translator *t)
+{
+  return t->scratch++;
+}
+
+// Physical slot `p` is about to be overwritten: move anything else still
+// reading it into a scratch slot first.
+static void reg_protect(Reg_Translator *t, Reg_Program *rp, int64_t p, Inst_Addr addr)
+{
+  int64_t saved = 0;
+  bool has_saved = false;
+  for (int64_t q = t->lo; q < t->top; ++q) {
+    Reg_Value *v = reg_value(t, q);
+    if (q != p && !v->is_const && v->slot == p) {
+      if (!has_saved) {
+        saved = reg_alloc_scratch(t);
+        has_saved = true;
+        reg_emit(t, rp, (Reg_Op) {.type = REG_MOV, .dst = (int32_t) saved, .a = (int32_t) p, .addr = addr});
+      }
+      v->slot = saved;
+    }
+  }
+}
+
+// Turns a constant into a slot by loading it into `p`.
+static Reg_Value reg_materialize(Reg_Translator *t, Reg_Program *rp, Reg_Value v, int64_t p, Inst_Addr addr)
+{
+  if (v.is_const) {
+    reg_emit(t, rp, (Reg_Op) {.type = REG_MOVK, .dst = (int32_t) p, .k = v.k, .addr = addr});
+    return reg_slot(p);
+  }
+  return v;
+}
+
+static bool reg_is_pending(Reg_Translator *t, int64_t p)
+{
+  if (p < t->lo || p >= t->top) {
+    return false;
+  }
+  Reg_Value *v = reg_value(t, p);
+  return v->is_const || v->slot != p;
+}
+
+// Writes the symbolic stack back to the real slots. This is a parallel
+// move: a slot is only overwritten once nothing pending reads it, and
+// cycles (from swaps) are broken through a scratch slot.
+static void reg_flush(Reg_Translator *t, Reg_Program *rp, Inst_Addr addr)
+{
+  while (!t->failed) {
+    bool pending = false;
+    bool progress = false;
+    for (int64_t p = t->lo; p < t->top; ++p) {
+      Reg_Value *v = reg_value(t, p);
+      if (v->is_const || v->slot == p) {
+        continue;
+      }
+      pending = true;
+
+      bool read = false;
+      for (int64_t q = t->lo; q < t->top && !read; ++q) {
+        Reg_Value *w = reg_value(t, q);
+        read = q != p && !w->is_const && w->slot == p && w->slot != q;
+      }
+
+      if (!read) {
+        reg_emit(t, rp, (Reg_Op) {.type = REG_MOV, .dst = (int32_t) p, .a = (int32_t) v->slot, .addr = addr});
+        *v = reg_slot(p);
+        progress = true;
+      }
+    }
+
+    if (!pending) {
+      break;
+    }
+
+    if (!progress) {
+      // every pending slot is still needed by another move: a cycle
+      for (int64_t p = t->lo; p < t->top; ++p) {
+        if (reg_is_pending(t, p) && !reg_value(t, p)->is_const) {
+          reg_protect(t, rp, p, addr);
+          break;
+        }
+      }
+    }
+  }
+
+  for (int64_t p = t->lo; p < t->top; ++p) {
+    Reg_Value *v = reg_value(t, p);
+    if (v->is_const) {
+      reg_emit(t, rp, (Reg_Op) {.type = REG_MOVK, .dst = (int32_t) p, .k = v->k, .addr = addr});
+      *v = reg_slot(p);
+    }
+  }
+}
+
+// The next op can fail: remember how to write the symbolic stack back.
+static void reg_fault(Reg_Translator *t, Reg_Program *rp)
+{
+  if (rp->faults_size >= LVM_PROGRAM_CAPACITY) {
+    t->failed = true;
+    return;
+  }
+
+  Reg_Fault fault = {
+    .op = rp->ops_size,
+    .moves_begin = rp->fault_moves_size,
+    .top = t->top,
+  };
+  for (int64_t p = t->lo; p < t->top; ++p) {
+    const Reg_Value *v = reg_value(t, p);
+    if (!reg_is_pending(t, p)) {
+      continue;
+    }
+    if (rp->fault_moves_size >= REG_OPS_CAPACITY) {
+      t->failed = true;
+      return;
+    }
+    rp->fault_moves[rp->fault_moves_size++] = v->is_const
+      ? (Reg_Op) {.type = REG_MOVK, .dst = (int32_t) p, .k = v->k}
+      : (Reg_Op) {.type = REG_MOV, .dst = (int32_t) p, .a = (int32_t) v->slot};
+  }
+  fault.moves_end = rp->fault_moves_size;
+  rp->faults[rp->faults_size++] = fault;
+}
+
+// A value the terminator still needs after the flush. If the flush is
+// going to overwrite its slot, copy it out of the way first.
+static Reg_Value reg_keep(Reg_Translator *t, Reg_Program *rp, Reg_Value v, Inst_Addr addr)
+{
+  if (!v.is_const && reg_is_pending(t, v.slot)) {
+    int64_t s = reg_alloc_scratch(t);
+    reg_emit(t, rp, (Reg_Op) {.type = REG_MOV, .dst = (int32_t) s, .a = (int32_t) v.slot, .addr = addr});
+    return reg_slot(s);
+  }
+  return v;
+}
+
+static bool reg_binary_op(Inst_Type type, Reg_Op_Type *output)
+{
+  switch (type) {
+  case INST_PLUSI:  *output = REG_PLUSI;  return true;
+  case INST_MINUSI: *output = REG_MINUSI; return true;
+  case INST_MULTI:  *output = REG_MULTI;  return true;
+  case INST_DIVI:   *output = REG_DIVI;   return true;
+  case INST_PLUSF:  *output = REG_PLUSF;  return true;
+  case INST_MINUSF: *output = REG_MINUSF; return true;
+  case INST_MULTF:  *output = REG_MULTF;  return true;
+  case INST_DIVF:   *output = REG_DIVF;   return true;
+  case INST_EQ:     *output = REG_EQ;     return true;
+  // gef compares the top against the value below it: that's `a <= b`
+  case INST_GEF:    *output = REG_LEF;    return true;
+  case INST_NE:     *output = REG_NE;     return true;
+  case INST_LTI:    *output = REG_LTI;    return true;
+  case INST_LEI:    *output = REG_LEI;    return true;
+  case INST_GTI:    *output = REG_GTI;    return true;
+  case INST_GEI:    *output = REG_GEI;    return true;
+  case INST_LTU:    *output = REG_LTU;    return true;
+  case INST_LEU:    *output = REG_LEU;    return true;
+  case INST_GTU:    *output = REG_GTU;    return true;
+  case INST_GEU:    *output = REG_GEU;    return true;
+  case INST_EQF:    *output = REG_EQF;    return true;
+  case INST_NEF:    *output = REG_NEF;    return true;
+  case INST_LTF:    *output = REG_LTF;    return true;
+  case INST_LEF:    *output = REG_LEF;    return true;
+  case INST_GTF:    *output = REG_GTF;    return true;
+  case INST_ANDB:   *output = REG_ANDB;   return true;
+  case INST_ORB:    *output = REG_ORB;    return true;
+  case INST_XOR:    *output = REG_XOR;    return true;
+  case INST_SHR:    *output = REG_SHR;    return true;
+  case INST_SHL:    *output = REG_SHL;    return true;
+  case INST_NOP:
+  case INST_PUSH:
+  case INST_DROP:
+  case INST_DUP:
+  case INST_SWAP:
+  case INST_JMP:
+  case INST_JMP_IF:
+  case INST_RET:
+  case INST_CALL:
+  case INST_NATIVE:
+  case INST_HALT:
+  case INST_NOT:
+  case INST_NOTB:
+  case INST_READ8:
+  case INST_READ16:
+  case INST_READ32:
+  case INST_READ64:
+  case INST_WRITE8:
+  case INST_WRITE16:
+  case INST_WRITE32:
+  case INST_WRITE64:
+  case INST_PRINT_DEBUG:
+  case INST_JEQ:
+  case INST_JNE:
+  case INST_JLTI:
+  case INST_JLEI:
+  case INST_JGTI:
+  case INST_JGEI:
+  case INST_JLTU:
+  case INST_JLEU:
+  case INST_JGTU:
+  case INST_JGEU:
+  case INST_JLTF:
+  case INST_JLEF:
+  case INST_JGTF:
+  case INST_JGEF:
+  case INST_I2F:
+  case INST_U2F:
+  case INST_F2I:
+  case INST_F2U:
+  case INST_FMAF:
+  case INST_READ16BE:
+  case INST_READ32BE:
+  case INST_READ64BE:
+  case INST_WRITE16BE:
+  case INST_WRITE32BE:
+  case INST_WRITE64BE:
+  case INST_AREAD32:
+  case INST_AREAD64:
+  case INST_AWRITE32:
+  case INST_AWRITE64:
+  case INST_AADD32:
+  case INST_AADD64:
+  case INST_ACAS32:
+  case INST_ACAS64:
+  case INST_FENCE:
+  case INST_PUSH0:
+  case INST_PUSH1:
+  case INST_DUP0:
+  case INST_DUP1:
+  case INST_DUP2:
+  case INST_SWAP1:
+  case INST_SWAP2:
+  case NUMBER_OF_INSTS:
+  default:
+    return false;
+  }
+}
+
+// The comparison a conditional jump branches on.
+static bool reg_cond_jump_op(Inst_Type type, Reg_Op_Type *output)
+{
+  if (type >= INST_JEQ && type <= INST_JGEU) {
+    *output = (Reg_Op_Type) (REG_EQ + 2 * (type - INST_JEQ));
+  } else if (type >= INST_JLTF && type <= INST_JGEF) {
+    *output = (Reg_Op_Type) (REG_LTF + 2 * (type - INST_JLTF));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool reg_unary_op(Inst_Type type, Reg_Op_Type *output)
+{
+  if (type == INST_NOT) {
+    *output = REG_NOT;
+  } else if (type == INST_NOTB) {
+    *output = REG_NOTB;
+  } else if (type >= INST_I2F && type <= INST_F2U) {
+    *output = (Reg_Op_Type) (REG_I2F + (type - INST_I2F));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool reg_memory_op(Inst_Type type, Reg_Op_Type *output)
+{
+  if (type >= INST_READ8 && type <= INST_READ64) {
+    *output = (Reg_Op_Type) (REG_READ8 + (type - INST_READ8));
+    return true;
+  }
+  if (type >= INST_WRITE8 && type <= INST_WRITE64) {
+    *output = (Reg_Op_Type) (REG_WRITE8 + (type - INST_WRITE8));
+    return true;
+  }
+  if (type >= INST_READ16BE && type <= INST_WRITE64BE) {
+    *output = (Reg_Op_Type) (REG_READ16BE + (type - INST_READ16BE));
+    return true;
+  }
+  return false;
+}
+
+// Instructions that stay inside a block.
+static bool reg_is_straight(Inst_Type type)
+{
+  Reg_Op_Type ignore;
+  return type == INST_NOP || type == INST_PUSH || type == INST_DROP
+    || type == INST_DUP || type == INST_SWAP || type == INST_FMAF
+    || reg_unary_op(type, &ignore) || reg_binary_op(type, &ignore)
+    || reg_memory_op(type, &ignore);
+}
+
+static bool reg_is_transfer(Inst_Type type)
+{
+  return type == INST_JMP || type == INST_JMP_IF || type == INST_CALL
+    || type == INST_RET || type == INST_HALT || inst_is_cond_jump(type);
+}
+
+// Lowest slot an instruction reads and the stack depth after it, relative
+// to the current depth.
+static void reg_stack_effect(Inst inst, int64_t *reads, int64_t *delta)
+{
+  Reg_Op_Type ignore;
+  *reads = 0;
+  *delta = 0;
+  if (inst.type == INST_PUSH || inst.type == INST_CALL) {
+    *delta = 1;
+  } else if (inst.type == INST_DUP || inst.type == INST_SWAP) {
+    *reads = inst.operand.as_u64 >= LVM_STACK_CAPACITY
+      ? -LVM_STACK_CAPACITY - 1
+      : -1 - (int64_t) inst.operand.as_u64;
+    *delta = inst.type == INST_DUP ? 1 : 0;
+  } else if (inst.type == INST_DROP || inst.type == INST_JMP_IF || inst.type == INST_RET) {
+    *reads = -1;
+    *delta = -1;
+  } else if (reg_unary_op(inst.type, &ignore)
+             || inst_is_memory_read(inst.type)) {
+    *reads = -1;
+  } else if (reg_binary_op(inst.type, &ignore)) {
+    *reads = -2;
+    *delta = -1;
+  } else if (inst.type == INST_FMAF) {
+    *reads = -3;
+    *delta = -2;
+  } else if (inst_is_cond_jump(inst.type)
+             || inst_is_memory_write(inst.type)) {
+    *reads = -2;
+    *delta = -2;
+  }
+}
+
+static void reg_translate_block(const LVM *lvm, Reg_Program *rp, const bool *leader, Inst_Addr start)
+{
+  static Reg_Translator t;
+
+  // first pass: find the extent of the block and the slots it touches
+  Inst_Addr end = start;
+  int64_t depth = 0;
+  int64_t lo = 0;
+  int64_t hi = 0;
+  while (end < lvm->program_size) {
+    const Inst inst = lvm->program[end];
+    if (!reg_is_straight(inst.type) && !reg_is_transfer(inst.type)) {
+      break;
+    }
+
+    int64_t reads, delta;
+    reg_stack_effect(inst, &reads, &delta);
+    if (depth + reads < lo) {
+      lo = depth + reads;
+    }
+    depth += delta;
+    if (depth > hi) {
+      hi = depth;
+    }
+    end += 1;
+
+    if (reg_is_transfer(inst.type) || (end < lvm->program_size && leader[end])) {
+      break;
+    }
+  }
+
+  if (lo < -LVM_STACK_CAPACITY || hi > LVM_STACK_CAPACITY) {
+    // can never pass the entry check, leave it to the stack interpreter
+    return;
+  }
+
+  memset(&t, 0, sizeof(t));
+  t.lo = lo;
+  t.top = 0;
+  t.scratch = hi;
+  for (int64_t p = lo; p < 0; ++p) {
+    *reg_value(&t, p) = reg_slot(p);
+  }
+
+  Reg_Block block = {
+    .ops_begin = rp->ops_size,
+    .insts = end - start,
+    .term = REG_TERM_FALL,
+    .next = end,
+  };
+  const size_t saved_ops_size = rp->ops_size;
+  const size_t saved_faults_size = rp->faults_size;
+  const size_t saved_fault_moves_size = rp->fault_moves_size;
+
+  for (Inst_Addr i = start; i < end && !t.failed; ++i) {
+    const Inst inst = lvm->program[i];
+    Reg_Op_Type type;
+
+    if (inst.type == INST_NOP) {
+      // nothing
+    } else if (inst.type == INST_PUSH) {
+      *reg_value(&t, t.top++) = reg_const(inst.operand);
+    } else if (inst.type == INST_DROP) {
+      t.top -= 1;
+    } else if (inst.type == INST_DUP) {
+      Reg_Value v = *reg_value(&t, t.top - 1 - (int64_t) inst.operand.as_u64);
+      *reg_value(&t, t.top++) = v;
+    } else if (inst.type == INST_SWAP) {
+      Reg_Value *a = reg_value(&t, t.top - 1);
+      Reg_Value *b = reg_value(&t, t.top - 1 - (int64_t) inst.operand.as_u64);
+      Reg_Value tmp = *a;
+      *a = *b;
+      *b = tmp;
+    } else if (reg_binary_op(inst.type, &type)) {
+      const int64_t dst = t.top - 2;
+      Reg_Value a = *reg_value(&t, dst);
+      Reg_Value b = *reg_value(&t, t.top - 1);
+      Word k = {0};
+      if (a.is_const && b.is_const && inst_fold_binary(inst.type, a.k, b.k, &k)) {
+        *reg_value(&t, dst) = reg_const(k);
+      } else {
+        reg_protect(&t, rp, dst, i);
+        a = reg_materialize(&t, rp, *reg_value(&t, dst), dst, i);
+        b = *reg_value(&t, t.top - 1);
+        if (type == REG_DIVI) {
+          reg_fault(&t, rp);
+        }
+        if (b.is_const) {
+          reg_emit(&t, rp, (Reg_Op) {.type = (Reg_Op_Type) (type + 1), .dst = (int32_t) dst, .a = (int32_t) a.slot, .k = b.k, .addr = i});
+        } else {
+          reg_emit(&t, rp, (Reg_Op) {.type = type, .dst = (int32_t) dst, .a = (int32_t) a.slot, .b = (int32_t) b.slot, .addr = i});
+        }
+        *reg_value(&t, dst) = reg_slot(dst);
+      }
+      t.top -= 1;
+    } else if (reg_unary_op(inst.type, &type)) {
+      const int64_t dst = t.top - 1;
+      Reg_Value a = *reg_value(&t, dst);
+      Word k = {0};
+      if (a.is_const && inst_fold_unary(inst.type, a.k, &k)) {
+        *reg_value(&t, dst) = reg_const(k);
+      } else {
+        reg_protect(&t, rp, dst, i);
+        reg_emit(&t, rp, (Reg_Op) {.type = type, .dst = (int32_t) dst, .a = (int32_t) a.slot, .addr = i});
+        *reg_value(&t, dst) = reg_slot(dst);
+      }
+    } else if (inst.type == INST_FMAF) {
+      const int64_t dst = t.top - 3;
+      Reg_Value a = *reg_value(&t, dst);
+      Reg_Value b = *reg_value(&t, t.top - 2);
+      Reg_Value c = *reg_value(&t, t.top - 1);
+      if (a.is_const && b.is_const && c.is_const) {
+        *reg_value(&t, dst) = reg_const((Word) {.as_f64 = fma(a.k.as_f64, b.k.as_f64, c.k.as_f64)});
+      } else {
+        reg_protect(&t, rp, dst, i);
+        a = reg_materialize(&t, rp, *reg_value(&t, dst), dst, i);
+        b = *reg_value(&t, t.top - 2);
+        c = *reg_value(&t, t.top - 1);
+        if (b.is_const) {
+          b = reg_materialize(&t, rp, b, reg_alloc_scratch(&t), i);
+        }
+        if (c.is_const) {
+          c = reg_materialize(&t, rp, c, reg_alloc_scratch(&t), i);
+        }
+        reg_emit(&t, rp, (Reg_Op) {.type = REG_FMAF, .dst = (int32_t) dst, .a = (int32_t) a.slot, .b = (int32_t) b.slot, .k.as_i64 = c.slot, .addr = i});
+        *reg_value(&t, dst) = reg_slot(dst);
+      }
+      t.top -= 2;
+    } else if (inst_is_memory_read(inst.type)) {
+      const int64_t dst = t.top - 1;
+      reg_memory_op(inst.type, &type);
+      reg_protect(&t, rp, dst, i);
+      Reg_Value a = reg_materialize(&t, rp, *reg_value(&t, dst), dst, i);
+      reg_fault(&t, rp);
+      reg_emit(&t, rp, (Reg_Op) {.type = type, .dst = (int32_t) dst, .a = (int32_t) a.slot, .addr = i});
+      *reg_value(&t, dst) = reg_slot(dst);
+    } else if (inst_is_memory_write(inst.type)) {
+      reg_memory_op(inst.type, &type);
+      Reg_Value a = *reg_value(&t, t.top - 2);
+      Reg_Value b = *reg_value(&t, t.top - 1);
+      if (a.is_const) {
+        a = reg_materialize(&t, rp, a, reg_alloc_scratch(&t), i);
+      }
+      if (b.is_const) {
+        b = reg_materialize(&t, rp, b, reg_alloc_scratch(&t), i);
+      }
+      reg_fault(&t, rp);
+      reg_emit(&t, rp, (Reg_Op) {.type = type, .a = (int32_t) a.slot, .b = (int32_t) b.slot, .addr = i});
+      t.top -= 2;
+    } else if (inst.type == INST_JMP || inst.type == INST_CALL) {
+      if (inst.type == INST_CALL) {
+        *reg_value(&t, t.top++) = reg_const((Word) {.as_u64 = i + 1});
+      }
+      reg_flush(&t, rp, i);
+      block.term = REG_TERM_JMP;
+      block.target = inst.operand.as_u64;
+    } else if (inst.type == INST_JMP_IF || inst.type == INST_RET) {
+      Reg_Value v = *reg_value(&t, t.top - 1);
+      t.top -= 1;
+      v = reg_keep(&t, rp, v, i);
+      reg_flush(&t, rp, i);
+      if (v.is_const && inst.type == INST_JMP_IF) {
+        block.term = v.k.as_u64 ? REG_TERM_JMP : REG_TERM_FALL;
+        block.target = inst.operand.as_u64;
+      } else if (v.is_const) {
+        block.term = REG_TERM_JMP;
+        block.target = v.k.as_u64;
+      } else {
+        block.term = inst.type == INST_JMP_IF ? REG_TERM_JMP_IF : REG_TERM_RET;
+        block.cond = (int32_t) v.slot;
+        block.target = inst.operand.as_u64;
+      }
+    } else if (reg_cond_jump_op(inst.type, &type)) {
+      Reg_Value a = *reg_value(&t, t.top - 2);
+      Reg_Value b = *reg_value(&t, t.top - 1);
+      t.top -= 2;
+      Word k = {0};
+      if (a.is_const && b.is_const) {
+        inst_fold_binary(inst.type, a.k, b.k, &k);
+        reg_flush(&t, rp, i);
+        block.term = k.as_u64 ? REG_TERM_JMP : REG_TERM_FALL;
+      } else {
+        // the condition goes to a scratch slot, which the flush never touches
+        const int64_t cond = reg_alloc_scratch(&t);
+        a = reg_materialize(&t, rp, a, cond, i);
+        if (b.is_const) {
+          reg_emit(&t, rp, (Reg_Op) {.type = (Reg_Op_Type) (type + 1), .dst = (int32_t) cond, .a = (int32_t) a.slot, .k = b.k, .addr = i});
+        } else {
+          reg_emit(&t, rp, (Reg_Op) {.type = type, .dst = (int32_t) cond, .a = (int32_t) a.slot, .b = (int32_t) b.slot, .addr = i});
+        }
+        reg_flush(&t, rp, i);
+        block.term = REG_TERM_JMP_IF;
+        block.cond = (int32_t) cond;
+      }
+      block.target = inst.operand.as_u64;
+    } else if (inst.type == INST_HALT) {
+      reg_flush(&t, rp, i);
+      block.term = REG_TERM_HALT;
+      block.next = i;
+    } else {
+      assert(false && "reg_translate_block: unreachable");
+    }
+  }
+
+  if (block.term == REG_TERM_FALL && (end == start || !reg_is_transfer(lvm->program[end - 1].type))) {
+    reg_flush(&t, rp, end);
+    if (end < lvm->program_size && (end == start || !leader[end])) {
+      // the block stopped at something it can't translate: step over it
+      block.term = REG_TERM_STEP;
+      block.insts += 1;
+    }
+  }
+
+  if (t.failed) {
+    rp->ops_size = saved_ops_size;
+    rp->faults_size = saved_faults_size;
+    rp->fault_moves_size = saved_fault_moves_size;
+    return;
+  }
+
+  block.ops_end = rp->ops_size;
+  block.below = (uint64_t) -lo;
+  block.above = (uint64_t) t.scratch;
+  block.delta = t.top;
+
+  rp->block_of[start] = (int64_t) rp->blocks_size;
+  rp->blocks[rp->blocks_size++] = block;
+  rp->translated_insts += block.insts;
+}
+
+void lvm_reg_translate(const LVM *lvm, Reg_Program *rp)
+{
+  static bool leader[LVM_PROGRAM_CAPACITY];
+
+  memset(leader, 0, sizeof(leader));
+  rp->blocks_size = 0;
+  rp->ops_size = 0;
+  rp->faults_size = 0;
+  rp->fault_moves_size = 0;
+  rp->translated_insts = 0;
+
+  if (lvm->program_size > 0) {
+    leader[0] = true;
+  }
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    const Inst inst = lvm->program[i];
+    if ((inst.type == INST_JMP || inst.type == INST_JMP_IF || inst.type == INST_CALL
+         || inst_is_cond_jump(inst.type))
+        && inst.operand.as_u64 < lvm->program_size) {
+      leader[inst.operand.as_u64] = true;
+    }
+    if (!reg_is_straight(inst.type) && i + 1 < lvm->program_size) {
+      leader[i + 1] = true;
+    }
+  }
+
+  for (Inst_Addr i = 0; i < LVM_PROGRAM_CAPACITY; ++i) {
+    rp->block_of[i] = REG_NO_BLOCK;
+  }
+
+  for (Inst_Addr i = 0; i < lvm->program_size; ++i) {
+    if (leader[i]) {
+      reg_translate_block(lvm, rp, leader, i);
+    }
+  }
+}
+
+#define REG_BINARY_U64(name, op)                                        \
+  case name:        fp[o->dst].as_u64 = fp[o->a].as_u64 op fp[o->b].as_u64; break; \
+  case name ## _K:  fp[o->dst].as_u64 = fp[o->a].as_u64 op o->k.as_u64;    break;
+
+#define REG_BINARY_F64(name, op)                                        \
+  case name:        fp[o->dst].as_f64 = fp[o->a].as_f64 op fp[o->b].as_f64; break; \
+  case name ## _K:  fp[o->dst].as_f64 = fp[o->a].as_f64 op o->k.as_f64;    break;
+
+#define REG_COMPARE(name, as, op)                                       \
+  case name:        fp[o->dst].as_u64 = fp[o->a].as op fp[o->b].as; break; \
+  case name ## _K:  fp[o->dst].as_u64 = fp[o->a].as op o->k.as;    break;
+
+// Op `op` of the block whose frame is at `sp` failed: put the stack back
+// the way the stack interpreter leaves it for the same error.
+static Err lvm_reg_fail(LVM *lvm, const Reg_Program *rp, size_t op, uint64_t sp, Err err)
+{
+  size_t lo = 0;
+  size_t hi = rp->faults_size;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (rp->faults[mid].op < op) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  assert(lo < rp->faults_size && rp->faults[lo].op == op);
+  const Reg_Fault *fault = &rp->faults[lo];
+
+  // a parallel move: read every source before writing any slot
+  Word *fp = &lvm->stack[sp];
+  Word values[LVM_STACK_CAPACITY * 2 + 1];
+  for (size_t i = fault->moves_begin; i < fault->moves_end; ++i) {
+    const Reg_Op *move = &rp->fault_moves[i];
+    values[i - fault->moves_begin] = move->type == REG_MOVK ? move->k : fp[move->a];
+  }
+  for (size_t i = fault->moves_begin; i < fault->moves_end; ++i) {
+    fp[rp->fault_moves[i].dst] = values[i - fault->moves_begin];
+  }
+
+  lvm->stack_size = (uint64_t) ((int64_t) sp + fault->top);
+  lvm->pc = rp->ops[op].addr;
+  return err;
+}
+
+static Err lvm_reg_run(LVM *lvm, const Reg_Program *rp)
+{
+  while (!lvm->halt) {
+    const int64_t index = lvm->pc < lvm->program_size ? rp->block_of[lvm->pc] : REG_NO_BLOCK;
+    const Reg_Block *block = index == REG_NO_BLOCK ? NULL : &rp->blocks[index];
+    const uint64_t sp = lvm->stack_size;
+    const Inst_Addr start = lvm->pc;
+
+    if (block == NULL
+        || sp < block->below
+        || sp + block->above > LVM_STACK_CAPACITY) {
+      Err err = lvm_execute_inst(lvm);
+      if (err != ERR_OK) {
+        return err;
+      }
+      continue;
+    }
+
+    Word *fp = &lvm->stack[sp];
+    for (size_t i = block->ops_begin; i < block->ops_end; ++i) {
+      const Reg_Op *o = &rp->ops[i];
+      switch (o->type) {
+      case REG_MOV:  fp[o->dst] = fp[o->a]; break;
+      case REG_MOVK: fp[o->dst] = o->k;     break;
+
+      REG_BINARY_U64(REG_PLUSI,  +)
+      REG_BINARY_U64(REG_MINUSI, -)
+      REG_BINARY_U64(REG_MULTI,  *)
+      REG_BINARY_F64(REG_PLUSF,  +)
+      REG_BINARY_F64(REG_MINUSF, -)
+      REG_BINARY_F64(REG_MULTF,  *)
+      REG_BINARY_F64(REG_DIVF,   /)
+      REG_BINARY_U64(REG_ANDB,   &)
+      REG_BINARY_U64(REG_ORB,    |)
+      REG_BINARY_U64(REG_XOR,    ^)
+      REG_BINARY_U64(REG_SHR,    >>)
+      REG_BINARY_U64(REG_SHL,    <<)
+
+      case REG_DIVI:
+      case REG_DIVI_K: {
+        const uint64_t b = o->type == REG_DIVI ? fp[o->b].as_u64 : o->k.as_u64;
+        if (b == 0) {
+          return lvm_reg_fail(lvm, rp, i, sp, ERR_DIV_BY_ZERO);
+        }
+        fp[o->dst].as_u64 = fp[o->a].as_u64 / b;
+      } break;
+
+      REG_COMPARE(REG_EQ,  as_u64, ==)
+      REG_COMPARE(REG_NE,  as_u64, !=)
+      REG_COMPARE(REG_LTI, as_i64, <)
+      REG_COMPARE(REG_LEI, as_i64, <=)
+      REG_COMPARE(REG_GTI, as_i64, >)
+      REG_COMPARE(REG_GEI, as_i64, >=)
+      REG_COMPARE(REG_LTU, as_u64, <)
+      REG_COMPARE(REG_LEU, as_u64, <=)
+      REG_COMPARE(REG_GTU, as_u64, >)
+      REG_COMPARE(REG_GEU, as_u64, >=)
+      REG_COMPARE(REG_EQF, as_f64, ==)
+      REG_COMPARE(REG_NEF, as_f64, !=)
+      REG_COMPARE(REG_LTF, as_f64, <)
+      REG_COMPARE(REG_LEF, as_f64, <=)
+      REG_COMPARE(REG_GTF, as_f64, >)
+      REG_COMPARE(REG_GEF, as_f64, >=)
+
+      case REG_NOT:  fp[o->dst].as_u64 = !fp[o->a].as_u64; break;
+      case REG_NOTB: fp[o->dst].as_u64 = ~fp[o->a].as_u64; break;
+      case REG_I2F:  fp[o->dst].as_f64 = (double) fp[o->a].as_i64; break;
+      case REG_U2F:  fp[o->dst].as_f64 = (double) fp[o->a].as_u64; break;
+      case REG_F2I:  fp[o->dst].as_i64 = lvm_f64_to_i64(fp[o->a].as_f64); break;
+      case REG_F2U:  fp[o->dst].as_u64 = lvm_f64_to_u64(fp[o->a].as_f64); break;
+      case REG_FMAF:
+        fp[o->dst].as_f64 = fma(fp[o->a].as_f64, fp[o->b].as_f64, fp[o->k.as_i64].as_f64);
+        break;
+
+      case REG_READ8:
+      case REG_READ16:
+      case REG_READ32:
+      case REG_READ64:
+      case REG_READ16BE:
+      case REG_READ32BE:
+      case REG_READ64BE: {
+        const bool be = o->type >= REG_READ16BE;
+        const size_t size = be ? 2ull << (o->type - REG_READ16BE) : 1ull << (o->type - REG_READ8);
+        uint64_t value = 0;
+        const Err err = lvm_memory_load(lvm, fp[o->a].as_u64, size, be, &value);
+        if (err != ERR_OK) {
+          return lvm_reg_fail(lvm, rp, i, sp, err);
+        }
+        fp[o->dst].as_u64 = value;
+      } break;
+
+      case REG_WRITE8:
+      case REG_WRITE16:
+      case REG_WRITE32:
+      case REG_WRITE64:
+      case REG_WRITE16BE:
+      case REG_WRITE32BE:
+      case REG_WRITE64BE: {
+        const bool be = o->type >= REG_WRITE16BE;
+        const size_t size = be ? 2ull << (o->type - REG_WRITE16BE) : 1ull << (o->type - REG_WRITE8);
+        const Err err = lvm_memory_store(lvm, fp[o->a].as_u64, size, be, fp[o->b].as_u64);
+        if (err != ERR_OK) {
+          return lvm_reg_fail(lvm, rp, i, sp, err);
+        }
+      } break;
+
+      default:
+        assert(false && "lvm_reg_execute_program: unreachable");
+      }
+    }
+
+    const Word cond = block->term == REG_TERM_JMP_IF || block->term == REG_TERM_RET
+      ? fp[block->cond]
+      : (Word) {0};
+    lvm->stack_size = (uint64_t) ((int64_t) sp + block->delta);
+
+    switch (block->term) {
+    case REG_TERM_FALL:
+      lvm->pc = block->next;
+      break;
+    case REG_TERM_JMP:
+      lvm->pc = block->target;
+      break;
+    case REG_TERM_JMP_IF:
+      lvm->pc = cond.as_u64 ? block->target : block->next;
+      break;
+    case REG_TERM_RET:
+      lvm->pc = cond.as_u64;
+      break;
+    case REG_TERM_HALT:
+      lvm->pc = block->next;
+      lvm->halt = 1;
+      break;
+    case REG_TERM_STEP: {
+      lvm->pc = block->next;
+      Err err = lvm_execute_inst(lvm);
+      if (err != ERR_OK) {
+        return err;
+      }
+    } break;
+    default:
+      assert(false && "lvm_reg_execute_program: unreachable");
+    }
+
+    if (block->term != REG_TERM_FALL && block->term != REG_TERM_STEP) {
+      const Inst_Addr last = start + block->insts - 1;
+      if (lvm->pc != last + 1) {
+        if (lvm->trace != NULL) {
+          lvm_trace_record(lvm, last, lvm->program[last].type | LVM_TRACE_BLOCK);
+        }
+        const Err err = lvm_transfer(lvm, last, lvm->program[last].type);
+        if (err != ERR_OK) {
+          return err;
+        }
+      }
+    }
+  }
+
+  return ERR_OK;
+}
+
+// Fuel is charged and checked exactly like on the stack interpreter, so
+// both stop at the same back-edge.
+Err lvm_reg_execute_program(LVM *lvm, const Reg_Program *rp, int64_t limit)
+{
+  if (limit == 0) {
+    return ERR_OK;
+  }
+
+  lvm_fuel_begin(lvm, limit);
+  return lvm_fuel_end(lvm, lvm_reg_run(lvm, rp));
+}
+
+#endif
@@ -0,0 +1,644 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include "./lvm.h"
+#include "./lvm_reg.h"
+#include "./lvm_io.h"
+#include "./lvm_parallel.h"
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// lvm daemon: runs jobs sent over a Unix domain socket, so that a job costs
+// a round trip instead of starting a process and loading the program.
+//
+// A job is an Lvmd_Request followed by `image_size` bytes of a .lvm file.
+// The answer is an Lvmd_Response followed by `output_size` bytes of what
+// the program printed and `stack_size` words of its final stack. A
+// connection carries any number of jobs, one after the other, in host byte
+// order.
+//
+// Images are cached by a hash of their bytes: the first job loads, links
+// and quickens one, and the first job on the register engine translates
+// it. Every worker thread serves one connection at a time with a VM of its
+// own, forked from the image the first time it runs it. After a job the VM
+// is lvm_reset() back to the image, which only puts back the pages the job
+// wrote to, so jobs on the same image cost what they do, not what the
+// memory is.
+//
+// Natives behave as in lvm outside of the scheduler: io_* natives block the
+// worker, spawn fails and parallel_for runs its chunks on the worker.
+// `lvmd -c` is the client.
+
+#define LVMD_MAGIC 0x444D564C // "LVMD"
+// the register engine instead of the stack interpreter
+#define LVMD_REG 1
+#define LVMD_IMAGE_CAPACITY (1024 * 1024)
+// more than the workers can hold at once, so one can always be evicted
+#define LVMD_IMAGES_CAPACITY (2 * LVM_PARALLEL_THREADS_CAPACITY)
+#define LVMD_BACKLOG 64
+
+typedef struct {
+  uint32_t magic;
+  uint32_t flags;
+  // negative for no limit
+  int64_t limit;
+  uint64_t image_size;
+} Lvmd_Request;
+
+typedef enum {
+  LVMD_RAN = 0,
+  LVMD_BAD_REQUEST,
+  LVMD_BAD_IMAGE,
+} Lvmd_Status;
+
+// Unless the job ran, the output is the reason why not.
+typedef struct {
+  uint32_t magic;
+  uint32_t status;
+  uint32_t err;
+  uint32_t reserved;
+  uint64_t output_size;
+  uint64_t stack_size;
+} Lvmd_Response;
+
+typedef struct {
+  // unique, unlike the address, which a new image may get again
+  uint64_t id;
+  uint64_t hash;
+  uint8_t *bytes;
+  uint64_t size;
+  // loaded and linked, the program as it comes from the file
+  LVM *vm;
+  Inst quickened[LVM_PROGRAM_CAPACITY];
+  // NULL until a job asks for the register engine
+  Reg_Program *rp;
+  size_t users;
+  uint64_t last_used;
+} Lvmd_Image;
+
+typedef struct {
+  Lvmd_Image *images[LVMD_IMAGES_CAPACITY];
+  size_t images_size;
+  uint64_t clock;
+  uint64_t images_loaded;
+  // also serializes lvm_reg_translate, which is not reentrant
+  pthread_mutex_t lock;
+} Lvmd_Cache;
+
+typedef struct {
+  pthread_t thread;
+  // forked from the image `image_id`, 0 for none, with the program for the
+  // register engine if `reg`
+  LVM *vm;
+  uint64_t image_id;
+  bool reg;
+  LVM_Output output;
+  // what does not fit into `output` before the job is over
+  int spill_fd;
+  uint8_t *image;
+} Lvmd_Worker;
+
+LVM_Native_Table natives = {0};
+Lvmd_Cache cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+int listener = -1;
+
+char *shift(int *argc, char ***argv);
+void usage(FILE *stream, const char *program);
+
+char *shift(int *argc, char ***argv)
+{
+  assert(*argc > 0);
+  char *result = **argv;
+  *argv += 1;
+  *argc -= 1;
+  return result;
+}
+
+void usage(FILE *stream, const char *program)
+{
+  fprintf(stream, "Usage: %s [-t <threads>] <socket>\n", program);
+  fprintf(stream, "       %s -c <socket> -i <input.lvm> [-l <limit>] [--reg] [--stack] [-n <jobs>]\n", program);
+  fprintf(stream, "  -t       worker threads, one per CPU by default\n");
+  fprintf(stream, "  -c       send a job to the daemon listening on the socket and print its output\n");
+  fprintf(stream, "  --reg    run the job on the register engine\n");
+  fprintf(stream, "  --stack  print the final stack\n");
+  fprintf(stream, "  -n       send the job this many times and report the time per job\n");
+}
+
+static bool lvmd_read_all(int fd, void *data, size_t size)
+{
+  uint8_t *bytes = data;
+  while (size > 0) {
+    const ssize_t n = read(fd, bytes, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    bytes += n;
+    size -= (size_t) n;
+  }
+  return true;
+}
+
+static bool lvmd_write_all(int fd, const void *data, size_t size)
+{
+  const uint8_t *bytes = data;
+  while (size > 0) {
+    const ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    bytes += n;
+    size -= (size_t) n;
+  }
+  return true;
+}
+
+static uint64_t lvmd_hash(const uint8_t *bytes, uint64_t size)
+{
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (uint64_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static void lvmd_image_free(Lvmd_Image *image)
+{
+  if (image->vm != NULL) {
+    lvm_memory_release(image->vm);
+  }
+  free(image->vm);
+  free(image->rp);
+  free(image->bytes);
+  free(image);
+}
+
+// NULL with the reason in `error` if the bytes are not a program that
+// can run here.
+static Lvmd_Image *lvmd_image_load(const uint8_t *bytes, uint64_t size, uint64_t hash,
+                                   char *error, size_t error_size)
+{
+  if (size == 0) {
+    snprintf(error, error_size, "the image is empty");
+    return NULL;
+  }
+
+  Lvmd_Image *image = calloc(1, sizeof(Lvmd_Image));
+  assert(image != NULL);
+  image->hash = hash;
+  image->size = size;
+  image->bytes = malloc(size);
+  image->vm = calloc(1, sizeof(LVM));
+  assert(image->bytes != NULL && image->vm != NULL);
+  memcpy(image->bytes, bytes, size);
+
+  FILE *f = fmemopen(image->bytes, size, "rb");
+  if (f == NULL) {
+    snprintf(error, error_size, "Could not open the image: %s", strerror(errno));
+    lvmd_image_free(image);
+    return NULL;
+  }
+  const bool loaded = lvm_read_program(image->vm, f, "<image>", error, error_size);
+  fclose(f);
+  if (!loaded) {
+    lvmd_image_free(image);
+    return NULL;
+  }
+
+  const char *missing = lvm_try_link_natives(image->vm, &natives);
+  if (missing != NULL) {
+    snprintf(error, error_size, "unknown native `%s`", missing);
+    lvmd_image_free(image);
+    return NULL;
+  }
+
+  for (Inst_Addr i = 0; i < image->vm->program_size; ++i) {
+    image->quickened[i] = inst_quicken(image->vm->program[i]);
+  }
+  return image;
+}
+
+// Called with the cache locked.
+static void lvmd_image_translate(Lvmd_Image *image)
+{
+  if (image->rp == NULL) {
+    image->rp = malloc(sizeof(Reg_Program));
+    assert(image->rp != NULL);
+    lvm_reg_translate(image->vm, image->rp);
+  }
+}
+
+// The cached image of these bytes, loading it if need be. Give it back
+// with lvmd_image_put().
+static Lvmd_Image *lvmd_image_get(const uint8_t *bytes, uint64_t size, bool reg,
+                                  char *error, size_t error_size)
+{
+  const uint64_t hash = lvmd_hash(bytes, size);
+
+  pthread_mutex_lock(&cache.lock);
+  for (size_t i = 0; i < cache.images_size; ++i) {
+    Lvmd_Image *image = cache.images[i];
+    if (image->hash == hash && image->size == size && memcmp(image->bytes, bytes, size) == 0) {
+      image->users += 1;
+      image->last_used = ++cache.clock;
+      if (reg) {
+        lvmd_image_translate(image);
+      }
+      pthread_mutex_unlock(&cache.lock);
+      return image;
+    }
+  }
+  pthread_mutex_unlock(&cache.lock);
+
+  // loading doesn't need the lock, but two workers may load the same image
+  Lvmd_Image *image = lvmd_image_load(bytes, size, hash, error, error_size);
+  if (image == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache.lock);
+  size_t slot = cache.images_size;
+  if (cache.images_size < LVMD_IMAGES_CAPACITY) {
+    cache.images_size += 1;
+  } else {
+    for (size_t i = 0; i < cache.images_size; ++i) {
+      const Lvmd_Image *old = cache.images[i];
+      if (old->users == 0 && (slot == cache.images_size || old->last_used < cache.images[slot]->last_used)) {
+        slot = i;
+      }
+    }
+    assert(slot < cache.images_size);
+    lvmd_image_free(cache.images[slot]);
+  }
+  cache.images[slot] = image;
+  image->id = ++cache.images_loaded;
+  image->users = 1;
+  image->last_used = ++cache.clock;
+  if (reg) {
+    lvmd_image_translate(image);
+  }
+  pthread_mutex_unlock(&cache.lock);
+  return image;
+}
+
+static void lvmd_image_put(Lvmd_Image *image)
+{
+  pthread_mutex_lock(&cache.lock);
+  image->users -= 1;
+  pthread_mutex_unlock(&cache.lock);
+}
+
+// Makes the worker's VM the image as it was just loaded. It already is
+// unless the last job of the worker ran another image or engine.
+static void lvmd_prepare(Lvmd_Worker *worker, const Lvmd_Image *image, bool reg)
+{
+  LVM *vm = worker->vm;
+  if (worker->image_id != image->id) {
+    lvm_memory_release(vm);
+    lvm_fork(vm, image->vm);
+    worker->image_id = image->id;
+    worker->reg = true;
+  }
+  if (worker->reg != reg) {
+    memcpy(vm->program, reg ? image->vm->program : image->quickened,
+           sizeof(vm->program[0]) * vm->program_size);
+    worker->reg = reg;
+  }
+
+  vm->trace = NULL;
+  vm->output = &worker->output;
+  worker->output.size = 0;
+}
+
+static void lvmd_cleanup(Lvmd_Worker *worker, const Lvmd_Image *image)
+{
+  lvm_reset(worker->vm, image->vm);
+  if (lseek(worker->spill_fd, 0, SEEK_SET) < 0 || ftruncate(worker->spill_fd, 0) < 0) {
+    fprintf(stderr, "ERROR: Could not reset the output of a job: %s\n", strerror(errno));
+    exit(1);
+  }
+}
+
+static bool lvmd_respond(int fd, Lvmd_Status status, Err err, const void *output, size_t output_size,
+                         const Word *stack, size_t stack_size)
+{
+  const Lvmd_Response response = {
+    .magic = LVMD_MAGIC,
+    .status = status,
+    .err = (uint32_t) err,
+    .output_size = output_size,
+    .stack_size = stack_size,
+  };
+  return lvmd_write_all(fd, &response, sizeof(response))
+    && lvmd_write_all(fd, output, output_size)
+    && lvmd_write_all(fd, stack, sizeof(stack[0]) * stack_size);
+}
+
+static bool lvmd_refuse(int fd, Lvmd_Status status, const char *reason)
+{
+  return lvmd_respond(fd, status, ERR_OK, reason, strlen(reason), NULL, 0);
+}
+
+// Output that went to the spill file goes out first, then the buffer.
+static bool lvmd_send_result(int fd, Lvmd_Worker *worker, Err err)
+{
+  const off_t spilled = lseek(worker->spill_fd, 0, SEEK_CUR);
+  if (spilled < 0) {
+    return false;
+  }
+
+  const Lvmd_Response response = {
+    .magic = LVMD_MAGIC,
+    .status = LVMD_RAN,
+    .err = (uint32_t) err,
+    .output_size = (uint64_t) spilled + worker->output.size,
+    .stack_size = worker->vm->stack_size,
+  };
+  if (!lvmd_write_all(fd, &response, sizeof(response))) {
+    return false;
+  }
+
+  char chunk[LVM_IO_CHUNK];
+  for (off_t offset = 0; offset < spilled;) {
+    const ssize_t n = pread(worker->spill_fd, chunk, sizeof(chunk), offset);
+    if (n <= 0 || !lvmd_write_all(fd, chunk, (size_t) n)) {
+      return false;
+    }
+    offset += n;
+  }
+  return lvmd_write_all(fd, worker->output.bytes, worker->output.size)
+    && lvmd_write_all(fd, worker->vm->stack, sizeof(Word) * worker->vm->stack_size);
+}
+
+// Serves jobs from `fd` until the client is done or breaks the protocol.
+static void lvmd_serve(Lvmd_Worker *worker, int fd)
+{
+  Lvmd_Request request;
+  while (lvmd_read_all(fd, &request, sizeof(request))) {
+    if (request.magic != LVMD_MAGIC || request.image_size > LVMD_IMAGE_CAPACITY) {
+      lvmd_refuse(fd, LVMD_BAD_REQUEST, "not an lvmd request or the image is too big");
+      break;
+    }
+    if (!lvmd_read_all(fd, worker->image, request.image_size)) {
+      break;
+    }
+
+    const bool reg = (request.flags & LVMD_REG) != 0;
+    char error[LVM_FORMAT_CAPACITY];
+    Lvmd_Image *image = lvmd_image_get(worker->image, request.image_size, reg, error, sizeof(error));
+    if (image == NULL) {
+      if (!lvmd_refuse(fd, LVMD_BAD_IMAGE, error)) {
+        break;
+      }
+      continue;
+    }
+
+    lvmd_prepare(worker, image, reg);
+    Err err = reg
+      ? lvm_reg_execute_program(worker->vm, image->rp, request.limit)
+      : lvm_execute_program(worker->vm, request.limit);
+
+    const bool sent = lvmd_send_result(fd, worker, err);
+    lvmd_cleanup(worker, image);
+    lvmd_image_put(image);
+    if (!sent) {
+      break;
+    }
+  }
+  close(fd);
+}
+
+static void *lvmd_worker(void *arg)
+{
+  Lvmd_Worker *worker = arg;
+  // parallel_for runs its chunks right here: jobs are what runs in parallel
+  lvm_parallel_in_worker = true;
+
+  for (;;) {
+    const int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        fprintf(stderr, "ERROR: Could not accept a connection: %s\n", strerror(errno));
+      }
+      continue;
+    }
+    lvmd_serve(worker, fd);
+  }
+  return NULL;
+}
+
+static Lvmd_Worker *lvmd_worker_new(void)
+{
+  Lvmd_Worker *worker = calloc(1, sizeof(Lvmd_Worker));
+  assert(worker != NULL);
+  worker->vm = calloc(1, sizeof(LVM));
+  worker->image = malloc(LVMD_IMAGE_CAPACITY);
+  assert(worker->vm != NULL && worker->image != NULL);
+
+  FILE *spill = tmpfile();
+  if (spill == NULL) {
+    fprintf(stderr, "ERROR: Could not create a file for the output of jobs: %s\n", strerror(errno));
+    exit(1);
+  }
+  worker->spill_fd = fileno(spill);
+  worker->output.fd = worker->spill_fd;
+  return worker;
+}
+
+static int lvmd_socket(const char *socket_path, struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "ERROR: socket path `%s` is too long\n", socket_path);
+    exit(1);
+  }
+  strcpy(addr->sun_path, socket_path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not create a socket: %s\n", strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+static void lvmd_listen(const char *socket_path, size_t threads_size)
+{
+  struct sockaddr_un addr;
+  listener = lvmd_socket(socket_path, &addr);
+  unlink(socket_path);
+  if (bind(listener, (const struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listener, LVMD_BACKLOG) < 0) {
+    fprintf(stderr, "ERROR: Could not listen on `%s`: %s\n", socket_path, strerror(errno));
+    exit(1);
+  }
+
+  if (threads_size == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads_size = cpus > 0 ? (size_t) cpus : 1;
+  }
+  if (threads_size > LVM_PARALLEL_THREADS_CAPACITY) {
+    threads_size = LVM_PARALLEL_THREADS_CAPACITY;
+  }
+
+  for (size_t i = 1; i < threads_size; ++i) {
+    Lvmd_Worker *worker = lvmd_worker_new();
+    const int error = pthread_create(&worker->thread, NULL, lvmd_worker, worker);
+    if (error != 0) {
+      fprintf(stderr, "ERROR: Could not start a worker thread: %s\n", strerror(error));
+      exit(1);
+    }
+  }
+  fprintf(stderr, "INFO: listening on `%s` with %zu workers\n", socket_path, threads_size);
+  lvmd_worker(lvmd_worker_new());
+}
+
+static double lvmd_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static int lvmd_client(const char *socket_path, const char *input_file_path, int64_t limit,
+                       bool reg, bool print_stack, long jobs)
+{
+  uint8_t *image = malloc(LVMD_IMAGE_CAPACITY);
+  assert(image != NULL);
+  FILE *f = fopen(input_file_path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not open file `%s`: %s\n", input_file_path, strerror(errno));
+    exit(1);
+  }
+  const size_t image_size = fread(image, 1, LVMD_IMAGE_CAPACITY, f);
+  if (ferror(f) || !feof(f)) {
+    fprintf(stderr, "ERROR: Could not read `%s` or it is bigger than %d bytes\n",
+            input_file_path, LVMD_IMAGE_CAPACITY);
+    exit(1);
+  }
+  fclose(f);
+
+  struct sockaddr_un addr;
+  const int fd = lvmd_socket(socket_path, &addr);
+  if (connect(fd, (const struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "ERROR: Could not connect to `%s`: %s\n", socket_path, strerror(errno));
+    exit(1);
+  }
+
+  const Lvmd_Request request = {
+    .magic = LVMD_MAGIC,
+    .flags = reg ? LVMD_REG : 0,
+    .limit = limit,
+    .image_size = image_size,
+  };
+  Lvmd_Response response = {0};
+  char *output = NULL;
+  const double start = lvmd_now();
+  for (long i = 0; i < jobs; ++i) {
+    if (!lvmd_write_all(fd, &request, sizeof(request)) || !lvmd_write_all(fd, image, image_size)
+        || !lvmd_read_all(fd, &response, sizeof(response)) || response.magic != LVMD_MAGIC
+        || response.stack_size > LVM_STACK_CAPACITY) {
+      fprintf(stderr, "ERROR: the connection to `%s` broke\n", socket_path);
+      exit(1);
+    }
+
+    free(output);
+    output = malloc(response.output_size + 1);
+    assert(output != NULL);
+    if (!lvmd_read_all(fd, output, response.output_size)
+        || !lvmd_read_all(fd, lvm.stack, sizeof(Word) * response.stack_size)) {
+      fprintf(stderr, "ERROR: the connection to `%s` broke\n", socket_path);
+      exit(1);
+    }
+    if (response.status != LVMD_RAN) {
+      fprintf(stderr, "ERROR: %.*s\n", (int) response.output_size, output);
+      exit(1);
+    }
+  }
+  const double secs = lvmd_now() - start;
+  close(fd);
+
+  fwrite(output, 1, response.output_size, stdout);
+  lvm.stack_size = response.stack_size;
+  if (print_stack) {
+    lvm_dump_stack(stdout, &lvm);
+  }
+  if (jobs > 1) {
+    fprintf(stderr, "INFO: %ld jobs, %.1f us per job\n", jobs, secs / (double) jobs * 1e6);
+  }
+  if (response.err != ERR_OK) {
+    fprintf(stderr, "ERROR: %s\n", err_as_cstr((Err) response.err));
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *program = shift(&argc, &argv);
+  const char *socket_path = NULL;
+  const char *input_file_path = NULL;
+  bool client = false;
+  bool reg = false;
+  bool print_stack = false;
+  int64_t limit = -1;
+  long jobs = 1;
+  size_t threads_size = 0;
+
+  while (argc > 0) {
+    const char *flag = shift(&argc, &argv);
+    if (strcmp(flag, "-c") == 0 || strcmp(flag, "-i") == 0 || strcmp(flag, "-l") == 0
+        || strcmp(flag, "-n") == 0 || strcmp(flag, "-t") == 0) {
+      if (argc == 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+        exit(1);
+      }
+      const char *value = shift(&argc, &argv);
+      switch (flag[1]) {
+      case 'c': client = true; socket_path = value; break;
+      case 'i': input_file_path = value; break;
+      case 'l': limit = strtoll(value, NULL, 10); break;
+      case 'n': jobs = atol(value); break;
+      default:  threads_size = (size_t) atoi(value); break;
+      }
+    } else if (strcmp(flag, "--reg") == 0) {
+      reg = true;
+    } else if (strcmp(flag, "--stack") == 0) {
+      print_stack = true;
+    } else if (strcmp(flag, "-h") == 0) {
+      usage(stdout, program);
+      exit(0);
+    } else if (*flag == '-' || socket_path != NULL) {
+      usage(stderr, program);
+      fprintf(stderr, "ERROR: Unknown flag `%s`\n", flag);
+      exit(1);
+    } else {
+      socket_path = flag;
+    }
+  }
+
+  if (socket_path == NULL || (client && input_file_path == NULL) || jobs < 1) {
+    usage(stderr, program);
+    fprintf(stderr, "ERROR: %s was not provided\n", socket_path == NULL ? "socket" : "input");
+    exit(1);
+  }
+
+  if (client) {
+    return lvmd_client(socket_path, input_file_path, limit, reg, print_stack, jobs);
+  }
+
+  lvm_register_builtin_natives(&natives);
+  lvm_io_register_natives(&natives);
+  lvm_parallel_register_natives(&natives);
+  lvmd_listen(socket_path, threads_size);
+  return 0;
+}